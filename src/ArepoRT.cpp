@@ -42,6 +42,9 @@ void rtRenderFrames()
   
   Scene *scene = new Scene(NULL, arepoMesh, arepoTree);
   
+  // numaPlacement: move the snapshot and mesh to the memory of the render workers
+  placeSnapshotMemory(arepoMesh != NULL);
+  
   // setup transfer function
   for (unsigned int i=0; i < Config.tfSet.size(); i++)
     tf->AddParseString(Config.tfSet[i]);
@@ -76,6 +79,11 @@ void rtRenderFrames()
     if(arepoMesh) arepoMesh->WorldBound().print("ArepoMesh WorldBound ");
   }
 
+  // integrator, film, sampler and renderer are created for the first frame and then reused,
+  // only the camera follows the keyframes
+  Film *film   = NULL;
+  Renderer *re = NULL;
+  
   // loop for requested frames  
   for(int i = Config.startFrame; i < Config.startFrame+Config.numFrames; i++)
   {
@@ -84,30 +92,38 @@ void rtRenderFrames()
   
     // setup camera
     Transform world2camera = fm->SetCamera();
-    VolumeIntegrator *vi = NULL;
     
-    // recreate per frame
-    if( Config.nTreeNGB )
-      vi = CreateTreeSearchVolumeIntegrator();
-    else
-      vi = CreateVoronoiVolumeIntegrator();
+    if (!re)
+    {
+      VolumeIntegrator *vi = NULL;
       
-    //vi = CreateQuadIntersectionIntegrator();
+      if( Config.nTreeNGB )
+        vi = CreateTreeSearchVolumeIntegrator();
+      else
+        vi = CreateVoronoiVolumeIntegrator();
+        
+      //vi = CreateQuadIntersectionIntegrator();
 
-    Filter *filter       = CreateBoxFilter();
-    Film *film           = CreateFilm(filter);
-    Camera *camera       = CreateCamera(Inverse(world2camera), film);
-      
-    Sampler *sampler     = CreateStratifiedSampler(film, camera);
-    Renderer *re         = new Renderer(sampler, camera, vi);
+      Filter *filter     = CreateBoxFilter();
+      film               = CreateFilm(filter);
+      Camera *camera     = CreateCamera(Inverse(world2camera), film);
+        
+      Sampler *sampler   = CreateStratifiedSampler(film, camera);
+      re                 = new Renderer(sampler, camera, vi);
+    }
+    else
+    {
+      // clear the image in place and move the camera
+      film->Clear();
+      re->SetCamera(CreateCamera(Inverse(world2camera), film));
+    }
 
     // render
     if (re && scene)
       re->Render(scene,i);
-      
-    delete re;
   } 
   
+  delete re;
   delete scene;
   
 }
@@ -12,9 +12,12 @@
 #define FILTER_TABLE_SIZE   16
 #define TASK_MULT_FACT      8 //32
 #define TASK_MAX_PIXEL_SIZE 100 //16
+#define TASK_SPLIT_MIN_ROWS 4   // render tasks with this many unstarted rows are split for idle workers
+#define NUMA_STAGING_SIZE   (64*1024*1024) // bytes re-placed at once by numaPlaceMemory
 #define INFINITY            FLT_MAX
 #define INSIDE_EPS          1.0e-11 //1.0e-6
-#define AUXMESH_ALLOC_SIZE  4000
+#define AUXMESH_ALLOC_SIZE  4000   // initial, grows by AUXMESH_GROW_FAC if needed
+#define AUXMESH_GROW_FAC    2
 #define TF_NUM_VALS         9 // see transfer.h
 
 #define MSUN_PER_PC3_IN_CGS 6.769e-23
@@ -38,6 +41,7 @@
 //#define NNI_LIANG_HALE
 //#define DTFE_INTERP
 //#define CELL_GRADIENTS_DENS
+//#define CELL_GRADIENTS_LSQ
 //#define CELL_PIECEWISE_CONSTANT
 
 /* interpolation method options */
@@ -49,10 +53,15 @@
 //#define NATURAL_NEIGHBOR_INNER // for IDW, SPHKERNEL or NNI, do neighbors of neighbors
 //#define BRUTE_FORCE            // for IDW or SPHKERNEL, calculate over all NumGas in the box
 
+/* SPH kernel shape for SPHKERNEL and tree search (default cubic spline, see kernels.h) */
+//#define SPH_KERNEL_QUINTIC
+//#define SPH_KERNEL_WENDLAND_C2
+
 /* exponent of distance, greater values assign more influence to values closest to the 
  * interpolating point, approaching piecewise constant for large POWER_PARAM.
  * in N dimensions, if p <= N, the interpolated values are dominated by points far away,
  * which is rather bizarre. note: p is actually 2p since we skip the sqrt.
+ * integer and half-integer values are evaluated without pow() (see kernels.h).
  */
 #define POWER_PARAM 2.0
 
@@ -63,6 +72,44 @@
  */
 #define HSML_FAC 1.2
 
+/* tree search: sliding neighbor window, gather all gas within a capsule around the next
+ * TREE_WINDOW_STEPS steps of the ray (radius TREE_WINDOW_RAD_FAC times the search radius) and
+ * walk the tree again only when a sample leaves it (comment out to walk the tree for every sample)
+ */
+#define TREE_WINDOW_STEPS   8
+#define TREE_WINDOW_RAD_FAC 1.5
+
+/* tree search: interpolate over exactly nTreeNGB nearest neighbors (bounded heap kNN query) with
+ * hsml the distance to the furthest, instead of adapting hsml towards nTreeNGB between samples
+ * (changes the neighbors and hsml of every sample, so tree mode images differ from the references)
+ */
+//#define TREE_KNN
+
+/* tree search: scatter form SPH instead, each sample sums (m/rho) A W(r,h_j) over all particles
+ * whose own kernel covers it, with h_j the distance to the nTreeNGB-th neighbor of particle j
+ * (computed once, in parallel), such that there is no per ray hsml to adapt (requires GAS_TREE)
+ */
+//#define TREE_SCATTER
+
+/* neighbor searches (tree mode and entry cells) on a render-owned Morton ordered BVH over the gas
+ * (see gasTree.h) instead of the Arepo neighbor tree, GASTREE_LEAF_SIZE particles per leaf
+ */
+#define GAS_TREE
+#define GASTREE_LEAF_SIZE 8
+
+/* readPartType != 0: density and hsml of each particle from its KNN_DENSITY_NGB (or DesNumNgb if
+ * set) nearest neighbors with the SPH kernel, computed in parallel on a GasTree, instead of the 
+ * Arepo density() (comment out to use Arepo)
+ */
+#define KNN_DENSITY
+#define KNN_DENSITY_NGB 64
+
+/* tree search with projColDens: add the exact (tabulated) line integral of each particle kernel
+ * which intersects the ray, with hsml enclosing nTreeNGB neighbors at the particle density, 
+ * instead of stepping along the ray (requires GAS_TREE, changes every raw integral)
+ */
+//#define TREE_PROJ_ANALYTIC
+
 /* special behavior */
 //#define DEBUG_VERIFY_INCELL_EACH_STEP
 #define DEBUG_VERIFY_ENTRY_CELLS
@@ -418,6 +418,24 @@ extern struct sph_particle_data
  *DomainSphBuf;     /**< buffer for SPH particle data in domain decomposition */
 
 extern int NTopnodes, NTopleaves;
+
+/* domain decomposition: top-level tree of Peano-Hilbert key ranges, and the task of each leaf */
+extern struct topnode_data
+{
+  peanokey Size;        /**< number of Peano-Hilbert mesh-cells represented by top-level node */
+  peanokey StartKey;    /**< first Peano-Hilbert key in top-level node */
+  long long Count;      /**< counts the number of particles in this top-level node */
+  double Cost;
+  double SphCost;
+  int Daughter;         /**< index of first daughter cell (out of 8) of top-level node */
+  int Leaf;             /**< if the node is a leaf, this gives its number when all leaves are traversed in Peano-Hilbert order */
+  int Parent;
+  int PIndex;           /**< first particle in node */
+}
+ *TopNodes;
+
+extern int *DomainTask;
+extern double DomainCorner[3], DomainCenter[3], DomainLen, DomainFac;
  
 extern struct NODE
 {
@@ -500,6 +518,7 @@ void read_ic(const char *fname, int);
 void determine_compute_nodes(void);
  
 void domain_Decomposition(void);
+peanokey peano_hilbert_key(int x, int y, int z, int bits);
 void set_softenings(void);
 int ngb_treebuild(int npart);
 void ngb_treeallocate(void);
@@ -97,14 +97,27 @@ bool Arepo::LoadSnapshot()
           P[i].Vel[j] *= sqrt(All.Time) * All.Time; // for dm/gas particles, p = a^2 xdot
     */
 
-    domain_Decomposition();
     set_softenings();
     
-    // will build tree
-    Ngb_MaxPart = All.MaxPartSph;
-    Ngb_MaxNodes = (int) (All.NgbTreeAllocFactor * All.MaxPartSph) + NTopnodes;
-    ngb_treeallocate();
-    ngb_treebuild(NumGas);
+    // mpiRender=composite,tiles: each task keeps the slab or whole snapshot it loaded, searches use
+    // the GasTree only
+    if (Config.mpiRender != "composite" && Config.mpiRender != "tiles")
+    {
+      domain_Decomposition();
+      
+      // will build tree
+      Ngb_MaxPart = All.MaxPartSph;
+      Ngb_MaxNodes = (int) (All.NgbTreeAllocFactor * All.MaxPartSph) + NTopnodes;
+      ngb_treeallocate();
+      
+      Timer timer;
+      timer.Start();
+      
+      ngb_treebuild(NumGas);
+      
+      if (Config.verbose)
+        cout << "[" << ThisTask << "] Arepo: neighbor tree built in [" << (float)timer.Time() << "] seconds." << endl;
+    }
     
     //perhaps most (all) fields not accessed, chance to really kill P/SphP memory usage
     //update_primitive_variables(); // to get pressure
@@ -123,10 +136,14 @@ bool Arepo::LoadSnapshot()
   {
     // we will need a density estimate from the Voronoi mesh
     // for all other particle types (for which a local density estimate is not saved in snapshots)
+#ifdef KNN_DENSITY
+    EstimateDensityKNN();
+#else
     reconstruct_timebins();
     voronoi_init_connectivity(&Mesh);
     setup_smoothinglengths(); // build grav tree
     density(); // compute sph-kernel based density, saved into SphP[i].Density
+#endif
 
                       /*
     create_mesh();
@@ -193,6 +210,91 @@ bool Arepo::LoadSnapshot()
   return true;
 }
 
+// hsml of each particle as the distance to its k-th nearest neighbor (including itself), and
+// optionally its SPH density over these. particles are visited in Morton order such that the hsml
+// of the previous one is a good initial search radius (doubled until k are found)
+struct KNNSmoothingLength {
+  KNNSmoothingLength(const GasTree &t, int k, float guess, float hmin, vector<float> &h, bool d)
+    : tree(t), k(k), guess(guess), hsmlMin(hmin), hsml(h), setDensity(d), heaps(numberOfCores()) { }
+
+  void operator()(int i0, int i1, int threadNum) {
+    KNNHeap &heap = heaps[threadNum];
+    float prevHsml = guess;
+
+    for( int j = i0; j < i1; j++ ) {
+      int i = tree.ind[j];
+      Point pt(tree.x[j], tree.y[j], tree.z[j]);
+      float r = max( prevHsml * 1.25f, hsmlMin );
+
+      while( true ) {
+        heap.reset(k);
+        tree.KNearest(pt, r, heap);
+
+        if( heap.full() || r >= boxHalf )
+          break;
+        r *= 2.0f;
+      }
+
+      hsml[i] = heap.full() ? max( sqrtf(heap.top()), hsmlMin ) : r;
+      prevHsml = hsml[i];
+
+      if( !setDensity )
+        continue;
+
+      float hinv = 1.0f / hsml[i];
+      double rho = 0.0;
+
+      for( unsigned int n = 0; n < heap.h.size(); n++ )
+        rho += P[heap.h[n].second].Mass * SphKernel::W( sqrtf(heap.h[n].first) * hinv );
+
+      SphP[i].Density = rho * hinv * hinv * hinv;
+      SphP[i].Hsml    = hsml[i];
+    }
+  }
+
+  const GasTree &tree;
+  int k;
+  float guess;
+  float hsmlMin;
+  vector<float> &hsml;
+  bool setDensity;
+  vector<KNNHeap> heaps;
+};
+
+void knnSmoothingLengths( const GasTree &tree, int k, vector<float> &hsml, bool setDensity )
+{
+  hsml.assign(NumGas, 0.0f);
+  
+  if( !tree.NumPart() )
+    return;
+  
+  k = min(k, tree.NumPart());
+  
+  // initial search radius: sphere holding k particles at the mean density
+  float guess = pow( 3.0 / (4.0 * M_PI) * boxSize_X * boxSize_Y * boxSize_Z * k / tree.NumPart(), 1.0/3.0 );
+  
+  KNNSmoothingLength estimator(tree, k, guess, knnHsmlMin(boxSize_X, tree.NumPart()), hsml, setDensity);
+  parallelFor(tree.NumPart(), estimator);
+}
+
+void Arepo::EstimateDensityKNN()
+{
+  Timer timer;
+  timer.Start();
+  
+  GasTree tree;
+  tree.Build();
+  
+  int k = All.DesNumNgb > 0 ? All.DesNumNgb : KNN_DENSITY_NGB;
+  vector<float> hsml;
+  
+  knnSmoothingLengths(tree, k, hsml, true);
+  
+  if (Config.verbose)
+    cout << "[" << ThisTask << "] Arepo: kNN density (k = " << k << ") for [" << tree.NumPart() 
+         << "] particles in [" << (float)timer.Time() << "] seconds." << endl;
+}
+
 void Arepo::ComputeQuantityBounds()
 {
   float pmax  = -INFINITY;
@@ -319,8 +421,16 @@ ArepoMesh::ArepoMesh(const TransferFunction *tf)
   // preprocessing
   //ArepoMesh::LimitCellDensities();
   
+  ngbBatch.resize( numberOfCores() );
+  sampleBatch.resize( numberOfCores() );
+  
+#ifdef GAS_TREE
+  gasTree.Build();
+#endif
+  
   ArepoMesh::setupAuxMeshes();
-  ArepoMesh::precomputeTetraGrads();
+  ArepoMesh::precomputeNeighborRings();
+  ArepoMesh::precomputeCellGrads();
   
   // TODO: temp units
   unitConversions[TF_VAL_DENS] = All.UnitDensity_in_cgs / MSUN_PER_PC3_IN_CGS;
@@ -336,21 +446,16 @@ ArepoMesh::~ArepoMesh()
   // free aux meshes
   int numMeshes = numberOfCores();
   
-  for(int k = numMeshes-1; k == 0; k--)
-  {
-    myfree(AuxMeshes[k].DTF);
-    myfree(AuxMeshes[k].DTC);
-    AuxMeshes[k].DTC = NULL;
-    myfree(AuxMeshes[k].DT);
-    myfree(AuxMeshes[k].DP - 5);
-    myfree(AuxMeshes[k].VF);
-  }
+  for(int k = 0; k < numMeshes; k++)
+    free_auxmesh(&AuxMeshes[k]);
   
-  delete AuxMeshes;
+  delete[] AuxMeshes;
 #endif
-#ifdef DTFE_INTERP
-  // free delaunay tetra gradients
-  delete DT_grad;
+#ifdef NATURAL_NEIGHBOR_INNER
+  // free neighbor rings
+  delete[] RingOffset;
+  delete[] RingSph;
+  delete[] RingDP;
 #endif
 }
 
@@ -383,7 +488,7 @@ void ArepoMesh::LocateEntryCellBrute(const Ray &ray)
                 << P[sphInd].Pos[1] << " P.z = " << P[sphInd].Pos[2] << ")" << endl);
   
   ray.index = sphInd;
-  ray.task  = 0;
+  ray.task  = ThisTask;
   
   // verify task assignment
   if (ray.task < 0 || ray.task >= NTask)
@@ -405,23 +510,89 @@ void ArepoMesh::LocateEntryCell(const Ray &ray, int *prevEntryCell)
   cout << " ray ends at   x = " << exitbox.x << " y = " << exitbox.y << " z = " << exitbox.z << endl;
 #endif    
   
-  // TODO: use peanokey to find domain and task for ray
-  if (ray.task == -1)
-    ray.task = 0;
-  // TODO: exchange
-  
-  // use tree to find nearest gas particle (local only)
+  // use tree to find nearest gas particle (local only, the caller has checked the domain with 
+  // TaskOfPoint, or the ray was forwarded here by the task of the previous cell)
   int dp_min = ArepoMesh::FindNearestGasParticle(hitbox, *prevEntryCell, &mindist);
   *prevEntryCell = dp_min;
   
   ray.index = dp_min;
-  ray.task  = 0;
+  ray.task  = ThisTask;
+  
+  // near a domain boundary the containing cell can be a ghost of a neighboring task: walk the
+  // delaunay connectivity (local and ghost points) to the nearest generator, if that is a ghost
+  // the ray is forwarded to its task (as for cell crossings in the march). the distance strictly
+  // decreases with each step and each forward, so this terminates
+  if (NTask > 1) {
+    Vector celldist(hitbox.x - P[dp_min].Pos[0], hitbox.y - P[dp_min].Pos[1], hitbox.z - P[dp_min].Pos[2]);
+    double dist2 = celldist.PeriodicLengthSquared();
+    int sphInd = dp_min;
+    
+    while (sphInd >= 0) {
+      int next = -1, next_dp = -1;
+      int edge = SphP[sphInd].first_connection;
+      int last_edge = SphP[sphInd].last_connection;
+      
+      while (edge >= 0) {
+        int dp = DC[edge].dp_index;
+        
+        if (DC[edge].index >= 0 && dp >= 0) {
+          celldist = Vector(hitbox.x - DP[dp].x, hitbox.y - DP[dp].y, hitbox.z - DP[dp].z);
+          double d2 = celldist.PeriodicLengthSquared();
+          
+          if (d2 < dist2 * (1 - INSIDE_EPS)) {
+            dist2   = d2;
+            next    = DC[edge].index;
+            next_dp = dp;
+          }
+        }
+        
+        if (edge == last_edge)
+          break;
+        
+        edge = DC[edge].next;
+      }
+      
+      if (next_dp < 0)
+        break;
+      
+      if (DP[next_dp].task != ThisTask) {
+        ray.task  = DP[next_dp].task;
+        ray.index = DP[next_dp].index;
+        break;
+      }
+      
+      sphInd = next;
+      ray.index = next;
+      *prevEntryCell = next;
+    }
+    
+    IF_DEBUG(cout << " entry cell walk: sphInd = " << ray.index << " task = " << ray.task << endl);
+  }
   
   // verify task assignment
   if (ray.task < 0 || ray.task >= NTask)
     terminate("ERROR! ray has bad task=%d", ray.task);   
 }
 
+// task whose domain contains pt: walk the top-level tree of the domain decomposition down to the
+// leaf containing the Peano-Hilbert key of pt
+int ArepoMesh::TaskOfPoint(const Point &pt) const
+{
+  const double maxCoord = (double)((1 << BITS_PER_DIMENSION) - 1);
+  
+  int xb = (int)Clamp((pt.x - DomainCorner[0]) * DomainFac, 0.0, maxCoord);
+  int yb = (int)Clamp((pt.y - DomainCorner[1]) * DomainFac, 0.0, maxCoord);
+  int zb = (int)Clamp((pt.z - DomainCorner[2]) * DomainFac, 0.0, maxCoord);
+  
+  peanokey key = peano_hilbert_key(xb, yb, zb, BITS_PER_DIMENSION);
+  
+  int no = 0;
+  while (TopNodes[no].Daughter >= 0)
+    no = TopNodes[no].Daughter + (int)((key - TopNodes[no].StartKey) / (TopNodes[no].Size / 8));
+  
+  return DomainTask[TopNodes[no].Leaf];
+}
+
 void ArepoMesh::VerifyPointInCell(int parInd, Point &pos)
 {   
   Vector celldist(pos.x - P[parInd].Pos[0], pos.y - P[parInd].Pos[1], pos.z - P[parInd].Pos[2]);
@@ -537,8 +708,8 @@ void addValsContribution( vector<float> &vals, int SphP_ind, double weight )
     vals[TF_VAL_XRAY]    +=  sqrt( SphP[SphP_ind].Utherm ) *
                              pow( SphP[SphP_ind].Density * P[SphP_ind].OldAcc, 2 ) * weight;
 
-    vals[TF_VAL_BMAG]      += SphP[SphP_ind].VelVertex[0];
-    vals[TF_VAL_SHOCKDEDT] += SphP[SphP_ind].VelVertex[1];
+    vals[TF_VAL_BMAG]      += SphP[SphP_ind].VelVertex[0] * weight;
+    vals[TF_VAL_SHOCKDEDT] += SphP[SphP_ind].VelVertex[1] * weight;
   }
   
   // dark matter
@@ -557,13 +728,99 @@ void addValsContribution( vector<float> &vals, int SphP_ind, double weight )
   }
 }
 
+// update raw column density integrals, same weighting procedure as in voronoi_makeimage_new()
+// e.g. weight (Temp,Vmag,Ent,Metal) by rho*len and then normalize out at the end
+void addRawIntegrals( double *raw_vals, const vector<float> &vals, double len )
+{
+  double weight = vals[TF_VAL_DENS] * len;
+  
+  // column density
+  raw_vals[0] += vals[TF_VAL_DENS] * len;
+  
+  // mass-weighted values
+  raw_vals[1] += vals[TF_VAL_TEMP] * weight;
+  raw_vals[2] += vals[TF_VAL_VMAG] * weight;
+  raw_vals[3] += vals[TF_VAL_ENTROPY] * weight;
+  raw_vals[4] += vals[TF_VAL_METAL] * weight;
+
+  raw_vals[7] += vals[TF_VAL_BMAG] * weight;
+  raw_vals[8] += vals[TF_VAL_SHOCKDEDT] * weight;
+  
+  // un-weighted line integrals
+  raw_vals[5] += vals[TF_VAL_SZY] * len;
+  if( vals[TF_VAL_TEMP] >= 1e6 ) // xray restriction: hot gas only (Temp > 1e6 K)
+    raw_vals[6] += vals[TF_VAL_XRAY] * len;
+  if( vals[TF_VAL_TEMP] >= 5e5 && vals[TF_VAL_TEMP] < 1e6 ) // ramp off this step
+    raw_vals[6] += (vals[TF_VAL_TEMP]-5e5)/5e5 * vals[TF_VAL_XRAY] * len;
+}
+
+// per particle hsml enclosing nNgb neighbors at its own density (SPH scatter form)
+struct ParticleHsml {
+  ParticleHsml(vector<float> &h, int nNgb) : hsml(h), fac(3.0 * nNgb / (4.0 * M_PI)) { }
+
+  void operator()(int i0, int i1, int threadNum) {
+    for( int i = i0; i < i1; i++ )
+      hsml[i] = SphP[i].Density > 0.0 ? pow(fac * P[i].Mass / SphP[i].Density, 1.0/3.0) : 0.0;
+  }
+
+  vector<float> &hsml;
+  double fac;
+};
+
+void particleHsml( vector<float> &hsml, int nNgb )
+{
+  hsml.resize(NumGas);
+  ParticleHsml filler(hsml, nNgb);
+  parallelFor(NumGas, filler);
+}
+
+// numaPlacement: spread the snapshot (and mesh) over the memory of the nodes of the render workers
+void placeSnapshotMemory( bool mesh )
+{
+  if( Config.numaPlacement == "none" )
+    return;
+    
+  Timer timer;
+  timer.Start();
+  
+  bool interleave = (Config.numaPlacement == "interleave");
+  
+  numaPlaceMemory( P, NumPart * sizeof(P[0]), interleave );
+  numaPlaceMemory( SphP, NumGas * sizeof(SphP[0]), interleave );
+  
+  if( mesh ) {
+    numaPlaceMemory( Mesh.DP, Mesh.Ndp * sizeof(Mesh.DP[0]), interleave );
+    numaPlaceMemory( Mesh.DT, Mesh.Ndt * sizeof(Mesh.DT[0]), interleave );
+    numaPlaceMemory( Mesh.DTC, Mesh.Ndt * sizeof(Mesh.DTC[0]), interleave );
+    numaPlaceMemory( Mesh.DTF, Mesh.Ndt * sizeof(Mesh.DTF[0]), interleave );
+    numaPlaceMemory( DC, Nvc * sizeof(DC[0]), interleave );
+  }
+  
+  if (Config.verbose)
+    cout << "[" << ThisTask << "] NUMA placement (" << Config.numaPlacement << ") over [" << numaNodes() 
+         << "] nodes: [" << (float)timer.Time() << "] seconds." << endl;
+}
+
 int ArepoMesh::FindNearestGasParticle(Point &pt, int guess, double *mindist)
 {
+#ifdef GAS_TREE
+  int nearest = gasTree.Nearest(pt, guess, mindist);
+  
+  if (nearest < 0 || nearest >= NumGas) {
+    cout << "ERROR: FindNearestGasParticle nearest=" << nearest << " out of bounds." << endl;
+    terminate("1118");
+  }
+  
+  IF_DEBUG(cout << "FindNearestGasParticle(): found nearest = " << nearest << " mindist = " << *mindist << endl);
+  
+  return nearest;
+#else
   // based on ngbtree_walk.c:ngb_treefind_variable() (no MPI)
   int node, nearest, p;
   struct NgbNODE *current;
-  double dx, dy, dz, cur_mindist, cur_mindist_sq, xtmp, ytmp, ztmp;
-  float search_min[3], search_max[3], search_max_Lsub[3], search_min_Ladd[3];
+  double cur_mindist, cur_mindist_sq;
+  PeriodicBox<double> box;
+  PeriodicSearch search;
 
 #ifdef DEBUG
   int count_indpart=0,count_intnode=0,count_extnode=0;
@@ -580,28 +837,11 @@ int ArepoMesh::FindNearestGasParticle(Point &pt, int guess, double *mindist)
     nearest = (int)floor(NumGas/2.0);
   }
   
-  dx = NGB_PERIODIC_LONG_X(P[nearest].Pos[0] - pt.x);
-  dy = NGB_PERIODIC_LONG_Y(P[nearest].Pos[1] - pt.y);
-  dz = NGB_PERIODIC_LONG_Z(P[nearest].Pos[2] - pt.z);
-
-  cur_mindist_sq = dx * dx + dy * dy + dz * dz;
+  cur_mindist_sq = box.distSq(P[nearest].Pos[0] - pt.x, P[nearest].Pos[1] - pt.y, P[nearest].Pos[2] - pt.z);
   cur_mindist = sqrt(cur_mindist_sq);
   
   // search bounds
-  search_min[0] = pt.x - cur_mindist;
-  search_min[1] = pt.y - cur_mindist;
-  search_min[2] = pt.z - cur_mindist;
-  search_max[0] = pt.x + cur_mindist;
-  search_max[1] = pt.y + cur_mindist;
-  search_max[2] = pt.z + cur_mindist;
-
-  search_max_Lsub[0] = search_max[0] - boxSize_X;
-  search_max_Lsub[1] = search_max[1] - boxSize_Y;
-  search_max_Lsub[2] = search_max[2] - boxSize_Z;
-
-  search_min_Ladd[0] = search_min[0] + boxSize_X;
-  search_min_Ladd[1] = search_min[1] + boxSize_Y;
-  search_min_Ladd[2] = search_min[2] + boxSize_Z;
+  search.set(pt.x, pt.y, pt.z, cur_mindist);
   
 
   while(node >= 0)
@@ -615,19 +855,7 @@ int ArepoMesh::FindNearestGasParticle(Point &pt, int guess, double *mindist)
       if(P[p].Type > 0) // not gas particle
         continue;
       
-      dx = NGB_PERIODIC_LONG_X(P[p].Pos[0] - pt.x);
-      if(dx > cur_mindist)
-        continue;
-        
-      dy = NGB_PERIODIC_LONG_Y(P[p].Pos[1] - pt.y);
-      if(dy > cur_mindist)
-        continue;
-        
-      dz = NGB_PERIODIC_LONG_Z(P[p].Pos[2] - pt.z);
-      if(dz > cur_mindist)
-        continue;
-      
-      double curdist2 = dx * dx + dy * dy + dz * dz;
+      double curdist2 = box.distSq(P[p].Pos[0] - pt.x, P[p].Pos[1] - pt.y, P[p].Pos[2] - pt.z);
       if(curdist2 > cur_mindist_sq)
         continue;
         
@@ -643,19 +871,7 @@ int ArepoMesh::FindNearestGasParticle(Point &pt, int guess, double *mindist)
       node = current->u.d.sibling;
 
       // next check against bound
-      if(search_min[0] > current->u.d.range_max[0] && search_max_Lsub[0] < current->u.d.range_min[0])
-        continue;
-      if(search_min_Ladd[0] > current->u.d.range_max[0] && search_max[0] < current->u.d.range_min[0])
-        continue;
-
-      if(search_min[1] > current->u.d.range_max[1] && search_max_Lsub[1] < current->u.d.range_min[1])
-        continue;
-      if(search_min_Ladd[1] > current->u.d.range_max[1] && search_max[1] < current->u.d.range_min[1])
-        continue;
-
-      if(search_min[2] > current->u.d.range_max[2] && search_max_Lsub[2] < current->u.d.range_min[2])
-        continue;
-      if(search_min_Ladd[2] > current->u.d.range_max[2] && search_max[2] < current->u.d.range_min[2])
+      if(search.disjoint(current->u.d.range_min, current->u.d.range_max))
         continue;
 
       node = current->u.d.nextnode; // need to open the node
@@ -668,7 +884,7 @@ int ArepoMesh::FindNearestGasParticle(Point &pt, int guess, double *mindist)
     }
   }
 
-  if (nearest < 0 || nearest > NumGas) {
+  if (nearest < 0 || nearest >= NumGas) {
     cout << "ERROR: FindNearestGasParticle nearest=" << nearest << " out of bounds." << endl;
     terminate("1118");
   }
@@ -681,6 +897,7 @@ int ArepoMesh::FindNearestGasParticle(Point &pt, int guess, double *mindist)
   *mindist = sqrt(cur_mindist_sq);
   
   return nearest;
+#endif // GAS_TREE
 }
 
 // get primary hydro IND - handle local ghosts
@@ -720,7 +937,7 @@ void ArepoMesh::checkCurCellTF(bool *addFlag, int sphInd, vector<float> &vals)
 */    
 }
 
-void ArepoMesh::locateCurrentTetra(const Ray &ray, Vector &pt)
+void ArepoMesh::locateCurrentTetra(const Ray &ray, const Point &pt)
 {
   // check degenerate point in R3, immediate return, otherwise we will terminate get_tetra
   // with "strange zero count" since we are on a vertex (3 faces simultaneously)
@@ -927,6 +1144,22 @@ bool ArepoMesh::AdvanceRayOneCellNew(const Ray &ray, double *t0, double *t1,
         
       IF_DEBUG(cout << " sub-stepping len = " << len << " nSamples = " << nSamples 
                     << " (step = " << len/nSamples << ")" << endl);
+                    
+#ifdef SUBSAMPLE_BATCH
+      // interpolate all samples of this segment at once (one neighbor gather per cell)
+      SampleBatch &batch = sampleBatch[threadNum];
+      
+      if( nSamples > 0 )
+      {
+        batch.pts.resize(nSamples);
+        batch.vals.resize(nSamples * TF_NUM_VALS);
+        
+        for (int i = 0; i < nSamples; ++i)
+          batch.pts[i] = prev_sample_pt + (i+1)*stepSize * norm;
+          
+        subSampleCellBatch(ray, &batch.pts[0], nSamples, &batch.vals[0], threadNum);
+      }
+#endif
                       
       for (int i = 0; i < nSamples; ++i)
       {
@@ -942,7 +1175,13 @@ bool ArepoMesh::AdvanceRayOneCellNew(const Ray &ray, double *t0, double *t1,
           terminate("ERROR: Sample point outside box. (%g %g %g)",samplept.x,samplept.y,samplept.z);
                                             
         // subsample (replace fields in vals by interpolated values)
+#ifdef SUBSAMPLE_BATCH
+        for( int v = 0; v < TF_NUM_VALS; v++ )
+          vals[v] = batch.vals[i * TF_NUM_VALS + v];
+        int status = 1;
+#else
         int status = subSampleCell(ray, samplept, vals, threadNum);
+#endif
             
 #ifdef DEBUG
         double fracstep = 1.0 / nSamples;
@@ -12,12 +12,124 @@
 
 #include "transfer.h"
 #include "voronoi_3db.h"
+#include "kernels.h"
+#include "gasTree.h"
 
 #if (NUM_THREADS > 1)
 #include <omp.h>
 #endif
 
 void addValsContribution( vector<float> &vals, int SphP_ind, double weight );
+void addRawIntegrals( double *raw_vals, const vector<float> &vals, double len );
+void particleHsml( vector<float> &hsml, int nNgb );
+void knnSmoothingLengths( const GasTree &tree, int k, vector<float> &hsml, bool setDensity );
+void placeSnapshotMemory( bool mesh );
+
+// SPH/IDW over natural neighbors: interpolate all samples of a cell segment in one batch
+#if (defined(NATURAL_NEIGHBOR_IDW) || defined(NATURAL_NEIGHBOR_SPHKERNEL)) && !defined(BRUTE_FORCE)
+#define SUBSAMPLE_BATCH
+#endif
+
+// per thread sample points of the current cell segment and their TF_NUM_VALS values each
+struct SampleBatch {
+  vector<Point> pts;
+  vector<float> vals;
+  vector<float> tmp, parentVals; // TF_NUM_VALS scratch of subSampleCellBatch()
+};
+
+// NATURAL_NEIGHBOR_INTERP: per thread copy of the auxiliary mesh built for the last visited cell
+struct AuxMeshCache {
+  AuxMeshCache() : sphInd(-1), Ndp(0), Ndt(0), tlast(0) { }
+  
+  int sphInd;       // parent cell of the cached aux mesh (-1 for none)
+  int Ndp, Ndt;     // aux mesh sizes without the sample point
+  int tlast;        // last tetra inserted into (point location start)
+  
+  vector<tetra> DT;
+  vector<tetra_center> DTC;
+  vector<char> DTF;
+  
+  vector<int> sphInds;          // aux mesh point -> SphP index
+  vector<double> oldVol;        // volumes without the sample point
+  vector<double> newVol;        // volumes with the sample point (star only)
+  vector<unsigned char> inStar; // aux mesh point shares a tetra with the sample point
+};
+
+// DTFE_INTERP: density gradient over one delaunay tetra, with the SphP index of its vertex p[0]
+struct TetraGrad {
+  int sph0;       // -1 for degenerate tetras
+  float grad[3];
+};
+
+// small open addressing hash map (key -> val) over the tetras and nodes of one cavity, keys are
+// tetra (>= 0) or DP (>= DPinfinity) indices. the capacity follows the largest cavity seen (kept
+// at most half full), such that clearing it per sample is cheap
+#define CAVITY_HASH_EMPTY -100
+#define CAVITY_HASH_SIZE  64
+
+struct CavityHash {
+  CavityHash() : num(0) { }
+  
+  vector<int> keys, vals;
+  int num;
+  
+  void clear() {
+    if ( keys.empty() ) {
+      keys.resize(CAVITY_HASH_SIZE);
+      vals.resize(CAVITY_HASH_SIZE);
+    }
+    fill( keys.begin(), keys.end(), CAVITY_HASH_EMPTY );
+    num = 0;
+  }
+  
+  // slot of key, or of the empty entry where it would be inserted
+  int slot(int key) const {
+    int mask = keys.size() - 1;
+    unsigned int h = (unsigned int)key * 2654435761u;
+    int s = (h ^ (h >> 16)) & mask;
+    
+    while ( keys[s] != CAVITY_HASH_EMPTY && keys[s] != key )
+      s = (s + 1) & mask;
+    return s;
+  }
+  
+  // value of key, -1 if not present
+  int find(int key) const {
+    int s = slot(key);
+    return keys[s] == key ? vals[s] : -1;
+  }
+  
+  void insert(int key, int val) {
+    if ( 2 * (num + 1) > (int)keys.size() ) {
+      vector<int> oldKeys(keys), oldVals(vals);
+      keys.assign( 2 * oldKeys.size(), CAVITY_HASH_EMPTY );
+      vals.resize( keys.size() );
+      
+      for ( unsigned int i=0; i < oldKeys.size(); i++ )
+        if ( oldKeys[i] != CAVITY_HASH_EMPTY ) {
+          int s = slot(oldKeys[i]);
+          keys[s] = oldKeys[i];
+          vals[s] = oldVals[i];
+        }
+    }
+    
+    int s = slot(key);
+    keys[s] = key;
+    vals[s] = val;
+    num++;
+  }
+};
+
+// NNI_WATSON_SAMBRIDGE: per thread work lists (capacity is kept between samples)
+struct NNIScratch {
+  vector<int> tetInds;     // global tetras whose circumsphere contains the sample point
+  vector<int> tetStack;    // flood fill work list
+  vector<int> nodeInds;    // DP indices of the natural neighbors (vertices of tetInds)
+  vector<double> nodeVols; // stolen volume per natural neighbor
+  
+  CavityHash tetSeen;      // tetras tested for the current cavity (in tetInds or not)
+  CavityHash nodeSlot;     // DP index -> position in nodeInds
+};
 
 // Arepo: main interface with Arepo to load a snapshot, create data structures, and return
 class Arepo
@@ -30,6 +142,7 @@ public:
   void Init(int*, char***);
   void Cleanup();
   bool LoadSnapshot();
+  void EstimateDensityKNN();
 
   void ComputeQuantityBounds();
 
@@ -52,7 +165,9 @@ public:
   
   // init for particular interp methods
   void setupAuxMeshes();
-  void precomputeTetraGrads();
+  void precomputeTetraGrads(const Camera *camera);
+  void precomputeNeighborRings();
+  void precomputeCellGrads();
 
   // preprocessing
   int ComputeVoronoiEdges();
@@ -79,22 +194,31 @@ public:
   void VerifyPointInCell(int sphInd, Point &pos);
   
   void LocateEntryTetra(const Ray &ray, int *prevEntryTetra);
+  int TaskOfPoint(const Point &pt) const;
   
   int FindNearestGasParticle(Point &pt, int guess, double *mindist);
   bool AdvanceRayOneCellNew(const Ray &ray, double *t0, double *t1, 
                             Spectrum &Lv, Spectrum &Tr, int threadNum);
   
   inline int getSphPID(int dpInd);
-  void locateCurrentTetra(const Ray& ray, Vector &pt);
+  bool calcTetraGrad(int tt, TetraGrad *tg);
+  void calcCellGrad(int i, const float *cellVals, vector<int> &ngb);
+  void locateCurrentTetra(const Ray& ray, const Point &pt);
   void checkCurCellTF(bool *addFlag, int sphInd, vector<float> &vals);
   
   // fluid data introspection
   float calcNeighborHSML(int sphInd, Point &pt);
   int subSampleCell(const Ray &ray, Point &pt, vector<float> &vals, int threadNum);
+  void subSampleCellBatch(const Ray &ray, const Point *pts, int nSamples, float *vals, int threadNum);
+  
+  // NATURAL_NEIGHBOR_INTERP
+  void buildAuxMesh(int sphInd, int threadNum);
+  void insertAuxMeshPoint(int threadNum, int dp_index, int sph_index, Point &cen);
   
   // NNI_WATSON_SAMBRIDGE
-  inline bool needTet(int tt, point *pp, int *node_inds, int *nTet);
-  void addTet(int tt, point *pp, int *node_inds, int *tet_inds, int *nNode, int *nTet);
+  inline bool needTet(int tt, point *pp);
+  inline int addNode(NNIScratch &scr, int dp);
+  void findCavity(int tt, point *pp, NNIScratch &scr);
   double ccVolume(double *ci, double *cj, double *ck, double *ct);
   
   // data
@@ -107,6 +231,9 @@ public:
   tetra_center *DTC; // circumcenters of delaunay tetrahedra
   char *DTF;         // tetra faces
   face *VF;          // voronoi faces
+  
+  vector<int> tetraGradSlot;     // DTFE_INTERP: index into tetraGrads (-1 not computed) per tetra
+  vector<TetraGrad> tetraGrads;  // DTFE_INTERP: packed gradients of the tetras in view, kept across frames
   //connection *DC;    // voronoi connections
     
 private:
@@ -122,8 +249,17 @@ private:
   
   // for particular interpolation methods
   tessellation *AuxMeshes;
-  float *DT_grad;
-  float *DP_vols;
+  vector<AuxMeshCache> auxCache;
+  vector<NeighborBatch> ngbBatch; // per thread
+  vector<SampleBatch> sampleBatch; // per thread
+  GasTree gasTree;                 // GAS_TREE: nearest gas particle searches
+  vector<NNIScratch> nniScratch;  // per thread
+  vector<float> cellGrads;        // CELL_GRADIENTS_LSQ: gradient (x,y,z) of each TF_VAL per gas cell
+  
+  // NATURAL_NEIGHBOR_INNER: first+second order neighbors of each cell (CSR, RingOffset[NumGas+1])
+  int *RingOffset;
+  int *RingSph;
+  int *RingDP;
   
   // for drawing voronoi faces and edges
   vector<int> vertexList;
@@ -4,6 +4,7 @@
  */
  
 #include <alloca.h>
+#include <algorithm> // sort/unique
 
 #include "transform.h"
 #include "spectrum.h"
@@ -11,18 +12,14 @@
 #include "volume.h"
 #include "transfer.h"
 #include "util.h" // for numberOfCores()
+#include "camera.h"
 
 // NNI_WATSON_SAMBRIDGE
-#define MAX_NUM_TETS 100
-#define MAX_NUM_NODES 400
 #define NODE_A 3
 #define NODE_B 0
 #define NODE_C 1
 #define NODE_D 2
 
-// NATURAL_NEIGHBOR_INNER
-#define MAX_NON_INDS 800 // 500 for 455^3 ok
-
 // get primary hydro ID - handle local ghosts
 inline int ArepoMesh::getSphPID(int dp_id)
 {
@@ -42,185 +39,490 @@ inline int ArepoMesh::getSphPID(int dp_id)
 void ArepoMesh::setupAuxMeshes(void)
 {
 #ifdef NATURAL_NEIGHBOR_INTERP
-  // allocate auxiliary meshes
+  // auxiliary meshes (one per thread), the arrays are allocated by the owning thread on first use
   int numMeshes = numberOfCores();
-  AuxMeshes = new tessellation[numMeshes];
+  AuxMeshes = new tessellation[numMeshes]();
+  auxCache.resize(numMeshes);
   
   // define neutral index
   DPinfinity = -5;    
-  
-  double box = All.BoxSize;
-  double tetra_incircle, tetra_sidelength, tetra_height, tetra_face_height;   
-  
-  tetra_incircle = 1.5 * box;
-  tetra_sidelength = tetra_incircle * sqrt(24);
-  tetra_height = sqrt(2.0 / 3) * tetra_sidelength;
-  tetra_face_height = sqrt(3.0) / 2.0 * tetra_sidelength;   
-  
-  for(int k = 0; k < numMeshes; k++)
-  {
-    // copy individual allocation factors for auxiliary meshes
-    //init_clear_auxmesh(&AuxMeshes[k]);
-    point *p;
-    int i;
-    
-    AuxMeshes[k].Indi.AllocFacNdp = AUXMESH_ALLOC_SIZE / 2;
-    AuxMeshes[k].Indi.AllocFacNdt = AUXMESH_ALLOC_SIZE;
-    AuxMeshes[k].Indi.AllocFacNvf = AUXMESH_ALLOC_SIZE;
-
-    AuxMeshes[k].MaxNdp = (int)AuxMeshes[k].Indi.AllocFacNdp;
-    AuxMeshes[k].MaxNdt = (int)AuxMeshes[k].Indi.AllocFacNdt;
-    AuxMeshes[k].MaxNvf = (int)AuxMeshes[k].Indi.AllocFacNvf;
-
-    AuxMeshes[k].VF = static_cast<face*>
-                   (mymalloc_movable(AuxMeshes[k].VF, "VFaux", AuxMeshes[k].MaxNvf * sizeof(face)));
-    AuxMeshes[k].DP = static_cast<point*>
-                   (mymalloc_movable(AuxMeshes[k].DP, "DPaux", (AuxMeshes[k].MaxNdp+5) * sizeof(point)));
-    AuxMeshes[k].DP += 5; // leave first five for bounding tetra + infinity
-    AuxMeshes[k].DT = static_cast<tetra*>
-                   (mymalloc_movable(AuxMeshes[k].DT, "DTaux", AuxMeshes[k].MaxNdt * sizeof(tetra)));
-    
-    AuxMeshes[k].DTC = static_cast<tetra_center*>(
-                    mymalloc_movable(&AuxMeshes[k].DTC, "AuxDTC", AuxMeshes[k].MaxNdt * sizeof(tetra_center)));
-    AuxMeshes[k].DTF = static_cast<char*>(
-                    mymalloc_movable(&AuxMeshes[k].DTF, "AuxDTF", AuxMeshes[k].MaxNdt * sizeof(char))); 
-
-    point *DP = AuxMeshes[k].DP;
-    //tetra *DT = AuxMeshes[k].DT;
-
-    /* first, let's make the points */
-    DP[-4].x = 0.5 * tetra_sidelength;
-    DP[-4].y = -1.0 / 3 * tetra_face_height;
-    DP[-4].z = -0.25 * tetra_height;
-
-    DP[-3].x = 0;
-    DP[-3].y = 2.0 / 3 * tetra_face_height;
-    DP[-3].z = -0.25 * tetra_height;
-
-    DP[-2].x = -0.5 * tetra_sidelength;
-    DP[-2].y = -1.0 / 3 * tetra_face_height;
-    DP[-2].z = -0.25 * tetra_height;
-
-    DP[-1].x = 0;
-    DP[-1].y = 0;
-    DP[-1].z = 0.75 * tetra_height;
-
-    for(i = -4; i <= -1; i++)
-      {
-        DP[i].x += 0.5 * box;
-        DP[i].y += 0.5 * box;
-        DP[i].z += 0.5 * box;
-      }
-
-    for(i = -4, p = &DP[-4]; i < 0; i++, p++)
-      {
-        p->index = -1;
-        p->task = ThisTask;
-        p->timebin = 0;
-      }
+#endif
 
-    /* we also define a neutral element at infinity */
-    DP[DPinfinity].x = GSL_POSINF;
-    DP[DPinfinity].y = GSL_POSINF;
-    DP[DPinfinity].z = GSL_POSINF;
-    DP[DPinfinity].index = -1;
-    DP[DPinfinity].task = ThisTask;
-    DP[DPinfinity].timebin = 0;
-    
-  }
+#ifdef NNI_WATSON_SAMBRIDGE
+  nniScratch.resize( numberOfCores() );
 #endif
+
 }
 
-void ArepoMesh::precomputeTetraGrads()
+// DTFE gradient of the density over global tetra tt, false if degenerate or touching the bounding tetra
+bool ArepoMesh::calcTetraGrad(int tt, TetraGrad *tg)
 {
-#ifdef DTFE_INTERP
-  int i;
   double det_A;
   double A[3][3]; // row,col
   double A_inv[3][3];
   float delta_f[3];
   float field_0;
   
-  // allocate for grad[3] per tetra (one field only)
-  DT_grad = new float[3 * Ndt];
+  tetra *t = &DT[tt];
   
-  for (i = 0; i < Ndt; i++)
-  {
-    // if this tetra is connected to the bounding tetra then skip it
-    if ( DT[i].p[0] < 0 || DT[i].p[1] < 0 || DT[i].p[2] < 0 || DT[i].p[3] < 0 )
-      continue;
+  // if this tetra is connected to the bounding tetra then skip it
+  if ( t->p[0] < 0 || t->p[1] < 0 || t->p[2] < 0 || t->p[3] < 0 )
+    return false;
+    
+  // fill A
+  A[0][0] = DP[t->p[1]].x - DP[t->p[0]].x;
+  A[1][0] = DP[t->p[2]].x - DP[t->p[0]].x;
+  A[2][0] = DP[t->p[3]].x - DP[t->p[0]].x;
+  A[0][1] = DP[t->p[1]].y - DP[t->p[0]].y;
+  A[1][1] = DP[t->p[2]].y - DP[t->p[0]].y;
+  A[2][1] = DP[t->p[3]].y - DP[t->p[0]].y;
+  A[0][2] = DP[t->p[1]].z - DP[t->p[0]].z;
+  A[1][2] = DP[t->p[2]].z - DP[t->p[0]].z;
+  A[2][2] = DP[t->p[3]].z - DP[t->p[0]].z;
+  
+  // compute determinant(A)
+  det_A = A[0][0]*A[1][1]*A[2][2] + A[1][0]*A[2][1]*A[0][2] +
+          A[2][0]*A[0][1]*A[1][2] - A[0][0]*A[2][1]*A[1][2] - 
+          A[2][0]*A[1][1]*A[0][2] - A[1][0]*A[0][1]*A[2][2];
       
-    // fill A
-    A[0][0] = DP[DT[i].p[1]].x - DP[DT[i].p[0]].x;
-    A[1][0] = DP[DT[i].p[2]].x - DP[DT[i].p[0]].x;
-    A[2][0] = DP[DT[i].p[3]].x - DP[DT[i].p[0]].x;
-    A[0][1] = DP[DT[i].p[1]].y - DP[DT[i].p[0]].y;
-    A[1][1] = DP[DT[i].p[2]].y - DP[DT[i].p[0]].y;
-    A[2][1] = DP[DT[i].p[3]].y - DP[DT[i].p[0]].y;
-    A[0][2] = DP[DT[i].p[1]].z - DP[DT[i].p[0]].z;
-    A[1][2] = DP[DT[i].p[2]].z - DP[DT[i].p[0]].z;
-    A[2][2] = DP[DT[i].p[3]].z - DP[DT[i].p[0]].z;
-    
-    // compute determinant(A)
-    det_A = A[0][0]*A[1][1]*A[2][2] + A[1][0]*A[2][1]*A[0][2] +
-            A[2][0]*A[0][1]*A[1][2] - A[0][0]*A[2][1]*A[1][2] - 
-            A[2][0]*A[1][1]*A[0][2] - A[1][0]*A[0][1]*A[2][2];
-        
-    //cout << "[" << i << "] p0 = " << DT[i].p[0] << " p1 = " << DT[i].p[2] << 
-    //  " p2 = " << DT[i].p[2] << " p3 = " << DT[i].p[3] << " det_A = " << det_A << endl;
+  if (det_A < INSIDE_EPS && det_A > -INSIDE_EPS)
+    return false;
+  
+  // reciprocal of determinant
+  det_A = 1.0 / det_A;
+  
+  // compute A_inv
+  A_inv[0][0] = det_A * ( A[1][1]*A[2][2] - A[1][2]*A[2][1] );
+  A_inv[1][0] = det_A * ( A[1][2]*A[2][0] - A[1][0]*A[2][2] );
+  A_inv[2][0] = det_A * ( A[1][0]*A[2][1] - A[1][1]*A[2][0] );
+  A_inv[0][1] = det_A * ( A[0][2]*A[2][1] - A[0][1]*A[2][2] );
+  A_inv[1][1] = det_A * ( A[0][0]*A[2][2] - A[0][2]*A[2][0] );
+  A_inv[2][1] = det_A * ( A[0][1]*A[2][0] - A[0][0]*A[2][1] );
+  A_inv[0][2] = det_A * ( A[0][1]*A[1][2] - A[0][2]*A[1][1] );
+  A_inv[1][2] = det_A * ( A[0][2]*A[1][0] - A[0][0]*A[1][2] );
+  A_inv[2][2] = det_A * ( A[0][0]*A[1][1] - A[0][1]*A[1][0] );
+  
+  // compute delta_f (field specific)
+  tg->sph0 = getSphPID(DP[t->p[0]].index);
+  field_0  = SphP[ tg->sph0 ].Density;
+  
+  delta_f[0] = SphP[ getSphPID(DP[t->p[1]].index) ].Density - field_0;
+  delta_f[1] = SphP[ getSphPID(DP[t->p[2]].index) ].Density - field_0;
+  delta_f[2] = SphP[ getSphPID(DP[t->p[3]].index) ].Density - field_0;
+  
+  // compute the gradient (A_inv * delta_f)
+  tg->grad[0] = A_inv[0][0]*delta_f[0] + A_inv[0][1]*delta_f[1] + A_inv[0][2]*delta_f[2];
+  tg->grad[1] = A_inv[1][0]*delta_f[0] + A_inv[1][1]*delta_f[1] + A_inv[1][2]*delta_f[2];
+  tg->grad[2] = A_inv[2][0]*delta_f[0] + A_inv[2][1]*delta_f[1] + A_inv[2][2]*delta_f[2];
+  
+  return true;
+}
 
-    if (det_A < INSIDE_EPS && det_A > -INSIDE_EPS) { // debugging
-      //cout << "ERROR: det_A is zero! " << det_A << " [" << i << "]" << endl;
-      //exit(12509);
+#ifdef DTFE_INTERP
+// view culling codes of all delaunay points (see Camera::RasterOutcode)
+struct PointOutcoder {
+  PointOutcoder(const Camera *c, point *dp, unsigned char *out) : camera(c), DP(dp), codes(out) { }
+  
+  void operator()(int i0, int i1, int threadNum) {
+    for( int i = i0; i < i1; i++ )
+      codes[i] = camera->RasterOutcode( Point(DP[i].x, DP[i].y, DP[i].z) );
+  }
+  
+  const Camera *camera;
+  point *DP;
+  unsigned char *codes;
+};
+
+// flag tetras possibly intersecting the view (not all vertices outside the same side) which are
+// not yet computed, then compute the gradients of a list of such tetras into their slots
+struct TetraGradBuilder {
+  TetraGradBuilder(ArepoMesh *am) : mesh(am), codes(NULL), newTets(NULL) { }
+  
+  void operator()(int i0, int i1, int threadNum) {
+    for( int i = i0; i < i1; i++ ) {
+      if( !newTets ) {
+        if( mesh->tetraGradSlot[i] != -1 )
+          continue;
+          
+        tetra *t = &mesh->DT[i];
+        if( t->p[0] < 0 || t->p[1] < 0 || t->p[2] < 0 || t->p[3] < 0 )
+          continue;
+        if( codes && (codes[t->p[0]] & codes[t->p[1]] & codes[t->p[2]] & codes[t->p[3]]) )
+          continue;
+          
+        mesh->tetraGradSlot[i] = -2; // wanted
+        continue;
+      }
+      
+      int tt = (*newTets)[i];
+      TetraGrad *tg = &mesh->tetraGrads[ mesh->tetraGradSlot[tt] ];
+      
+      if( !mesh->calcTetraGrad(tt, tg) ) {
+        tg->sph0 = -1;
+        tg->grad[0] = tg->grad[1] = tg->grad[2] = 0.0;
+      }
+    }
+  }
+  
+  ArepoMesh *mesh;
+  unsigned char *codes;
+  vector<int> *newTets;
+};
+#endif
+
+void ArepoMesh::precomputeTetraGrads(const Camera *camera)
+{
+#ifdef DTFE_INTERP
+  Timer timer;
+  timer.Start();
+  
+  // slots persist across frames, only tetras newly entering the view are computed
+  if( tetraGradSlot.empty() )
+    tetraGradSlot.assign(Ndt, -1);
+  
+  TetraGradBuilder builder(this);
+  vector<unsigned char> codes;
+  
+  if( camera ) {
+    codes.resize(Ndp);
+    PointOutcoder outcoder(camera, DP, &codes[0]);
+    parallelFor(Ndp, outcoder);
+    builder.codes = &codes[0];
+  }
+  
+  // first pass: flag, then assign compact slots in tetra order
+  parallelFor(Ndt, builder);
+  
+  vector<int> newTets;
+  
+  for( int i = 0; i < Ndt; i++ ) {
+    if( tetraGradSlot[i] != -2 )
       continue;
+      
+    tetraGradSlot[i] = tetraGrads.size() + newTets.size();
+    newTets.push_back(i);
+  }
+  
+  // second pass: compute
+  tetraGrads.resize( tetraGrads.size() + newTets.size() );
+  
+  builder.newTets = &newTets;
+  parallelFor(newTets.size(), builder);
+  
+  if (Config.verbose)
+    cout << "[" << ThisTask << "] ArepoMesh: DTFE gradients for [" << newTets.size() << "] new tetras, [" 
+         << tetraGrads.size() << "] of [" << Ndt << "] total in [" << (float)timer.Time() << "] seconds." << endl;
+#endif
+}
+
+#ifdef NATURAL_NEIGHBOR_INNER
+// is this connection usable as a first/second order natural neighbor?
+inline bool ringConnectionValid(int edge)
+{
+  // could connect to bounding tetra if we don't have a ghost across this boundary
+  if ( DC[edge].index < 0 )
+    return false;
+#if defined(NO_GHOST_CONTRIBS) || defined(NATURAL_NEIGHBOR_INTERP)
+  if ( DC[edge].dp_index >= NumGas ) // note: GHOSTS
+    return false;
+#endif
+  return true;
+}
+
+inline bool sameSphP(const pair<int,int> &a, const pair<int,int> &b)
+{
+  return a.first == b.first;
+}
+
+// first and second order natural neighbors of one cell as (SphP,DP) pairs, unique and sorted by SphP
+void gatherNeighborRing(int sphInd, vector< pair<int,int> > &ring)
+{
+  ring.clear();
+  
+  int edge = SphP[sphInd].first_connection;
+  int last_edge = SphP[sphInd].last_connection;
+  
+  while(edge >= 0)
+  {
+    if ( ringConnectionValid(edge) && DC[edge].index != sphInd )
+    {
+      int sphp_neighbor = DC[edge].index;
+      ring.push_back( make_pair(sphp_neighbor, DC[edge].dp_index) );
+      
+      // loop over neighbors of neighbors, skip the primary parent (added at sampling time)
+      int inner_edge = SphP[sphp_neighbor].first_connection;
+      int inner_last_edge = SphP[sphp_neighbor].last_connection;
+      
+      while(inner_edge >= 0) {
+        if ( ringConnectionValid(inner_edge) && DC[inner_edge].index != sphInd )
+          ring.push_back( make_pair(DC[inner_edge].index, DC[inner_edge].dp_index) );
+          
+        if(inner_edge == inner_last_edge)
+          break;
+        inner_edge = DC[inner_edge].next;
+      }
     }
     
-    // reciprocal of determinant
-    det_A = 1.0 / det_A;
+    if(edge == last_edge)
+      break;
+    edge = DC[edge].next;
+  }
+  
+  sort( ring.begin(), ring.end() );
+  ring.erase( unique(ring.begin(), ring.end(), sameSphP), ring.end() );
+}
+
+// parallel worker: count (fill=false) or write (fill=true) the CSR neighbor lists of a cell range
+struct NeighborRingBuilder {
+  NeighborRingBuilder(int *off, int *sph, int *dp) : offset(off), ringSph(sph), ringDP(dp), fill(false) {
+    rings.resize( numberOfCores() );
+  }
+  
+  void operator()(int i0, int i1, int threadNum) {
+    vector< pair<int,int> > &ring = rings[threadNum];
+    
+    for( int i = i0; i < i1; i++ ) {
+      gatherNeighborRing(i, ring);
+      
+      if( !fill ) {
+        offset[i+1] = ring.size();
+        continue;
+      }
+      
+      for( unsigned int j = 0; j < ring.size(); j++ ) {
+        ringSph[offset[i]+j] = ring[j].first;
+        ringDP[offset[i]+j]  = ring[j].second;
+      }
+    }
+  }
+  
+  int *offset, *ringSph, *ringDP;
+  bool fill;
+  vector< vector< pair<int,int> > > rings; // per thread
+};
+#endif
+
+void ArepoMesh::precomputeNeighborRings()
+{
+#ifdef NATURAL_NEIGHBOR_INNER
+  Timer timer;
+  timer.Start();
+  
+  RingOffset = new int[NumGas+1];
+  RingOffset[0] = 0;
+  
+  // first pass: count, then prefix sum into offsets
+  NeighborRingBuilder builder(RingOffset, NULL, NULL);
+  parallelFor(NumGas, builder);
+  
+  for( int i = 0; i < NumGas; i++ )
+    RingOffset[i+1] += RingOffset[i];
+  
+  // second pass: fill
+  RingSph = new int[ RingOffset[NumGas] ];
+  RingDP  = new int[ RingOffset[NumGas] ];
+  
+  builder.ringSph = RingSph;
+  builder.ringDP  = RingDP;
+  builder.fill    = true;
+  parallelFor(NumGas, builder);
+  
+  if (Config.verbose)
+    cout << "[" << ThisTask << "] ArepoMesh: neighbor rings, " << RingOffset[NumGas] << " entries (" 
+         << (float)RingOffset[NumGas] / max(NumGas,1) << " per cell) in [" << (float)timer.Time() 
+         << "] seconds." << endl;
+#endif
+}
+
+#ifdef CELL_GRADIENTS_LSQ
+// cell values of all TF_VAL quantities (exactly as sampled by addValsContribution)
+struct CellValueFiller {
+  CellValueFiller(float *cv) : cellVals(cv) { }
+  
+  void operator()(int i0, int i1, int threadNum) {
+    vector<float> vals(TF_NUM_VALS);
     
-    // compute A_inv
-    A_inv[0][0] = det_A * ( A[1][1]*A[2][2] - A[1][2]*A[2][1] );
-    A_inv[1][0] = det_A * ( A[1][2]*A[2][0] - A[1][0]*A[2][2] );
-    A_inv[2][0] = det_A * ( A[1][0]*A[2][1] - A[1][1]*A[2][0] );
-    A_inv[0][1] = det_A * ( A[0][2]*A[2][1] - A[0][1]*A[2][2] );
-    A_inv[1][1] = det_A * ( A[0][0]*A[2][2] - A[0][2]*A[2][0] );
-    A_inv[2][1] = det_A * ( A[0][1]*A[2][0] - A[0][0]*A[2][1] );
-    A_inv[0][2] = det_A * ( A[0][1]*A[1][2] - A[0][2]*A[1][1] );
-    A_inv[1][2] = det_A * ( A[0][2]*A[1][0] - A[0][0]*A[1][2] );
-    A_inv[2][2] = det_A * ( A[0][0]*A[1][1] - A[0][1]*A[1][0] );
+    for( int i = i0; i < i1; i++ ) {
+      for( int k = 0; k < TF_NUM_VALS; k++ )
+        vals[k] = 0.0;
+        
+      addValsContribution( vals, i, 1.0 );
+      
+      for( int k = 0; k < TF_NUM_VALS; k++ )
+        cellVals[i*TF_NUM_VALS+k] = vals[k];
+    }
+  }
+  
+  float *cellVals;
+};
+
+struct CellGradBuilder {
+  CellGradBuilder(ArepoMesh *am, const float *cv) : mesh(am), cellVals(cv) {
+    ngbs.resize( numberOfCores() );
+  }
+  
+  void operator()(int i0, int i1, int threadNum) {
+    for( int i = i0; i < i1; i++ )
+      mesh->calcCellGrad(i, cellVals, ngbs[threadNum]);
+  }
+  
+  ArepoMesh *mesh;
+  const float *cellVals;
+  vector< vector<int> > ngbs; // per thread
+};
+#endif
+
+// weighted least-squares gradients of all TF_VAL quantities of cell i from its natural neighbors,
+// each limited such that the reconstruction at the (approximate) face centers, halfway to the 
+// neighbors, stays within the extrema of the cell and its neighbors
+void ArepoMesh::calcCellGrad(int i, const float *cellVals, vector<int> &ngb)
+{
+#ifdef CELL_GRADIENTS_LSQ
+  const float *fi = &cellVals[i*TF_NUM_VALS];
+  float *grad = &cellGrads[i*3*TF_NUM_VALS];
+  
+  double M[3][3] = { {0,0,0}, {0,0,0}, {0,0,0} }, M_inv[3][3];
+  double b[TF_NUM_VALS][3];
+  float fmin[TF_NUM_VALS], fmax[TF_NUM_VALS];
+  
+  for( int k = 0; k < TF_NUM_VALS; k++ ) {
+    b[k][0] = b[k][1] = b[k][2] = 0.0;
+    fmin[k] = fmax[k] = fi[k];
+    grad[3*k+0] = grad[3*k+1] = grad[3*k+2] = 0.0;
+  }
+  
+  // natural neighbors (DP indices, ghosts carry the periodic image positions)
+  ngb.clear();
+  
+  int edge = SphP[i].first_connection;
+  int last_edge = SphP[i].last_connection;
+  
+  while(edge >= 0)
+  {
+    if ( DC[edge].index >= 0 
+#ifdef NO_GHOST_CONTRIBS
+         && DC[edge].dp_index < NumGas
+#endif
+       )
+      ngb.push_back( DC[edge].dp_index );
+      
+    if(edge == last_edge)
+      break;
+      
+    edge = DC[edge].next;
+  }
+  
+  if ( ngb.size() < 3 )
+    return;
+  
+  // accumulate normal equations, weights 1/r^2
+  for( unsigned int j = 0; j < ngb.size(); j++ )
+  {
+    double d[3] = { DP[ngb[j]].x - DP[i].x, DP[ngb[j]].y - DP[i].y, DP[ngb[j]].z - DP[i].z };
+    double w = 1.0 / (d[0]*d[0] + d[1]*d[1] + d[2]*d[2]);
+    const float *fj = &cellVals[ getSphPID(DP[ngb[j]].index) * TF_NUM_VALS ];
     
-    // compute delta_f (field specific)
-    field_0 = SphP[ getSphPID(DP[DT[i].p[0]].index) ].Density;
+    for( int r = 0; r < 3; r++ )
+      for( int c = 0; c < 3; c++ )
+        M[r][c] += w * d[r] * d[c];
+      
+    for( int k = 0; k < TF_NUM_VALS; k++ ) {
+      double df = w * (fj[k] - fi[k]);
+      b[k][0] += df * d[0];
+      b[k][1] += df * d[1];
+      b[k][2] += df * d[2];
+      
+      if( fj[k] < fmin[k] ) fmin[k] = fj[k];
+      if( fj[k] > fmax[k] ) fmax[k] = fj[k];
+    }
+  }
+  
+  // invert (symmetric), degenerate (e.g. coplanar) stencils keep zero gradients
+  double det_M = M[0][0]*(M[1][1]*M[2][2] - M[1][2]*M[2][1]) -
+                 M[0][1]*(M[1][0]*M[2][2] - M[1][2]*M[2][0]) +
+                 M[0][2]*(M[1][0]*M[2][1] - M[1][1]*M[2][0]);
+  double tr_M  = (M[0][0] + M[1][1] + M[2][2]) / 3.0;
+  
+  if ( fabs(det_M) <= 1e-8 * tr_M * tr_M * tr_M )
+    return;
+  
+  det_M = 1.0 / det_M;
+  
+  M_inv[0][0] = det_M * ( M[1][1]*M[2][2] - M[1][2]*M[2][1] );
+  M_inv[0][1] = det_M * ( M[0][2]*M[2][1] - M[0][1]*M[2][2] );
+  M_inv[0][2] = det_M * ( M[0][1]*M[1][2] - M[0][2]*M[1][1] );
+  M_inv[1][0] = M_inv[0][1];
+  M_inv[1][1] = det_M * ( M[0][0]*M[2][2] - M[0][2]*M[2][0] );
+  M_inv[1][2] = det_M * ( M[0][2]*M[1][0] - M[0][0]*M[1][2] );
+  M_inv[2][0] = M_inv[0][2];
+  M_inv[2][1] = M_inv[1][2];
+  M_inv[2][2] = det_M * ( M[0][0]*M[1][1] - M[0][1]*M[1][0] );
+  
+  for( int k = 0; k < TF_NUM_VALS; k++ )
+  {
+    double g[3];
+    for( int r = 0; r < 3; r++ )
+      g[r] = M_inv[r][0]*b[k][0] + M_inv[r][1]*b[k][1] + M_inv[r][2]*b[k][2];
+      
+    // slope limiter
+    double alpha = 1.0;
     
-    delta_f[0] = SphP[ getSphPID(DP[DT[i].p[1]].index) ].Density - field_0;
-    delta_f[1] = SphP[ getSphPID(DP[DT[i].p[2]].index) ].Density - field_0;
-    delta_f[2] = SphP[ getSphPID(DP[DT[i].p[3]].index) ].Density - field_0;
+    for( unsigned int j = 0; j < ngb.size(); j++ )
+    {
+      double dv = 0.5 * ( g[0] * (DP[ngb[j]].x - DP[i].x) + g[1] * (DP[ngb[j]].y - DP[i].y) + 
+                          g[2] * (DP[ngb[j]].z - DP[i].z) );
+                          
+      if ( dv > 0.0 && (fmax[k] - fi[k]) < alpha * dv )
+        alpha = (fmax[k] - fi[k]) / dv;
+      if ( dv < 0.0 && (fmin[k] - fi[k]) > alpha * dv )
+        alpha = (fmin[k] - fi[k]) / dv;
+    }
     
-    // compute the gradient (A_inv * delta_f) and store x,y,z components in DT_grad
-    DT_grad[3*i+0] = A_inv[0][0]*delta_f[0] + A_inv[0][1]*delta_f[1] + A_inv[0][2]*delta_f[2];
-    DT_grad[3*i+1] = A_inv[1][0]*delta_f[0] + A_inv[1][1]*delta_f[1] + A_inv[1][2]*delta_f[2];
-    DT_grad[3*i+2] = A_inv[2][0]*delta_f[0] + A_inv[2][1]*delta_f[1] + A_inv[2][2]*delta_f[2];
+    grad[3*k+0] = alpha * g[0];
+    grad[3*k+1] = alpha * g[1];
+    grad[3*k+2] = alpha * g[2];
   }
 #endif
 }
 
-#ifdef NATURAL_NEIGHBOR_SPHKERNEL
-inline float sph_kernel(float dist, float hinv)
+void ArepoMesh::precomputeCellGrads()
 {
-  float u = dist * hinv;
+#ifdef CELL_GRADIENTS_LSQ
+  Timer timer;
+  timer.Start();
+  
+  cellGrads.assign( 3 * TF_NUM_VALS * NumGas, 0.0 );
+  
+  // first pass: cell values, second pass: gradients
+  vector<float> cellVals( TF_NUM_VALS * NumGas );
   
-  if(u < 0.5)
-    return (KERNEL_COEFF_1 + KERNEL_COEFF_2 * (u - 1) * u * u);
-  if(u < 1.0)
-    return KERNEL_COEFF_5 * (1.0 - u) * (1.0 - u) * (1.0 - u);
-  return 0;
+  CellValueFiller filler(&cellVals[0]);
+  parallelFor(NumGas, filler);
+  
+  CellGradBuilder builder(this, &cellVals[0]);
+  parallelFor(NumGas, builder);
+  
+  if (Config.verbose)
+    cout << "[" << ThisTask << "] ArepoMesh: least-squares gradients of [" << TF_NUM_VALS 
+         << "] quantities in [" << (float)timer.Time() << "] seconds." << endl;
+#endif
 }
 
+#ifdef NATURAL_NEIGHBOR_SPHKERNEL
 float ArepoMesh::calcNeighborHSML(int sphInd, Point &pt)
 {
-  float dx,dy,dz,xtmp,ytmp,ztmp;
+  PeriodicBox<float> box;
   float distsq, hsml2 = 0.0;
   
+#ifdef NATURAL_NEIGHBOR_INNER
+  // furthest of the precomputed first and second order neighbors
+  for( int j = RingOffset[sphInd]; j < RingOffset[sphInd+1]; j++ )
+  {
+    const MyDouble *pos = P[ RingSph[j] ].Pos;
+    distsq = box.distSq(pos[0] - pt.x, pos[1] - pt.y, pos[2] - pt.z);
+    hsml2 = distsq > hsml2 ? distsq : hsml2;
+  }
+#else
   int edge = SphP[sphInd].first_connection;
   int last_edge = SphP[sphInd].last_connection;
   
@@ -240,43 +542,9 @@ float ArepoMesh::calcNeighborHSML(int sphInd, Point &pt)
       continue;
     }
     
-#ifdef NATURAL_NEIGHBOR_INNER
-    // loop over neighbors of neighbors
-    int inner_edge = SphP[sphp_neighbor].first_connection;
-    int inner_last_edge = SphP[sphp_neighbor].last_connection;
-    
-    while(inner_edge >= 0) {
-      // could connect to bounding tetra if we don't have a ghost across this boundary
-      if ( DC[inner_edge].index < 0 ) {
-        if ( inner_edge == inner_last_edge )
-          break;
-        inner_edge = DC[inner_edge].next;
-        continue;
-      }
-              
-      // neighbor of neighbor IDW
-      dx = NGB_PERIODIC_LONG_X(P[ DC[inner_edge].index ].Pos[0] - pt.x);
-      dy = NGB_PERIODIC_LONG_Y(P[ DC[inner_edge].index ].Pos[1] - pt.y);
-      dz = NGB_PERIODIC_LONG_Z(P[ DC[inner_edge].index ].Pos[2] - pt.z);
-      distsq = dx*dx + dy*dy + dz*dz;
-      
-      if(distsq > hsml2)
-        hsml2 = distsq;
-      
-      if(inner_edge == inner_last_edge)
-        break;
-
-      inner_edge = DC[inner_edge].next;
-    }
-#endif // NATURAL_NEIGHBOR_INNER  
-    
-    dx = NGB_PERIODIC_LONG_X(P[sphp_neighbor].Pos[0] - pt.x);
-    dy = NGB_PERIODIC_LONG_Y(P[sphp_neighbor].Pos[1] - pt.y);
-    dz = NGB_PERIODIC_LONG_Z(P[sphp_neighbor].Pos[2] - pt.z);
-    distsq = dx*dx + dy*dy + dz*dz;
-      
-    if(distsq > hsml2)
-      hsml2 = distsq;
+    distsq = box.distSq(P[sphp_neighbor].Pos[0] - pt.x, P[sphp_neighbor].Pos[1] - pt.y, 
+                        P[sphp_neighbor].Pos[2] - pt.z);
+    hsml2 = distsq > hsml2 ? distsq : hsml2;
       
     // move to next neighbor
     if(edge == last_edge)
@@ -289,6 +557,7 @@ float ArepoMesh::calcNeighborHSML(int sphInd, Point &pt)
 
     edge = DC[edge].next;
   }
+#endif // NATURAL_NEIGHBOR_INNER
   
   float hinv = 1.0 / sqrtf(hsml2);
   
@@ -299,105 +568,214 @@ float ArepoMesh::calcNeighborHSML(int sphInd, Point &pt)
 #ifdef NATURAL_NEIGHBOR_INTERP
 void inline periodic_wrap_DP_point(point &dp_pt, Point &ref)
 {
-  // conditional: wrap points to be in same quadrant as ref
-  double dx, dy, dz;
-
-  dx = dp_pt.x - ref.x;
-  dy = dp_pt.y - ref.y;
-  dz = dp_pt.z - ref.z;
-
-  if(dx > boxHalf_X)
-    dp_pt.x -= boxSize_X;
-  if(dx < -boxHalf_X)
-    dp_pt.x += boxSize_X;
-  if(dy > boxHalf_Y)
-    dp_pt.y -= boxSize_Y;
-  if(dy < -boxHalf_Y)
-    dp_pt.y += boxSize_Y;
-  if(dz > boxHalf_Z)
-    dp_pt.z -= boxSize_Z;
-  if(dz < -boxHalf_Z)
-    dp_pt.z += boxSize_Z;
+  // wrap points to be in same quadrant as ref
+  PeriodicBox<double> box;
+  
+  dp_pt.x = ref.x + box.nearest<0>(dp_pt.x - ref.x);
+  dp_pt.y = ref.y + box.nearest<1>(dp_pt.y - ref.y);
+  dp_pt.z = ref.z + box.nearest<2>(dp_pt.z - ref.z);
+}
+
+// insert one natural neighbor (dp_index into the global mesh) into the auxiliary mesh of this thread
+void ArepoMesh::insertAuxMeshPoint(int threadNum, int dp_index, int sph_index, Point &cen)
+{
+  tessellation *AT = &AuxMeshes[threadNum];
+  AuxMeshCache &cache = auxCache[threadNum];
+  
+  // room for this point and the sample point (tetras grow within insert_point_new)
+  if(AT->Ndp + 2 >= AT->MaxNdp) {
+    grow_auxmesh_points(AT);
+    
+    cache.sphInds.resize( AT->MaxNdp );
+    cache.oldVol.resize( AT->MaxNdp );
+    cache.newVol.resize( AT->MaxNdp );
+    cache.inStar.resize( AT->MaxNdp );
+    
+    if (Config.verbose)
+      cout << "[" << ThisTask << "] ArepoMesh: AuxMesh [" << threadNum << "] grown to MaxNdp = " 
+           << AT->MaxNdp << " (MaxNdt = " << AT->MaxNdt << ")." << endl;
+  }
+  
+  // insert point
+  AT->DP[AT->Ndp] = Mesh.DP[ dp_index ];
+  
+  // wrap this DP point to near the parent if necessary
+  // this doesn't necessary work, if some neighbors are wrapped and others aren't we will not get the correct
+  // periodic volume change? in any case, only matters with ghost neighbors, deal with later
+  periodic_wrap_DP_point( AT->DP[AT->Ndp], cen );
+  
+  cache.sphInds[AT->Ndp] = sph_index;
+  
+  IF_DEBUG(cout << "   insertN (dp_index=" << dp_index << " orig x=" << Mesh.DP[ dp_index ].x 
+                << " y=" << Mesh.DP[ dp_index ].y << " z=" << Mesh.DP[ dp_index ].z << ") (wrapped x=" 
+                << AT->DP[AT->Ndp].x << " y=" << AT->DP[AT->Ndp].y << " z=" << AT->DP[AT->Ndp].z 
+                << ") tlast=" << setw(3) << cache.tlast << " totnum=" << setw(2) << AT->Ndp+1 << endl);
+  
+  set_integers_for_pointer( &AT->DP[AT->Ndp] );
+  cache.tlast = insert_point_new(AT, AT->Ndp, cache.tlast);
+  AT->Ndp++;
+}
+
+// build the auxiliary mesh of the natural neighbors (and parent) of sphInd, compute their volumes,
+// and keep a copy of the tessellation such that sample points can be inserted and removed again
+void ArepoMesh::buildAuxMesh(int sphInd, int threadNum)
+{
+  tessellation *AT = &AuxMeshes[threadNum];
+  AuxMeshCache &cache = auxCache[threadNum];
+  
+  Point cen( P[sphInd].Pos[0], P[sphInd].Pos[1], P[sphInd].Pos[2] );
+  
+  // first use on this thread: allocate the arena (kept and grown for the whole run)
+  if ( !AT->DT )
+    alloc_auxmesh(AT, AUXMESH_ALLOC_SIZE / 2, AUXMESH_ALLOC_SIZE);
+  
+  // recreate the voronoi cell of the parent's neighbors (auxiliary mesh approach):
+  init_clear_auxmesh(AT);
+  cache.tlast = 0;
+  
+  if ( (int)cache.sphInds.size() < AT->MaxNdp ) {
+    cache.sphInds.resize( AT->MaxNdp );
+    cache.oldVol.resize( AT->MaxNdp );
+    cache.newVol.resize( AT->MaxNdp );
+    cache.inStar.resize( AT->MaxNdp );
+  }
+    
+#ifdef NATURAL_NEIGHBOR_INNER
+  // precomputed (deduplicated, no ghosts) first and second order natural neighbors
+  for( int j = RingOffset[sphInd]; j < RingOffset[sphInd+1]; j++ )
+    insertAuxMeshPoint(threadNum, RingDP[j], RingSph[j], cen);
+#else
+  int edge = SphP[sphInd].first_connection;
+  int last_edge = SphP[sphInd].last_connection;
+  
+  while(edge >= 0) {
+    // could connect to bounding tetra if we don't have a ghost across this boundary
+    if ( DC[edge].index >= 0 )
+      insertAuxMeshPoint(threadNum, DC[edge].dp_index, DC[edge].index, cen);
+      
+    // move to next neighbor
+    if(edge == last_edge)
+      break;
+      
+#ifdef DEBUG     
+    if (DC[edge].next == edge || DC[edge].next < 0)
+      terminate(" what is going on ");
+#endif
+      
+    edge = DC[edge].next;
+  }
+#endif // NATURAL_NEIGHBOR_INNER
+  
+  // add primary parent as well
+  insertAuxMeshPoint(threadNum, sphInd, sphInd, cen);
+  
+  // compute old circumcircles and volumes
+  compute_circumcircles(AT);
+  compute_auxmesh_volumes(AT, &cache.oldVol[0]);
+  
+#ifdef DEBUG
+  cout << "   old volumes:";
+  for (int kk = 0; kk < AT->Ndp; kk++)
+    cout << " [" << kk << "] " << cache.oldVol[kk];
+  cout << endl;
+#endif
+  
+  // keep a copy of the neighbor tessellation (restored after each sample point)
+  cache.sphInd = sphInd;
+  cache.Ndp    = AT->Ndp;
+  cache.Ndt    = AT->Ndt;
+  
+  if ( (int)cache.DT.size() < AT->MaxNdt ) {
+    cache.DT.resize( AT->MaxNdt );
+    cache.DTC.resize( AT->MaxNdt );
+    cache.DTF.resize( AT->MaxNdt );
+  }
+  
+  memcpy( &cache.DT[0],  AT->DT,  AT->Ndt * sizeof(tetra) );
+  memcpy( &cache.DTC[0], AT->DTC, AT->Ndt * sizeof(tetra_center) );
+  memcpy( &cache.DTF[0], AT->DTF, AT->Ndt * sizeof(char) );
 }
 #endif
 
 #ifdef NNI_WATSON_SAMBRIDGE
-inline bool ArepoMesh::needTet(int tt, point *pp, int *tet_inds, int *nTet)
+// does the circumsphere of global tetra tt contain pp? (i.e. would it be deleted on insertion)
+inline bool ArepoMesh::needTet(int tt, point *pp)
 {
-  // check if this tetra is already in tet_inds, if so skip
-  // we do this instead of a "mark" (could use DT[tt].s[0]) to make this thread safe
-  for (int i=0; i < *nTet; i++)
-    if ( tet_inds[i] == tt )
-      return false;
+  tetra *t = &DT[tt];
+  
+  // the hull (tetras with the point at infinity) is never part of the cavity
+  if ( t->p[0] == DPinfinity || t->p[1] == DPinfinity || 
+       t->p[2] == DPinfinity || t->p[3] == DPinfinity )
+    return false;
 
-  // check if pp is inside tetra tt, use non-exact if possible
-  int ret;
+  // use non-exact if possible: -1 outside, +1 inside, 0 need exact
+  int ret = InSphere_Errorbound( &DP[t->p[0]], &DP[t->p[1]], &DP[t->p[2]], &DP[t->p[3]], pp );
   
-  ret = InSphere_Errorbound( &DP[DT[tt].p[0]], &DP[DT[tt].p[1]], &DP[DT[tt].p[2]],
-                             &DP[DT[tt].p[3]], pp ); // -1 outside, +1 inside, 0 need exact
+  if ( ret == 0 )
+    ret = InSphere_Exact( &DP[t->p[0]], &DP[t->p[1]], &DP[t->p[2]], &DP[t->p[3]], pp );
+  
+  return ( ret > 0 );
+}
 
-  //IF_DEBUG(cout << "   needTet [" << tt << "] ret = " << ret << " pp.x = " << pp->x << endl);
+// index of DP dp in the natural neighbor list, appended if not yet present
+inline int ArepoMesh::addNode(NNIScratch &scr, int dp)
+{
+  int slot = scr.nodeSlot.find(dp);
   
-  if ( ret == 0 ) {
-    terminate(" handle the request for exact insphere ");
-  }
-  else if ( ret > 0 ) {
-    return true; // add
-  }
+  if ( slot >= 0 )
+    return slot;
+      
+  scr.nodeSlot.insert(dp, scr.nodeInds.size());
+  scr.nodeInds.push_back(dp);
+  scr.nodeVols.push_back(0.0);
   
-  return false; // skip
+  return scr.nodeInds.size() - 1;
 }
 
-void ArepoMesh::addTet(int tt, point *pp, int *node_inds, int *tet_inds, int *nNode, int *nTet)
+// flood fill the Bowyer-Watson cavity of pp starting from tetra tt (which contains pp), collecting
+// the tetras into tetInds and their vertices (the natural neighbors of pp) into nodeInds
+// note: we keep our own per thread hash sets instead of a "mark" in DT (could use DT[tt].s[0]) to
+// make this thread safe, they are sized to the cavity (not the mesh) and cleared per sample
+void ArepoMesh::findCavity(int tt, point *pp, NNIScratch &scr)
 {
-  if ( *nNode+3 >= MAX_NUM_TETS || *nTet >= MAX_NUM_NODES )
-    terminate(" addTet reached maximum buffer ");
-    
-  // determine if any of the nodes are already in the node_inds
-  // TODO: could use a set or other STL stuff here instead
-  bool flags[4] = { false, false, false, false };
-  
-  for (int i=0; i < *nNode; i++) {
-    if ( node_inds[i] == DT[tt].p[NODE_A] ) flags[0] = true;
-    if ( node_inds[i] == DT[tt].p[NODE_B] ) flags[1] = true;
-    if ( node_inds[i] == DT[tt].p[NODE_C] ) flags[2] = true;
-    if ( node_inds[i] == DT[tt].p[NODE_D] ) flags[3] = true;
-  }
-    
-  // add nodes and tetra to processing lists
-  if (!flags[0]) {
-    node_inds[*nNode] = DT[tt].p[NODE_A];
-    *nNode += 1;
-  }
-  if (!flags[1]) {
-    node_inds[*nNode] = DT[tt].p[NODE_B];
-    *nNode += 1;
-  }
-  if (!flags[2]) {
-    node_inds[*nNode] = DT[tt].p[NODE_C];
-    *nNode += 1;
-  }
-  if (!flags[3]) {
-    node_inds[*nNode] = DT[tt].p[NODE_D];
-    *nNode += 1;
-  }
-  
-  tet_inds[*nTet] = tt;
-  *nTet += 1;
-  
-  IF_DEBUG(cout << "   addTet [" << tt << "] new nTet = " << *nTet << " nNode = " << *nNode 
-                << " (" << DT[tt].p[NODE_A] << " " << DT[tt].p[NODE_B] << " " << DT[tt].p[NODE_C] 
-                << " " << DT[tt].p[NODE_D] << ")" << endl);
-  
-  // recursively add neighbors of this tetra if needed
-  if ( needTet(DT[tt].t[0], pp, tet_inds, nTet) ) 
-    addTet( DT[tt].t[0], pp, node_inds, tet_inds, nNode, nTet );
-  if ( needTet(DT[tt].t[1], pp, tet_inds, nTet) )
-    addTet( DT[tt].t[1], pp, node_inds, tet_inds, nNode, nTet );
-  if ( needTet(DT[tt].t[2], pp, tet_inds, nTet) )
-    addTet( DT[tt].t[2], pp, node_inds, tet_inds, nNode, nTet );
-  if ( needTet(DT[tt].t[3], pp, tet_inds, nTet) )
-    addTet( DT[tt].t[3], pp, node_inds, tet_inds, nNode, nTet );
+  scr.tetSeen.clear();
+  scr.nodeSlot.clear();
+  scr.tetInds.clear();
+  scr.tetStack.clear();
+  scr.nodeInds.clear();
+  scr.nodeVols.clear();
+  
+  scr.tetSeen.insert(tt, 1);
+  scr.tetInds.push_back(tt);
+  scr.tetStack.push_back(tt);
+  
+  while ( !scr.tetStack.empty() )
+  {
+    int cur = scr.tetStack.back();
+    scr.tetStack.pop_back();
+    
+    for ( int k=0; k < 4; k++ )
+      addNode(scr, DT[cur].p[k]);
+      
+    IF_DEBUG(cout << "   addTet [" << cur << "] nTet = " << scr.tetInds.size() << " nNode = " 
+                  << scr.nodeInds.size() << " (" << DT[cur].p[NODE_A] << " " << DT[cur].p[NODE_B] << " " 
+                  << DT[cur].p[NODE_C] << " " << DT[cur].p[NODE_D] << ")" << endl);
+    
+    for ( int k=0; k < 4; k++ )
+    {
+      int next = DT[cur].t[k];
+      
+      if ( next < 0 || scr.tetSeen.find(next) >= 0 )
+        continue;
+      
+      scr.tetSeen.insert(next, 1);
+        
+      if ( needTet(next, pp) ) {
+        scr.tetInds.push_back(next);
+        scr.tetStack.push_back(next);
+      }
+    }
+  }
 }
 
 double ArepoMesh::ccVolume(double *ci, double *cj, double *ck, double *ct)
@@ -411,6 +789,158 @@ double ArepoMesh::ccVolume(double *ci, double *cj, double *ck, double *ct)
 }
 #endif
 
+#ifdef SUBSAMPLE_BATCH
+// interpolate at all nSamples points of one cell segment at once (SPH/IDW): the natural neighbors
+// are gathered, wrapped and evaluated once per cell, then the weights of all samples form one
+// nSamples x k matrix of contiguous rows, vals receives TF_NUM_VALS per sample
+void ArepoMesh::subSampleCellBatch(const Ray &ray, const Point *pts, int nSamples, float *vals, int threadNum)
+{
+  int sphInd = ray.index;
+  PeriodicBox<float> box;
+  
+  NeighborBatch &ngb = ngbBatch[threadNum];
+  ngb.clear();
+  
+#ifdef NATURAL_NEIGHBOR_INNER
+  // precomputed (deduplicated) first and second order natural neighbors
+  for( int j = RingOffset[sphInd]; j < RingOffset[sphInd+1]; j++ )
+    ngb.inds.push_back( RingSph[j] );
+#else
+  int edge = SphP[sphInd].first_connection;
+  int last_edge = SphP[sphInd].last_connection;
+  
+  while(edge >= 0)
+  {
+    int sphp_neighbor = DC[edge].index;
+    
+    // could connect to bounding tetra if we don't have a ghost across this boundary
+    if ( sphp_neighbor >= 0 
+#ifdef NO_GHOST_CONTRIBS
+                      && DC[edge].dp_index < NumGas
+#endif
+    )
+      ngb.inds.push_back( sphp_neighbor );
+    
+    // move to next neighbor
+    if(edge == last_edge)
+      break;
+      
+#ifdef DEBUG
+    if (DC[edge].next == edge || DC[edge].next < 0)
+      terminate(" what is going on ");
+#endif        
+
+    edge = DC[edge].next;
+  }
+#endif // NATURAL_NEIGHBOR_INNER
+
+#ifdef NATURAL_NEIGHBOR_SPHKERNEL
+  // the smoothing length is set by the furthest natural neighbor (not the parent)
+  int nNgb = ngb.size();
+#endif
+  
+#ifdef NO_GHOST_CONTRIBS
+  if( sphInd < NumGas )
+#endif
+    ngb.inds.push_back( sphInd ); // primary parent
+  
+  int k = ngb.size();
+  
+  // neighbor positions relative to the parent and their values, transposed (k per quantity)
+  vector<float> &tmp = sampleBatch[threadNum].tmp;
+  vector<float> &parentVals = sampleBatch[threadNum].parentVals;
+  
+  tmp.resize(TF_NUM_VALS);
+  parentVals.assign(TF_NUM_VALS, 0.0);
+  
+  ngb.posx.resize(k);
+  ngb.posy.resize(k);
+  ngb.posz.resize(k);
+  ngb.nvals.resize(k * TF_NUM_VALS);
+  
+  for( int j = 0; j < k; j++ )
+  {
+    int n = ngb.inds[j];
+    
+    ngb.posx[j] = box.nearest<0>(P[n].Pos[0] - P[sphInd].Pos[0]);
+    ngb.posy[j] = box.nearest<1>(P[n].Pos[1] - P[sphInd].Pos[1]);
+    ngb.posz[j] = box.nearest<2>(P[n].Pos[2] - P[sphInd].Pos[2]);
+    
+    for( int v = 0; v < TF_NUM_VALS; v++ )
+      tmp[v] = 0.0;
+      
+    addValsContribution( tmp, n, 1.0 );
+    
+    for( int v = 0; v < TF_NUM_VALS; v++ )
+      ngb.nvals[v*k + j] = tmp[v];
+  }
+  
+  addValsContribution( parentVals, sphInd, 1.0 );
+  
+  // weight matrix, one row per sample
+  ngb.distsqMat.resize(nSamples * k);
+  ngb.weightsMat.resize(nSamples * k);
+  
+  for( int i = 0; i < nSamples; i++ )
+  {
+    float *vi = &vals[i * TF_NUM_VALS];
+    
+    float sx = box.nearest<0>(pts[i].x - P[sphInd].Pos[0]);
+    float sy = box.nearest<1>(pts[i].y - P[sphInd].Pos[1]);
+    float sz = box.nearest<2>(pts[i].z - P[sphInd].Pos[2]);
+    
+    // degenerate point in R3
+    if (fabs(sx) <= INSIDE_EPS && fabs(sy) <= INSIDE_EPS && fabs(sz) <= INSIDE_EPS) {
+      for( int v = 0; v < TF_NUM_VALS; v++ )
+        vi[v] = parentVals[v];
+      continue;
+    }
+    
+    for( int v = 0; v < TF_NUM_VALS; v++ )
+      vi[v] = 0.0;
+      
+    if( !k )
+      continue;
+    
+    float * __restrict__ r2 = &ngb.distsqMat[i * k];
+    float * __restrict__ w  = &ngb.weightsMat[i * k];
+    
+    for( int j = 0; j < k; j++ ) {
+      float dx = ngb.posx[j] - sx;
+      float dy = ngb.posy[j] - sy;
+      float dz = ngb.posz[j] - sz;
+      r2[j] = dx*dx + dy*dy + dz*dz;
+    }
+    
+    float hinv = 0.0;
+#ifdef NATURAL_NEIGHBOR_SPHKERNEL
+    float hsml2 = 0.0;
+    for( int j = 0; j < nNgb; j++ )
+      hsml2 = r2[j] > hsml2 ? r2[j] : hsml2;
+    hinv = 1.0 / sqrtf(hsml2);
+#endif
+    
+    float weightsum = NeighborBatch::evalWeights<HSML_FAC_PCT>(r2, w, k, hinv);
+    
+    if( weightsum <= 0.0 )
+      continue;
+    
+    // weighted sums of each quantity (dot products of contiguous rows), then normalize
+    weightsum = 1.0 / weightsum;
+    
+    for( int v = 0; v < TF_NUM_VALS; v++ ) {
+      const float * __restrict__ nv = &ngb.nvals[v * k];
+      float sum = 0.0;
+      
+      for( int j = 0; j < k; j++ )
+        sum += w[j] * nv[j];
+        
+      vi[v] = sum * weightsum;
+    }
+  }
+}
+#endif // SUBSAMPLE_BATCH
+
 // interpolate scalar fields at position pt inside Voronoi cell SphP_ID (various methods)
 int ArepoMesh::subSampleCell(const Ray &ray, Point &pt, vector<float> &vals, int threadNum)
 {
@@ -431,399 +961,131 @@ int ArepoMesh::subSampleCell(const Ray &ray, Point &pt, vector<float> &vals, int
         
 #if defined(NATURAL_NEIGHBOR_IDW) || defined(NATURAL_NEIGHBOR_SPHKERNEL)
 
-  float dx,dy,dz,xtmp,ytmp,ztmp;
-  float weight, weightsum=0, distsq;
-
-#ifdef NATURAL_NEIGHBOR_SPHKERNEL
-  // for SPHKERNEL first need to pick smoothing length
-  float hinv = HSML_FAC * calcNeighborHSML(sphInd,pt);
-#endif
-  
 #ifndef BRUTE_FORCE
-
-  int edge = SphP[sphInd].first_connection;
-  int last_edge = SphP[sphInd].last_connection;
-  
-#ifdef NATURAL_NEIGHBOR_INNER
-  int pri_neighbor_inds[MAX_NON_INDS];
-  int k=0;
-#endif
-  
-  edge = SphP[sphInd].first_connection;
+  // a single sample is a batch of one
+  ArepoMesh::subSampleCellBatch(ray, &pt, 1, &vals[0], threadNum);
+  return 1;
+#else // BRUTE_FORCE
+  float weightsum, distsq, hinv = 0.0;
   
-  while(edge >= 0)
-  {
-    int sphp_neighbor = DC[edge].index;
-    
-    // could connect to bounding tetra if we don't have a ghost across this boundary
-    if ( sphp_neighbor < 0 
-#ifdef NO_GHOST_CONTRIBS
-                      || DC[edge].dp_index >= NumGas
-#endif
-    ) {
-      if ( edge == last_edge )
-        break;
-      edge = DC[edge].next;
-      continue;
-    }
-    
-#ifdef NATURAL_NEIGHBOR_INNER 
-    // loop over neighbors of neighbors
-    int inner_edge = SphP[sphp_neighbor].first_connection;
-    int inner_last_edge = SphP[sphp_neighbor].last_connection;
-    
-    while(inner_edge >= 0) {
-      // could connect to bounding tetra if we don't have a ghost across this boundary
-      if ( DC[inner_edge].index < 0
-#ifdef NO_GHOST_CONTRIBS
-                      || DC[inner_edge].dp_index >= NumGas
-#endif
-      ) {
-        if ( inner_edge == inner_last_edge )
-          break;
-        inner_edge = DC[inner_edge].next;
-        continue;
-      }
-      
-      // skip the primary parent (added later)
-      if ( DC[inner_edge].index == sphInd ) {
-        if(inner_edge == inner_last_edge)
-          break;
-
-        inner_edge = DC[inner_edge].next;
-        continue;
-      }
-      
-      // skip any neighbors we've already done
-      for( int i=0; i < k; i++ ) {
-        if ( DC[inner_edge].index == pri_neighbor_inds[i] ) {
-          if(inner_edge == inner_last_edge)
-            break;
-
-          inner_edge = DC[inner_edge].next;
-          continue;
-        }
-      }
-      
-      // add current cell to handled list (will include first order and second order natural neighbors)
-      if(k >= MAX_NON_INDS)
-        terminate("k %d out of bounds",k);
-      pri_neighbor_inds[k++] = DC[inner_edge].index;
-      
-      // neighbor of neighbor distance
-      dx = NGB_PERIODIC_LONG_X(P[ DC[inner_edge].index ].Pos[0] - pt.x);
-      dy = NGB_PERIODIC_LONG_Y(P[ DC[inner_edge].index ].Pos[1] - pt.y);
-      dz = NGB_PERIODIC_LONG_Z(P[ DC[inner_edge].index ].Pos[2] - pt.z);
-      distsq = dx*dx + dy*dy + dz*dz;
-      
-#ifdef NATURAL_NEIGHBOR_IDW
-      weight = 1.0 / pow( sqrtf(distsq),POWER_PARAM );
-#else // NATURAL_NEIGHBOR_SPHKERNEL
-      weight = sph_kernel( sqrtf(distsq),hinv );
-#endif
-      weightsum += weight;
-      
-      addValsContribution( vals, DC[inner_edge].index, weight );
-    
-      if(inner_edge == inner_last_edge)
-        break;
+  NeighborBatch &ngb = ngbBatch[threadNum];
+  ngb.clear();
 
-      inner_edge = DC[inner_edge].next;
-    }
-#else // NATURAL_NEIGHBOR_INNER (already add first order neighbors as NoN of second order neighbors)
+  // brute force loop over NumGas
+  PeriodicBox<float> box;
   
-    dx = NGB_PERIODIC_LONG_X(P[sphp_neighbor].Pos[0] - pt.x);
-    dy = NGB_PERIODIC_LONG_Y(P[sphp_neighbor].Pos[1] - pt.y);
-    dz = NGB_PERIODIC_LONG_Z(P[sphp_neighbor].Pos[2] - pt.z);
-    distsq = dx*dx + dy*dy + dz*dz;
-      
-#ifdef NATURAL_NEIGHBOR_IDW
-    weight = 1.0 / pow( sqrtf(distsq),POWER_PARAM );
-#else // NATURAL_NEIGHBOR_SPHKERNEL
-    weight = sph_kernel( sqrtf(distsq),hinv );
-#endif
-    weightsum += weight;
-      
-    addValsContribution( vals, sphp_neighbor, weight );
-
-#endif // NATURAL_NEIGHBOR_INNER
+  for( int sphp_neighbor = 0; sphp_neighbor < NumGas; sphp_neighbor++ ) {     
+    distsq = box.distSq(P[sphp_neighbor].Pos[0] - pt.x, P[sphp_neighbor].Pos[1] - pt.y, 
+                        P[sphp_neighbor].Pos[2] - pt.z);
     
-    // move to next neighbor
-    if(edge == last_edge)
-      break;
-      
-#ifdef DEBUG
-    if (DC[edge].next == edge || DC[edge].next < 0 || sphp_neighbor < 0)
-      terminate(" what is going on ");
-#endif        
-
-    edge = DC[edge].next;
-  }
-  
-#ifdef NO_GHOST_CONTRIBS
-  if( sphInd < NumGas )
-  {
-#endif
-  // add in primary parent
-  dx = NGB_PERIODIC_LONG_X(P[sphInd].Pos[0] - pt.x);
-  dy = NGB_PERIODIC_LONG_Y(P[sphInd].Pos[1] - pt.y);
-  dz = NGB_PERIODIC_LONG_Z(P[sphInd].Pos[2] - pt.z);
-  distsq = dx*dx + dy*dy + dz*dz;
-      
-#ifdef NATURAL_NEIGHBOR_IDW
-  weight = 1.0 / pow( sqrtf(distsq),POWER_PARAM );
-#else // NATURAL_NEIGHBOR_SPHKERNEL
-  weight = sph_kernel( sqrtf(distsq),hinv );
-#endif
-  weightsum += weight;
-  
-  addValsContribution( vals, sphInd, weight );
-#ifdef NO_GHOST_CONTRIBS
+    ngb.add( sphp_neighbor, distsq );
   }
-#endif
   
-#else // BRUTE_FORCE
+  hinv = 4.0 / HSML_FAC;
 
-  // brute force loop over NumGas
-  for( int sphp_neighbor = 0; sphp_neighbor < NumGas; sphp_neighbor++ ) {     
-    dx = NGB_PERIODIC_LONG_X(P[sphp_neighbor].Pos[0] - pt.x);
-    dy = NGB_PERIODIC_LONG_Y(P[sphp_neighbor].Pos[1] - pt.y);
-    dz = NGB_PERIODIC_LONG_Z(P[sphp_neighbor].Pos[2] - pt.z);
-    distsq = dx*dx + dy*dy + dz*dz;
-      
-#ifdef NATURAL_NEIGHBOR_IDW
-    weight = 1.0 / pow( sqrtf(distsq),POWER_PARAM );
-#else // NATURAL_NEIGHBOR_SPHKERNEL
-    hinv = 4.0;
-    weight = sph_kernel( sqrtf(distsq),hinv );
-#endif
-    weightsum += weight;
-      
-    addValsContribution( vals, sphp_neighbor, weight );
-  }
-    
-#endif // BRUTE_FORCE
+  // evaluate kernel/idw weights for all neighbors at once
+  weightsum = ngb.computeWeights<HSML_FAC_PCT>(hinv);
+  
+  for( int i=0; i < ngb.size(); i++ )
+    addValsContribution( vals, ngb.inds[i], ngb.weights[i] );
 
   // normalize weights
   weightsum = 1.0 / weightsum;
   
   for( unsigned int i=0; i < vals.size(); i++ )
     vals[i] *= weightsum;
-      
+    
+#endif // BRUTE_FORCE
 #endif // NATURAL_NEIGHBOR_IDW or NATURAL_NEIGHBOR_SPHKERNEL
 
 /* -------------------------------------------------------------------------------------- */
 
 #ifdef NATURAL_NEIGHBOR_INTERP
-  int tlast = 0;
+  tessellation *AT = &AuxMeshes[threadNum];
+  AuxMeshCache &cache = auxCache[threadNum];
   float weight, weightsum = 0.0;
   
-  double dp_old_vol[AUXMESH_ALLOC_SIZE/2];
-  double dp_new_vol[AUXMESH_ALLOC_SIZE/2];
-  int sph_neighbor_inds[AUXMESH_ALLOC_SIZE/2];
-
-  // recreate the voronoi cell of the parent's neighbors (auxiliary mesh approach):
-  init_clear_auxmesh(&AuxMeshes[threadNum]);
-    
-  // construct new auxiliary mesh around pt
-  int edge = SphP[sphInd].first_connection;
-  int last_edge = SphP[sphInd].last_connection;
-  
-#ifdef NATURAL_NEIGHBOR_INNER
-  int nNgb = 0;
-  int pri_neighbor_inds[MAX_NON_INDS];
-#endif
+  // the natural neighbor tessellation (without pt) only depends on the parent cell, so it is
+  // built once when a ray (on this thread) enters a new cell and reused for all samples inside
+  if ( cache.sphInd != sphInd )
+    ArepoMesh::buildAuxMesh(sphInd, threadNum);
   
-  while(edge >= 0) {
-    // could connect to bounding tetra if we don't have a ghost across this boundary
-    if ( DC[edge].index < 0 ) {
-      if ( edge == last_edge )
-        break;
-      edge = DC[edge].next;
-      continue;
-    }
-    
-#ifdef NATURAL_NEIGHBOR_INNER 
-    // loop over neighbors of neighbors
-    int sphp_neighbor = DC[edge].index;
-    int inner_edge = SphP[sphp_neighbor].first_connection;
-    int inner_last_edge = SphP[sphp_neighbor].last_connection;
-    
-    while(inner_edge >= 0) {
-      // skip any neighbors we've already done
-      int flag = 0;
-      
-      for( int i=0; i < nNgb; i++ ) {
-        if ( DC[inner_edge].dp_index == pri_neighbor_inds[i] ) {
-          flag = 1;
-          break;
-        }
-      }
-      
-      // check possible conditions for not adding this NoN
-      if ( DC[inner_edge].index < 0 // could connect to bounding tetra (if no ghost across this bnd)
-           || DC[inner_edge].dp_index >= NumGas // note: GHOSTS
-           || DC[inner_edge].index == sphInd // skip the primary parent (added later)
-           || flag == 1 ) // NoN already done
-      { 
-        if ( inner_edge == inner_last_edge )
-          break;
-        inner_edge = DC[inner_edge].next;
-        continue;
-      }
-      
-      // add current cell to handled list (will include first order and second order natural neighbors)
-      if(nNgb >= MAX_NON_INDS)
-        terminate("nNgb %d out of bounds",nNgb);
-      pri_neighbor_inds[nNgb++] = DC[inner_edge].dp_index;
-      
-      if(AuxMeshes[threadNum].Ndp + 2 >= AuxMeshes[threadNum].MaxNdp)
-        terminate("AuxMesh for NNI exceeds maximum size.");
-      
-      // insert point
-      AuxMeshes[threadNum].DP[AuxMeshes[threadNum].Ndp] = Mesh.DP[ DC[inner_edge].dp_index ];
-      
-      periodic_wrap_DP_point( AuxMeshes[threadNum].DP[AuxMeshes[threadNum].Ndp], pt );
-      
-      sph_neighbor_inds[AuxMeshes[threadNum].Ndp] = DC[inner_edge].index;
-      
-      IF_DEBUG(cout << "   insertNoN (dp_index=" << DC[inner_edge].dp_index 
-                    << " orig x=" << Mesh.DP[ DC[inner_edge].dp_index ].x 
-                    << " y=" << Mesh.DP[ DC[inner_edge].dp_index ].y
-                    << " z=" << Mesh.DP[ DC[inner_edge].dp_index ].z << ") (wrapped x=" 
-                    << AuxMeshes[threadNum].DP[AuxMeshes[threadNum].Ndp].x 
-                    << " y=" << AuxMeshes[threadNum].DP[AuxMeshes[threadNum].Ndp].y 
-                    << " z=" << AuxMeshes[threadNum].DP[AuxMeshes[threadNum].Ndp].z 
-                    << ") tlast=" << setw(3) << tlast << " totnum=" << setw(2) << AuxMeshes[threadNum].Ndp+1 << endl);        
-      
-      set_integers_for_pointer( &AuxMeshes[threadNum].DP[AuxMeshes[threadNum].Ndp] );
-      tlast = insert_point_new(&AuxMeshes[threadNum], AuxMeshes[threadNum].Ndp, tlast);
-      AuxMeshes[threadNum].Ndp++;
-      
-      if(inner_edge == inner_last_edge)
-        break;
-
-      inner_edge = DC[inner_edge].next;
-    }
-#else // NATURAL_NEIGHBOR_INNER (already add first order neighbors as NoN of second order neighbors)
-    int dp_neighbor = DC[edge].dp_index;
-    
-    if(AuxMeshes[threadNum].Ndp + 2 >= AuxMeshes[threadNum].MaxNdp)
-      terminate("AuxMesh for NNI exceeds maximum size.");
-      
-    // insert point
-    AuxMeshes[threadNum].DP[AuxMeshes[threadNum].Ndp] = Mesh.DP[ dp_neighbor ];
-    
-    // wrap this DP point to near our sample point if necessary
-    // this doesn't necessary work, if some neighbors are wrapped and others aren't we will not get the correct
-    // periodic volume change? in any case, only matters with ghost neighbors, deal with later
-    periodic_wrap_DP_point( AuxMeshes[threadNum].DP[AuxMeshes[threadNum].Ndp], pt );
-    
-    sph_neighbor_inds[AuxMeshes[threadNum].Ndp] = DC[edge].index;
-      
-    IF_DEBUG(cout << "   insertN (orig x=" << Mesh.DP[ dp_neighbor ].x << " y=" << Mesh.DP[ dp_neighbor ].y
-                  << " z=" << Mesh.DP[ dp_neighbor ].z << ") (wrapped x=" 
-                  << AuxMeshes[threadNum].DP[AuxMeshes[threadNum].Ndp].x 
-                  << " y=" << AuxMeshes[threadNum].DP[AuxMeshes[threadNum].Ndp].y 
-                  << " z=" << AuxMeshes[threadNum].DP[AuxMeshes[threadNum].Ndp].z 
-                  << ") tlast=" << setw(3) << tlast << " totnum=" << setw(2) << AuxMeshes[threadNum].Ndp+1 << endl);        
-      
-    //set_integers_for_point(&AuxMeshes[threadNum], AuxMeshes[threadNum].Ndp);
-    set_integers_for_pointer( &AuxMeshes[threadNum].DP[AuxMeshes[threadNum].Ndp] );
-    tlast = insert_point_new(&AuxMeshes[threadNum], AuxMeshes[threadNum].Ndp, tlast);
-    AuxMeshes[threadNum].Ndp++;
-      
-#endif // NATURAL_NEIGHBOR_INNER
-      
-    // move to next neighbor
-    if(edge == last_edge)
-      break;
-      
-#ifdef DEBUG     
-    if (DC[edge].next == edge || DC[edge].next < 0)
-      terminate(" what is going on ");
-#endif
-      
-    edge = DC[edge].next;
-  }
+  Point cen( P[sphInd].Pos[0], P[sphInd].Pos[1], P[sphInd].Pos[2] );
   
-  // add primary parent as well
-  AuxMeshes[threadNum].DP[AuxMeshes[threadNum].Ndp] = Mesh.DP[sphInd];
-
-  // wrap
-  periodic_wrap_DP_point( AuxMeshes[threadNum].DP[AuxMeshes[threadNum].Ndp], pt );
+  // add interpolate point
+  int pp = AT->Ndp;
   
-  sph_neighbor_inds[AuxMeshes[threadNum].Ndp] = sphInd;
+  AT->DP[pp].x = pt.x;
+  AT->DP[pp].y = pt.y;
+  AT->DP[pp].z = pt.z;
   
-  IF_DEBUG(cout << "   insertP (orig x=" << Mesh.DP[ sphInd ].x << " y=" << Mesh.DP[ sphInd ].y
-                << " z=" << Mesh.DP[ sphInd ].z << ") (wrapped x=" 
-                << AuxMeshes[threadNum].DP[AuxMeshes[threadNum].Ndp].x 
-                << " y=" << AuxMeshes[threadNum].DP[AuxMeshes[threadNum].Ndp].y 
-                << " z=" << AuxMeshes[threadNum].DP[AuxMeshes[threadNum].Ndp].z 
-                << ") tlast=" << setw(3) << tlast << " totnum=" << setw(2) << AuxMeshes[threadNum].Ndp+1 << endl);    
+  // wrap (consistent with the neighbors, which are wrapped around the parent)
+  periodic_wrap_DP_point( AT->DP[pp], cen );
   
-  set_integers_for_pointer( &AuxMeshes[threadNum].DP[AuxMeshes[threadNum].Ndp] );
-  tlast = insert_point_new(&AuxMeshes[threadNum], AuxMeshes[threadNum].Ndp, tlast);
-  AuxMeshes[threadNum].Ndp++;
+  set_integers_for_pointer( &AT->DP[pp] );
+  insert_point_new(AT, pp, cache.tlast);
+  AT->Ndp++;
   
-  // compute old circumcircles and volumes
-  compute_circumcircles(&AuxMeshes[threadNum]);
-  compute_auxmesh_volumes(&AuxMeshes[threadNum], dp_old_vol);
+  IF_DEBUG(cout << "   inserted interpolate, totnum=" << AT->Ndp << " Ndt=" << AT->Ndt 
+                << " (cached Ndt=" << cache.Ndt << ")" << endl);
+
+  // circumcircles of the modified/new tetras only (insert_point_new clears their DTF flags)
+  compute_circumcircles(AT);
   
-#ifdef DEBUG
-  cout << "   old volumes:";
-  for (int kk = 0; kk < AuxMeshes[threadNum].Ndp; kk++) {
-      cout << " [" << kk << "] " << dp_old_vol[kk];
+  // the star of pt: all points sharing a tetra with it, only their volumes change
+  for ( int i = 0; i < AT->Ndp; i++ )
+    cache.inStar[i] = 0;
+    
+  for ( int i = 0; i < AT->Ndt; i++ ) {
+    tetra *t = &AT->DT[i];
+    
+    if ( t->t[0] < 0 ) // deleted
+      continue;
+    if ( t->p[0] != pp && t->p[1] != pp && t->p[2] != pp && t->p[3] != pp )
+      continue;
+      
+    for ( int j = 0; j < 4; j++ )
+      if ( t->p[j] >= 0 )
+        cache.inStar[ t->p[j] ] = 1;
   }
-  cout << endl;
-#endif    
-  
-  // add interpolate point
-  AuxMeshes[threadNum].DP[AuxMeshes[threadNum].Ndp].x = pt.x;
-  AuxMeshes[threadNum].DP[AuxMeshes[threadNum].Ndp].y = pt.y;
-  AuxMeshes[threadNum].DP[AuxMeshes[threadNum].Ndp].z = pt.z;
   
-  // wrap
-  periodic_wrap_DP_point( AuxMeshes[threadNum].DP[AuxMeshes[threadNum].Ndp], pt );
-  
-  set_integers_for_pointer( &AuxMeshes[threadNum].DP[AuxMeshes[threadNum].Ndp] );
-
-  tlast = insert_point_new(&AuxMeshes[threadNum], AuxMeshes[threadNum].Ndp, tlast);
-  AuxMeshes[threadNum].Ndp++;
-  
-  IF_DEBUG(cout << "   inserted interpolate new tlast=" << tlast << " totnum=" << AuxMeshes[threadNum].Ndp << endl);
-
-  // compute new circumcircles and volumes
-  compute_circumcircles(&AuxMeshes[threadNum]);
-  compute_auxmesh_volumes(&AuxMeshes[threadNum], dp_new_vol);
+  compute_auxmesh_volumes_star(AT, &cache.newVol[0], &cache.inStar[0]);
 
 #ifdef DEBUG
-  cout << "   new volumes:";
-  for (int kk = 0; kk < AuxMeshes[threadNum].Ndp; kk++) {
-      cout << " [" << kk << "] " << dp_new_vol[kk];
-  }
+  cout << "   new volumes (star):";
+  for (int kk = 0; kk < AT->Ndp; kk++)
+    if ( cache.inStar[kk] )
+      cout << " [" << kk << "] " << cache.newVol[kk];
   cout << endl;
 #endif
 
   // normalize by volume of last added cell (around interp point)
-  float invWeight = 1.0 / dp_new_vol[AuxMeshes[threadNum].Ndp-1];
+  float invWeight = 1.0 / cache.newVol[pp];
 
-  // calculate scalar value based on neighbor values and area fraction weights
-  edge = SphP[sphInd].first_connection;
-  
-  // loop over all points added to auxmesh except sample point (inc. pri parent and NoN)
-  for(int k = 0; k < AuxMeshes[threadNum].Ndp-1; k++) {
-    weight = (dp_old_vol[k] - dp_new_vol[k]) * invWeight;
+  // calculate scalar value based on neighbor values and volume fraction weights
+  // (all points not in the star lose no volume and have zero weight)
+  for ( int k = 0; k < pp; k++ ) {
+    if ( !cache.inStar[k] )
+      continue;
+      
+    weight = (cache.oldVol[k] - cache.newVol[k]) * invWeight;
     weightsum += weight;
     
 #ifdef DEBUG
-    cout << " neighbor [k=" << k << "] [sph=" << sph_neighbor_inds[k] << "] weight = " 
+    cout << " neighbor [k=" << k << "] [sph=" << cache.sphInds[k] << "] weight = " 
          << weight << " weightsum = " << weightsum << endl;
 #endif
     
-    addValsContribution( vals, sph_neighbor_inds[k], weight );
+    addValsContribution( vals, cache.sphInds[k], weight );
   }
   
+  // remove the interpolate point again: restore the cached neighbor tessellation
+  AT->Ndp = cache.Ndp;
+  AT->Ndt = cache.Ndt;
+  memcpy( AT->DT,  &cache.DT[0],  cache.Ndt * sizeof(tetra) );
+  memcpy( AT->DTC, &cache.DTC[0], cache.Ndt * sizeof(tetra_center) );
+  memcpy( AT->DTF, &cache.DTF[0], cache.Ndt * sizeof(char) );
+  
   // do the volumes lost by all the natural neighbors add up to the sample pt cell volume?
   if ( fabs(weightsum - 1.0) > 0.01 ) // 1% tolerance
     terminate("NNI weight error is large (%g).",weightsum);
@@ -834,7 +1096,7 @@ int ArepoMesh::subSampleCell(const Ray &ray, Point &pt, vector<float> &vals, int
 
 #ifdef DTFE_INTERP
   // use DT[tt].p[0] as the x_i sample point
-  int tt0_DPID   = DT[ray.tetra].p[0];
+  int tt0_DPID = DT[ray.tetra].p[0];
   
   // if p[0] is part of the bounding tetra (we are on the edge), cannot do DTFE
   if (tt0_DPID < 0) {
@@ -842,21 +1104,34 @@ int ArepoMesh::subSampleCell(const Ray &ray, Point &pt, vector<float> &vals, int
     return 0;
   }
   
-  int tt0_SphPID = getSphPID(DP[tt0_DPID].index);
+  // precomputed for tetras in the view, otherwise (culling is conservative) compute directly
+  TetraGrad tg;
+  int slot = tetraGradSlot.empty() ? -1 : tetraGradSlot[ray.tetra];
+  
+  if (slot >= 0)
+    tg = tetraGrads[slot];
+  else if (!calcTetraGrad(ray.tetra, &tg))
+    tg.sph0 = -1;
+  
+  if (tg.sph0 < 0) {
+    IF_DEBUG(cout << "  dtfe: degenerate tetra " << ray.tetra << ", skipping!" << endl);
+    return 0;
+  }
   
-  Vector p0cen( DP[tt0_DPID].x, DP[tt0_DPID].y, DP[tt0_DPID].z );
-  Vector tetraGrad( DT_grad[3*ray.tetra+0], DT_grad[3*ray.tetra+1], DT_grad[3*ray.tetra+2] );
+  int tt0_SphPID = tg.sph0;
   
-  pt -= p0cen; // make relative to p[0] position (not Voronoi center)
+  // make relative to p[0] position (not Voronoi center)
+  Vector dpt( pt.x - DP[tt0_DPID].x, pt.y - DP[tt0_DPID].y, pt.z - DP[tt0_DPID].z );
+  Vector tetraGrad( tg.grad[0], tg.grad[1], tg.grad[2] );
 
   // apply the (linear) gradient to the sampling point
   addValsContribution( vals, tt0_SphPID, 1.0 );
-  vals[TF_VAL_DENS] += Dot(tetraGrad,pt);
+  vals[TF_VAL_DENS] += Dot(tetraGrad,dpt);
   // dtfe gradients for values other than density not available
   
 #ifdef DEBUG
   cout << "  dtfe: tt = " << ray.tetra << " p0 = " << tt0_DPID << " sph0 = " << tt0_SphPID << endl;
-  pt.print("  dtfe: relative point ");
+  dpt.print("  dtfe: relative point ");
   cout << "  dtfe: dens = " << vals[TF_VAL_DENS] << " sphDens = " << SphP[tt0_SphPID].Density << endl;
 #endif
   
@@ -864,6 +1139,26 @@ int ArepoMesh::subSampleCell(const Ray &ray, Point &pt, vector<float> &vals, int
 
 /* -------------------------------------------------------------------------------------- */
 
+#ifdef NNI_WATSON_SAMBRIDGE
+  // double triplet for our interp point
+  point pp;
+  pp.x = pt.x;
+  pp.y = pt.y;
+  pp.z = pt.z;
+  set_integers_for_pointer(&pp);
+  
+  // compute the tetra/node lists corresponding to natural neighbors, starting the search 
+  // with the current parent tetra
+  NNIScratch &scr = nniScratch[threadNum];
+  ArepoMesh::findCavity(ray.tetra, &pp, scr);
+  
+  int nNode = scr.nodeInds.size();
+  int nTet  = scr.tetInds.size();
+  
+  // total volume sum of voronoi cell that would be added (pieces are in scr.nodeVols)
+  double vol_sum = 0.0;
+#endif
+
 #ifdef NNI_WATSON_SAMBRIDGE
   // const int access_tri_ws[4][3] = { {1, 2, 3}, {2, 3, 0},  {3, 0, 1}, {0, 1, 2} };
   // const int access_nodes_ws[4] = {3,0,1,2}; // used via NODE_X
@@ -878,43 +1173,14 @@ int ArepoMesh::subSampleCell(const Ray &ray, Point &pt, vector<float> &vals, int
   // volumes of four new tetras each composed of 1 original tetra face and the pt
   double va,vb,vc,vd;
   
-  // total volume sum of voronoi cell that would be added (pieces are in DP_vols)
-  double vol_sum = 0.0;
-  
-  // double triplet for our interp point
-  point pp;
-  pp.x = pt.x;
-  pp.y = pt.y;
-  pp.z = pt.z;
-  set_integers_for_pointer(&pp);
-  
-  // compute the tetra/node lists corresponding to natural neighbors
-  int nNode = 0;
-  int nTet = 0;
-  
-  int tet_inds[MAX_NUM_TETS];
-  int node_inds[MAX_NUM_NODES];
-  
-  // start the recursive search with the current parent tetra
-  ArepoMesh::addTet(ray.tetra, &pp, &node_inds[0], &tet_inds[0], &nNode, &nTet);
-  
-  // zero volumes we will accumulate into and make nodeIndex -> DP_vols_index map
-  float DP_vols[MAX_NUM_NODES];
-  multimap<int,int> mm;
-  
-  for ( int i=0; i < nNode; i++ ) {
-    DP_vols[ i ] = 0.0;
-    mm.insert( std::pair<int,int>( node_inds[i], i ) );
-  }
-    
   // loop over natural neighbor tetras
   bool okFlag = true;
   
   for ( int i=0; i < nTet; i++ )
   {
-    int tet = tet_inds[i];
+    int tet = scr.tetInds[i];
     
-    // compute five new circumcenters
+    // compute four new circumcenters
     // cyclic ordering correct? (0=a, 1=b, 2=c, 3=d is incorrect)
     // (Arepo orientation: 3 lies above the oriented triangle formed by 0,1,2)
     // --> (3=a, 0=b, 1=c, 2=d if tri is CCW) (3=a, 0=b, 2=c, 1=d if tri is CW)
@@ -922,8 +1188,11 @@ int ArepoMesh::subSampleCell(const Ray &ray, Point &pt, vector<float> &vals, int
     okFlag &= calc_circumcenter(T, &pp, DT[tet].p[NODE_A], DT[tet].p[NODE_D], DT[tet].p[NODE_C], &ccb[0]);
     okFlag &= calc_circumcenter(T, &pp, DT[tet].p[NODE_A], DT[tet].p[NODE_B], DT[tet].p[NODE_D], &ccc[0]);
     okFlag &= calc_circumcenter(T, &pp, DT[tet].p[NODE_A], DT[tet].p[NODE_C], DT[tet].p[NODE_B], &ccd[0]);
-    okFlag &= calc_circumcenter(T, &(DP[DT[tet].p[NODE_A]]), 
-                              DT[tet].p[NODE_B], DT[tet].p[NODE_C], DT[tet].p[NODE_D], &cct[0]);
+    
+    // the circumcenter of the original tetra is already known from the tessellation
+    cct[0] = DTC[tet].cx;
+    cct[1] = DTC[tet].cy;
+    cct[2] = DTC[tet].cz;
     
     // compute four volumes
     va = ArepoMesh::ccVolume(&ccb[0],&ccc[0],&ccd[0],&cct[0]);
@@ -932,10 +1201,10 @@ int ArepoMesh::subSampleCell(const Ray &ray, Point &pt, vector<float> &vals, int
     vd = ArepoMesh::ccVolume(&cca[0],&ccc[0],&ccb[0],&cct[0]);
     
     // accumulate volumes onto vertices (nodes)
-    DP_vols[ mm.find( DT[tet].p[NODE_A] )->second ] += va;
-    DP_vols[ mm.find( DT[tet].p[NODE_B] )->second ] += vb;
-    DP_vols[ mm.find( DT[tet].p[NODE_C] )->second ] += vc;
-    DP_vols[ mm.find( DT[tet].p[NODE_D] )->second ] += vd;
+    scr.nodeVols[ addNode(scr, DT[tet].p[NODE_A]) ] += va;
+    scr.nodeVols[ addNode(scr, DT[tet].p[NODE_B]) ] += vb;
+    scr.nodeVols[ addNode(scr, DT[tet].p[NODE_C]) ] += vc;
+    scr.nodeVols[ addNode(scr, DT[tet].p[NODE_D]) ] += vd;
     
     vol_sum += va + vb + vc + vd;
     
@@ -951,41 +1220,50 @@ int ArepoMesh::subSampleCell(const Ray &ray, Point &pt, vector<float> &vals, int
     return 0;
   }
   
-  // we have the final volumes and the normalization, loop once more over the contributing tetras
-  double wt_total = 0.0; // debugging
+  if ( vol_sum <= 0.0 )
+    terminate("Watson-Sambridge produced negative volume for inserted Vcell.");
+#endif // NNI_WATSON_SAMBRIDGE
+
+/* -------------------------------------------------------------------------------------- */
+
+#ifdef NNI_LIANG_HALE
+  terminate("TODO");
+#endif
+
+#ifdef NNI_WATSON_SAMBRIDGE
+  // we have the final volumes and the normalization, loop once more over the natural neighbors
+  // nodes of the global bounding tetra carry no gas, we renormalize by the weight actually used
+  double wt_total = 0.0;
+  vol_sum = 1.0 / vol_sum;
 
   for ( int i=0; i < nNode; i++ )
   {
-    int sphInd = getSphPID(DP[node_inds[i]].index);
+    int dp = scr.nodeInds[i];
+    double wt = scr.nodeVols[i] * vol_sum;
+    
+    if ( dp < 0 || DP[dp].index < 0 || wt < INSIDE_EPS )
+      continue;
+      
+    int sphInd_ngb = getSphPID(DP[dp].index);
     
-    addValsContribution( vals, sphInd, DP_vols[ node_inds[i] ] );
+    addValsContribution( vals, sphInd_ngb, wt );
     
-    IF_DEBUG(cout << "   add node [i " << setw(2) << i << "] [sphInd " << setw(3) << sphInd
-                  << "] Dens = " << SphP[sphInd].Density 
-                  << " wt = " << DP_vols[ mm.find( node_inds[i] )->second ]/vol_sum 
-                  << " ( " << SphP[sphInd].Density * DP_vols[ mm.find( node_inds[i] )->second ] << " )" << endl);
+    IF_DEBUG(cout << "   add node [i " << setw(2) << i << "] [sphInd " << setw(3) << sphInd_ngb
+                  << "] Dens = " << SphP[sphInd_ngb].Density << " wt = " << wt 
+                  << " ( " << SphP[sphInd_ngb].Density * wt << " )" << endl);
                   
-    wt_total += DP_vols[ mm.find( node_inds[i] )->second ];
+    wt_total += wt;
   }
   
-  IF_DEBUG(cout << "   wt_total = " << wt_total << " ( error = " << wt_total - vol_sum << " )" << endl);
+  IF_DEBUG(cout << "   wt_total = " << wt_total << " ( error = " << wt_total - 1.0 << " )" << endl);
   
-  if ( vol_sum <= 0.0 )
-    terminate("Watson-Sambridge produced negative volume for inserted Vcell.");
-  //if ( fabs(wt_total - vol_sum)/vol_sum > 1e-1 )
-  //  terminate("Watson-Sambridge weights failed to sum up to total volume (%g %g %g).",pt.x,pt.y,pt.z);
+  if ( wt_total <= 0.0 )
+    return 0;
   
-  vol_sum = 1.0 / vol_sum;
+  wt_total = 1.0 / wt_total;
   
-  for( int i=0; i < vals.size(); i++ )
-    vals[i] *= vol_sum;
-
-#endif // NNI_WATSON_SAMBRIDGE
-
-/* -------------------------------------------------------------------------------------- */
-
-#ifdef NNI_LIANG_HALE
-  terminate("TODO");
+  for( unsigned int i=0; i < vals.size(); i++ )
+    vals[i] *= wt_total;
 #endif
 
 /* -------------------------------------------------------------------------------------- */
@@ -994,13 +1272,13 @@ int ArepoMesh::subSampleCell(const Ray &ray, Point &pt, vector<float> &vals, int
   // add piecewise constant (nearest cell) values (most other gradients not available)
   addValsContribution( vals, sphInd, 1.0 );
   
-  // periodic displacement between sample point and cell center
+  // periodic displacement from cell center to sample point
+  PeriodicBox<double> box;
   Vector offset;
   
-  float xtmp,ytmp,ztmp;
-  offset[0] = NGB_PERIODIC_LONG_X(P[ sphInd ].Pos[0] - pt.x);
-  offset[1] = NGB_PERIODIC_LONG_Y(P[ sphInd ].Pos[1] - pt.y);
-  offset[2] = NGB_PERIODIC_LONG_Z(P[ sphInd ].Pos[2] - pt.z);   
+  offset[0] = box.nearest<0>(pt.x - P[ sphInd ].Pos[0]);
+  offset[1] = box.nearest<1>(pt.y - P[ sphInd ].Pos[1]);
+  offset[2] = box.nearest<2>(pt.z - P[ sphInd ].Pos[2]);
   
   // apply Voronoi stencil-based linear gradient (available for density)
   // TODO: also available for velocity, pressure (and utherm if we enable MATERIALS/DEREFINE_GENTLY)
@@ -1014,6 +1292,23 @@ int ArepoMesh::subSampleCell(const Ray &ray, Point &pt, vector<float> &vals, int
 
 /* -------------------------------------------------------------------------------------- */
 
+#ifdef CELL_GRADIENTS_LSQ
+  // cell values plus the limited linear correction of each quantity
+  addValsContribution( vals, sphInd, 1.0 );
+  
+  // displacement from the cell center to the sample point (nearest periodic image)
+  PeriodicBox<float> box;
+  float off[3] = { box.nearest<0>(pt.x - P[sphInd].Pos[0]), box.nearest<1>(pt.y - P[sphInd].Pos[1]), 
+                   box.nearest<2>(pt.z - P[sphInd].Pos[2]) };
+  
+  const float *grad = &cellGrads[3 * TF_NUM_VALS * sphInd];
+  
+  for( int k = 0; k < TF_NUM_VALS; k++ )
+    vals[k] += grad[3*k+0] * off[0] + grad[3*k+1] * off[1] + grad[3*k+2] * off[2];
+#endif // CELL_GRADIENTS_LSQ
+
+/* -------------------------------------------------------------------------------------- */
+
 #ifdef CELL_PIECEWISE_CONSTANT
   addValsContribution( vals, sphInd, 1.0 );
 #endif
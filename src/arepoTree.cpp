@@ -8,6 +8,7 @@
 #include "volume.h"
 #include "transfer.h"
 #include "arepo.h"
+#include "distributed.h"
 #include "util.h" // for numberOfCores()
 
 #define NGB_LIST_FAC 4 // times requested nNGB safety margin
@@ -24,12 +25,17 @@ ArepoTree::ArepoTree(const TransferFunction *tf)
   if (Config.verbose)
     cout << "[" << ThisTask << "] ArepoMesh: NumGas = " << NumGas << " NumPart = " << NumPart << endl << endl;
   
-  // allocate variable size tree search return list
-  //int numLists = numberOfCores();
-  //for(int i = 0; i < numLists; i++)
-  //  varNGBLists.push_back( new int[Config.nTreeNGB * NGB_LIST_FAC] );
-    
-  //varNGBList = new int[Config.nTreeNGB * NGB_LIST_FAC]; //OLD
+  // allocate per thread neighbor gather buffers
+  ngbBatch.resize( numberOfCores() );
+  
+  for(unsigned int i = 0; i < ngbBatch.size(); i++) {
+    ngbBatch[i].inds.reserve( Config.nTreeNGB * NGB_LIST_FAC );
+    ngbBatch[i].distsq.reserve( Config.nTreeNGB * NGB_LIST_FAC );
+  }
+  
+  ngbWindow.resize( numberOfCores() );
+  knnHeap.resize( numberOfCores() );
+  hsmlMin = knnHsmlMin( All.BoxSize, NumGas );
   
   // boxsize
   extent = BBox(Point(0.0,0.0,0.0),Point(All.BoxSize,All.BoxSize,All.BoxSize));
@@ -40,57 +46,47 @@ ArepoTree::ArepoTree(const TransferFunction *tf)
   }
 
   IF_DEBUG(extent.print(" ArepoTree extent "));   
+  
+  // mpiRender=composite: rays are traced through the slab of this task only
+  bound = extent;
+  
+  if (Config.mpiRender == "composite") {
+    int axis = compositeAxis();
+    compositeSlab(ThisTask, &bound.pMin[axis], &bound.pMax[axis]);
+  }
+  
+#ifdef GAS_TREE
+  gasTree.Build();
+  
+  // (no Arepo neighbor tree with mpiRender=composite,tiles)
+  if (Config.verbose && Config.mpiRender != "composite" && Config.mpiRender != "tiles")
+    ArepoTree::benchmarkTrees();
+#endif
+
+#ifdef TREE_SCATTER_SPH
+  setupSupport();
+#elif defined(TREE_ANALYTIC_PROJECTION)
+  if (Config.projColDens)
+    setupSupport();
+#endif
 }
 
 ArepoTree::~ArepoTree()
 {
-  // de-allocate variable neighbor lists
-  //int numLists = numberOfCores();
-  //for(int i = 0; i < numLists; i++)
-  //  delete varNGBLists[i];
 }
 
-bool ArepoTree::FindNeighborList(Point &pt, float hsml, int *numngb_int, vector<float> &vals)
+// walk the neighbor tree (based on ngb_treefind_variable, no MPI), call visit(p) for all gas 
+// particles in the leaves of nodes which overlap the search box
+// (the visitor may shrink the search box during the walk)
+template <class Visitor>
+static void walkNgbTree(const PeriodicSearch &search, Visitor &visit)
 {
-  int numngb = 0;
-#if defined(NATURAL_NEIGHBOR_SPHKERNEL) || defined(NATURAL_NEIGHBOR_IDW)
-  // based on ngb_treefind_variable (e.g. CalcTHValWt)
   int node, p;
   struct NgbNODE *current;
-  double dx, dy, dz, xtmp, ytmp, ztmp, r, wk, weight, h2, r2;
-  float search_min[3], search_max[3], search_max_Lsub[3], search_min_Ladd[3];
-  
-#ifdef NATURAL_NEIGHBOR_SPHKERNEL
-  double u, hinv, hinv3;
-  
-  hinv = 1.0 / hsml;
-  hinv3 = hinv * hinv * hinv;
-#endif
-  
-  h2 = hsml * hsml;
-  r2 = 0.0;
-  weight = 0.0;
   
   // starting node
   node = Ngb_MaxPart;
-    
-  // search bounds
-  search_min[0] = pt.x - hsml;
-  search_min[1] = pt.y - hsml;
-  search_min[2] = pt.z - hsml;
-  search_max[0] = pt.x + hsml;
-  search_max[1] = pt.y + hsml;
-  search_max[2] = pt.z + hsml;
-
-  search_max_Lsub[0] = search_max[0] - boxSize_X;
-  search_max_Lsub[1] = search_max[1] - boxSize_Y;
-  search_max_Lsub[2] = search_max[2] - boxSize_Z;
-
-  search_min_Ladd[0] = search_min[0] + boxSize_X;
-  search_min_Ladd[1] = search_min[1] + boxSize_Y;
-  search_min_Ladd[2] = search_min[2] + boxSize_Z;
-  
-  // start search
+  
   while(node >= 0)
   {
     if(node < Ngb_MaxPart)  // single particle
@@ -101,53 +97,7 @@ bool ArepoTree::FindNeighborList(Point &pt, float hsml, int *numngb_int, vector<
       if(P[p].Type > 0) // not gas particle
         continue;
       
-      dx = NGB_PERIODIC_LONG_X(P[p].Pos[0] - pt.x);
-      if(dx > hsml)
-        continue;
-        
-      dy = NGB_PERIODIC_LONG_Y(P[p].Pos[1] - pt.y);
-      if(dy > hsml)
-        continue;
-        
-      dz = NGB_PERIODIC_LONG_Z(P[p].Pos[2] - pt.z);
-      if(dz > hsml)
-        continue;
-      
-      r2 = dx * dx + dy * dy + dz * dz;
-      
-      if( r2 < h2 )
-      {
-        //if( numngb >= Config.nTreeNGB * NGB_LIST_FAC )
-        //  terminate("going to buffer overrun, increase NGB_LIST_FAC");
-          
-        r = sqrt(r2);
-#ifdef NATURAL_NEIGHBOR_IDW
-        wk = 1.0 / pow( r,POWER_PARAM );
-#else
-
-#ifdef NATURAL_NEIGHBOR_SPHKERNEL
-        u = r * hinv;
-        
-        if(u < 0.5)
-          wk = hinv3 * (KERNEL_COEFF_1 + KERNEL_COEFF_2 * (u - 1) * u * u);
-        else
-          wk = hinv3 * KERNEL_COEFF_5 * (1.0 - u) * (1.0 - u) * (1.0 - u);
-
-        wk = NORM_COEFF * wk / hinv3;
-#endif
-
-#endif // NATURAL_NEIGHBOR_IDW
-
-        // accumulate weights and add to neighbor list
-        weight += wk;
-        
-        //varNGBList[numngb++] = p;
-        numngb++;
-        
-        // TEST: store directly weighted values
-        addValsContribution( vals, p, wk );
-      }
-      
+      visit(p);
     }
     else if(node < Ngb_MaxPart + Ngb_MaxNodes) // internal node
     {
@@ -157,19 +107,7 @@ bool ArepoTree::FindNeighborList(Point &pt, float hsml, int *numngb_int, vector<
       node = current->u.d.sibling;
 
       // next check against bound
-      if(search_min[0] > current->u.d.range_max[0] && search_max_Lsub[0] < current->u.d.range_min[0])
-        continue;
-      if(search_min_Ladd[0] > current->u.d.range_max[0] && search_max[0] < current->u.d.range_min[0])
-        continue;
-
-      if(search_min[1] > current->u.d.range_max[1] && search_max_Lsub[1] < current->u.d.range_min[1])
-        continue;
-      if(search_min_Ladd[1] > current->u.d.range_max[1] && search_max[1] < current->u.d.range_min[1])
-        continue;
-
-      if(search_min[2] > current->u.d.range_max[2] && search_max_Lsub[2] < current->u.d.range_min[2])
-        continue;
-      if(search_min_Ladd[2] > current->u.d.range_max[2] && search_max[2] < current->u.d.range_min[2])
+      if(search.disjoint(current->u.d.range_min, current->u.d.range_max))
         continue;
 
       node = current->u.d.nextnode; // need to open the node
@@ -180,6 +118,198 @@ bool ArepoTree::FindNeighborList(Point &pt, float hsml, int *numngb_int, vector<
       continue;
     }
   }
+}
+
+// gather all gas particles within hsml of pt
+struct BallGather {
+  BallGather(const Point &p, float hsml, NeighborBatch &n) : pt(p), h2(hsml*hsml), ngb(n) { }
+  
+  void operator()(int p) {
+    double r2 = box.distSq(P[p].Pos[0] - pt.x, P[p].Pos[1] - pt.y, P[p].Pos[2] - pt.z);
+    
+    if( r2 < h2 )
+      ngb.add( p, r2 );
+  }
+  
+  PeriodicBox<double> box;
+  const Point &pt;
+  double h2;
+  NeighborBatch &ngb;
+};
+
+// gather all gas particles within rad of the segment a + s*dir, s in [0,len] (dir normalized)
+struct CapsuleGather {
+  CapsuleGather(const Point &a, const Vector &dir, float len, float rad, vector< pair<float,int> > &e)
+    : len(len), rad2(rad*rad), ents(e)
+  {
+    ax = a.x; ay = a.y; az = a.z;
+    dx = dir.x; dy = dir.y; dz = dir.z;
+  }
+  
+  void operator()(int p) {
+    float ox = box.nearest<0>(P[p].Pos[0] - ax);
+    float oy = box.nearest<1>(P[p].Pos[1] - ay);
+    float oz = box.nearest<2>(P[p].Pos[2] - az);
+    
+    // projection onto the ray, distance to the closest point of the segment
+    float s  = ox*dx + oy*dy + oz*dz;
+    float sc = s < 0.0f ? 0.0f : (s > len ? len : s);
+    
+    ox -= sc * dx;
+    oy -= sc * dy;
+    oz -= sc * dz;
+    
+    if( ox*ox + oy*oy + oz*oz < rad2 )
+      ents.push_back( make_pair(s, p) );
+  }
+  
+  PeriodicBox<float> box;
+  float ax, ay, az, dx, dy, dz;
+  float len, rad2;
+  vector< pair<float,int> > &ents;
+};
+
+#if defined(TREE_KNN) && !defined(TREE_NEIGHBOR_WINDOW) && !defined(GAS_TREE)
+// offer all gas particles within the search cube to a bounded heap, pruning the remaining walk
+// by the current k-th nearest distance
+struct KNNGather {
+  KNNGather(const Point &p, float guess, KNNHeap &h, PeriodicSearch &s) 
+    : pt(p), r2max(guess*guess), heap(h), search(s) { }
+  
+  void operator()(int p) {
+    double r2 = box.distSq(P[p].Pos[0] - pt.x, P[p].Pos[1] - pt.y, P[p].Pos[2] - pt.z);
+    
+    if( r2 >= r2max || !heap.push(r2, p) || !heap.full() )
+      return;
+    
+    r2max = heap.top();
+    search.set(pt.x, pt.y, pt.z, sqrt(r2max));
+  }
+  
+  PeriodicBox<double> box;
+  const Point &pt;
+  double r2max;
+  KNNHeap &heap;
+  PeriodicSearch &search;
+};
+#endif
+
+#ifdef GAS_TREE
+// compare ball query throughput of the Arepo neighbor tree and the GasTree (single thread), at
+// the radius which holds nTreeNGB particles on average, centered near evenly strided gas particles
+void ArepoTree::benchmarkTrees()
+{
+  int nQueries = min(NumGas, GASTREE_BENCH_QUERIES);
+  
+  if( !nQueries || !gasTree.NumPart() )
+    return;
+    
+  double boxVol = (double)boxSize_X * boxSize_Y * boxSize_Z;
+  float hsml = pow( 3.0 / (4.0 * M_PI) * boxVol * Config.nTreeNGB / gasTree.NumPart(), 1.0/3.0 );
+  
+  vector<Point> pts(nQueries);
+  for( int i = 0; i < nQueries; i++ ) {
+    int p = (int)((long long)NumGas * i / nQueries);
+    pts[i] = Point(P[p].Pos[0] + 0.3*hsml, P[p].Pos[1] - 0.2*hsml, P[p].Pos[2] + 0.1*hsml);
+  }
+  
+  NeighborBatch &ngb = ngbBatch[0];
+  long long numArepo = 0, numGasTree = 0;
+  Timer timer;
+  
+  timer.Start();
+  for( int i = 0; i < nQueries; i++ ) {
+    ngb.clear();
+    PeriodicSearch search;
+    search.set(pts[i].x, pts[i].y, pts[i].z, hsml);
+    
+    BallGather gather(pts[i], hsml, ngb);
+    walkNgbTree(search, gather);
+    numArepo += ngb.size();
+  }
+  float timeArepo = (float)timer.Time();
+  
+  timer.Reset();
+  timer.Start();
+  for( int i = 0; i < nQueries; i++ ) {
+    ngb.clear();
+    gasTree.Ball(pts[i], hsml, ngb);
+    numGasTree += ngb.size();
+  }
+  float timeGasTree = (float)timer.Time();
+  
+  // verify (untimed): both trees must return the same particles for each query
+  int numDiffer = 0;
+  vector<int> indsArepo;
+  
+  for( int i = 0; i < nQueries; i++ ) {
+    ngb.clear();
+    PeriodicSearch search;
+    search.set(pts[i].x, pts[i].y, pts[i].z, hsml);
+    
+    BallGather gather(pts[i], hsml, ngb);
+    walkNgbTree(search, gather);
+    indsArepo = ngb.inds;
+    
+    ngb.clear();
+    gasTree.Ball(pts[i], hsml, ngb);
+    
+    sort( indsArepo.begin(), indsArepo.end() );
+    sort( ngb.inds.begin(), ngb.inds.end() );
+    
+    if( indsArepo != ngb.inds )
+      numDiffer++;
+  }
+  
+  ngb.clear();
+  
+  cout << "[" << ThisTask << "] ArepoTree: [" << nQueries << "] ball queries (hsml = " << hsml << "), Arepo tree ["
+       << nQueries / max(timeArepo,1e-6f) << "] GasTree [" << nQueries / max(timeGasTree,1e-6f) << "] queries/sec";
+  if( numArepo != numGasTree || numDiffer )
+    cout << " WARNING: neighbors differ in [" << numDiffer << "] queries (counts " << numArepo << " " << numGasTree << ")";
+  cout << endl;
+}
+#endif
+
+#ifdef GAS_TREE
+// per particle smoothing lengths for scatter queries (scatter SPH, analytic projections): the
+// distance to the nTreeNGB-th neighbor, or enclosing nTreeNGB neighbors at the particle density
+void ArepoTree::setupSupport()
+{
+  Timer timer;
+  timer.Start();
+  
+#ifdef TREE_SCATTER_SPH
+  knnSmoothingLengths(gasTree, Config.nTreeNGB, supportHsml, false);
+#else
+  particleHsml(supportHsml, Config.nTreeNGB);
+#endif
+  
+  gasTree.SetSupport(supportHsml);
+  
+#ifdef TREE_ANALYTIC_PROJECTION
+  supportHits.resize( numberOfCores() );
+  
+  // the ray is integrated in pieces such that each particle has a single periodic image
+  if( Config.projColDens && gasTree.MaxSupport() >= 0.5 * boxHalf )
+    terminate("ArepoTree: maximum hsml [%g] too large for analytic projections.", gasTree.MaxSupport());
+#endif
+  
+  if (Config.verbose)
+    cout << "[" << ThisTask << "] ArepoTree: particle hsml, max = " << gasTree.MaxSupport()
+         << ", setup in [" << (float)timer.Time() << "] seconds." << endl;
+}
+#endif
+
+// kernel (support = hsml, no HSML_FAC) or idw weights of the gathered neighbors, fill vals
+int ArepoTree::interpNeighbors(NeighborBatch &ngb, float hsml, vector<float> &vals)
+{
+  int numngb = ngb.size();
+#if defined(NATURAL_NEIGHBOR_SPHKERNEL) || defined(NATURAL_NEIGHBOR_IDW)
+  double weight = ngb.computeWeights<100>( 1.0 / hsml );
+  
+  for( int i=0; i < numngb; i++ )
+    addValsContribution( vals, ngb.inds[i], ngb.weights[i] );
 
   // normalize vals
   weight = 1.0 / weight;
@@ -192,6 +322,132 @@ bool ArepoTree::FindNeighborList(Point &pt, float hsml, int *numngb_int, vector<
        << " ( dens = " << vals[TF_VAL_DENS] << " utherm = " << vals[TF_VAL_TEMP] << " ) " << endl;
 #endif  
 #endif // SPH/IDW
+  return numngb;
+}
+
+bool ArepoTree::FindNeighborList(Point &pt, float hsml, int *numngb_int, vector<float> &vals, int threadNum)
+{
+  int numngb = 0;
+#if defined(NATURAL_NEIGHBOR_SPHKERNEL) || defined(NATURAL_NEIGHBOR_IDW)
+  // gather neighbors during the walk, evaluate weights afterwards in one batch
+  NeighborBatch &ngb = ngbBatch[threadNum];
+  ngb.clear();
+  
+#ifdef GAS_TREE
+  gasTree.Ball(pt, hsml, ngb);
+#else
+  PeriodicSearch search;
+  search.set(pt.x, pt.y, pt.z, hsml);
+  
+  BallGather gather(pt, hsml, ngb);
+  walkNgbTree(search, gather);
+#endif
+  
+  numngb = interpNeighbors(ngb, hsml, vals);
+#endif // SPH/IDW
+  *numngb_int = numngb;
+  
+  if( !numngb )
+    return false; // skip
+
+  return true;
+}
+
+#ifdef TREE_NEIGHBOR_WINDOW
+// refill the window of a ray with all gas within rad of the segment starting at ray(t) of length len
+void ArepoTree::fillNeighborWindow(const Ray &ray, double t, float rad, float len, NeighborWindow &win)
+{
+  double dlen = ray.d.Length();
+  
+  // clamp to the ray, and keep the capsule well inside a half box (single periodic image)
+  if( len > (ray.max_t - t) * dlen )
+    len = (ray.max_t - t) * dlen;
+  if( len > 0.5 * boxHalf - rad )
+    len = 0.5 * boxHalf - rad;
+  if( len < 0.0 )
+    len = 0.0;
+  
+  win.o    = ray.o;
+  win.d    = ray.d;
+  win.t0   = t;
+  win.t1   = t + len / dlen;
+  win.dlen = dlen;
+  win.rad  = rad;
+  win.first = 0;
+  win.ents.clear();
+  
+  // tree walk over the bounding box of the capsule
+  Point a( ray(win.t0) ), b( ray(win.t1) );
+  
+#ifdef GAS_TREE
+  gasTree.Capsule(a, ray.d / dlen, len, rad, win.ents);
+#else
+  float lo[3] = { (float)min(a.x,b.x) - rad, (float)min(a.y,b.y) - rad, (float)min(a.z,b.z) - rad };
+  float hi[3] = { (float)max(a.x,b.x) + rad, (float)max(a.y,b.y) + rad, (float)max(a.z,b.z) + rad };
+  
+  PeriodicSearch search;
+  search.setBounds(lo, hi);
+  
+  CapsuleGather gather(a, ray.d / dlen, len, rad, win.ents);
+  walkNgbTree(search, gather);
+#endif
+  
+  sort( win.ents.begin(), win.ents.end() );
+  
+  IF_DEBUG(cout << " fillNeighborWindow(): t = [" << win.t0 << "," << win.t1 << "] rad = " << rad
+                << " num = " << win.ents.size() << endl);
+}
+
+// gather all gas within hsml of ray(t) from the sliding window of this thread, which is refilled
+// from the tree only if t or hsml leave it (t is usually non-decreasing along each ray)
+void ArepoTree::windowGather(const Ray &ray, double t, float hsml, float stepSize, NeighborBatch &ngb, 
+                             int threadNum)
+{
+  NeighborWindow &win = ngbWindow[threadNum];
+  
+  if( !win.covers(ray, t, hsml) )
+    fillNeighborWindow(ray, t, hsml * TREE_WINDOW_RAD_FAC, TREE_WINDOW_STEPS * stepSize, win);
+  
+  ngb.clear();
+  
+  PeriodicBox<double> box;
+  Point pt( ray(t) );
+  double h2 = hsml * hsml;
+  float sq = (t - win.t0) * win.dlen;
+  int num = (int)win.ents.size();
+  
+  // drop entries behind the sample (no later sample of this window can reach them), unless the
+  // ray is sampled again at an earlier t (e.g. a re-step), then rescan from the start
+  if( t < win.tLast )
+    win.first = 0;
+  
+  win.tLast = t;
+  
+  while( win.first < num && win.ents[win.first].first < sq - win.rad )
+    win.first++;
+  
+  // entries sorted by s, only |s - sq| <= hsml can be within hsml
+  for( int j = win.first; j < num && win.ents[j].first <= sq + hsml; j++ )
+  {
+    if( win.ents[j].first < sq - hsml )
+      continue;
+      
+    int p = win.ents[j].second;
+    double r2 = box.distSq(P[p].Pos[0] - pt.x, P[p].Pos[1] - pt.y, P[p].Pos[2] - pt.z);
+    
+    if( r2 < h2 )
+      ngb.add( p, r2 );
+  }
+}
+
+// as FindNeighborList() at ray(t), but gathering from the sliding window
+bool ArepoTree::FindNeighborListWindow(const Ray &ray, double t, float hsml, float stepSize, 
+                                       int *numngb_int, vector<float> &vals, int threadNum)
+{
+  NeighborBatch &ngb = ngbBatch[threadNum];
+  windowGather(ray, t, hsml, stepSize, ngb, threadNum);
+  
+  int numngb = interpNeighbors(ngb, hsml, vals);
   *numngb_int = numngb;
   
   if( !numngb )
@@ -199,6 +455,163 @@ bool ArepoTree::FindNeighborList(Point &pt, float hsml, int *numngb_int, vector<
 
   return true;
 }
+#endif // TREE_NEIGHBOR_WINDOW
+
+#ifdef TREE_SCATTER_SPH
+// scatter form SPH at pt: sum over all particles whose own kernel covers pt (unnormalized, as the
+// SPH field is defined), hmin the smallest of their hsml
+bool ArepoTree::FindNeighborListScatter(const Point &pt, int *numngb_int, float *hmin, vector<float> &vals, 
+                                        int threadNum)
+{
+  NeighborBatch &ngb = ngbBatch[threadNum];
+  ngb.clear();
+  
+  gasTree.Scatter(pt, ngb);
+  
+  int numngb = ngb.size();
+  ngb.weights.resize(numngb);
+  *hmin = INFINITY;
+  
+  // weights (m/rho) W(r,h_j) / h_j^3
+  for( int i=0; i < numngb; i++ ) {
+    int p = ngb.inds[i];
+    float hinv = 1.0f / supportHsml[p];
+    float vol = SphP[p].Density > 0.0 ? P[p].Mass / SphP[p].Density : 0.0;
+    
+    ngb.weights[i] = vol * SphKernel::W( sqrtf(ngb.distsq[i]) * hinv ) * hinv * hinv * hinv;
+    *hmin = min(*hmin, supportHsml[p]);
+  }
+  
+  for( int i=0; i < numngb; i++ )
+    addValsContribution( vals, ngb.inds[i], ngb.weights[i] );
+  
+  *numngb_int = numngb;
+  
+  IF_DEBUG(cout << " FindNeighborListScatter(): numngb = " << numngb << " hmin = " << *hmin
+                << " dens = " << vals[TF_VAL_DENS] << endl);
+  
+  if( !numngb )
+    return false; // skip
+
+  return true;
+}
+#endif // TREE_SCATTER_SPH
+
+#ifdef TREE_KNN
+// exactly the Config.nTreeNGB nearest gas particles of ray(t), within an initial search radius of
+// guess (doubled until enough are found, e.g. the distance of the k-th neighbor of the previous
+// sample plus the step guarantees a single pass), interpolate with hsml the k-th neighbor distance
+bool ArepoTree::FindNearestNeighbors(const Ray &ray, double t, float guess, float stepSize, float *hsml,
+                                     int *numngb_int, vector<float> &vals, int threadNum)
+{
+  int k = Config.nTreeNGB;
+  Point pt( ray(t) );
+  
+  KNNHeap &heap = knnHeap[threadNum];
+  NeighborBatch &ngb = ngbBatch[threadNum];
+  
+  if( guess < hsmlMin )
+    guess = hsmlMin;
+  
+  while( true )
+  {
+    heap.reset(k);
+    
+#ifdef TREE_NEIGHBOR_WINDOW
+    // all candidates within guess from the window, keep the k nearest
+    windowGather(ray, t, guess, stepSize, ngb, threadNum);
+    
+    for( int i=0; i < ngb.size(); i++ )
+      heap.push( ngb.distsq[i], ngb.inds[i] );
+#elif defined(GAS_TREE)
+    // single tree walk, pruning by the heap top once k candidates are held
+    gasTree.KNearest(pt, guess, heap);
+#else
+    // single tree walk, the search cube shrinks to the heap top once k candidates are held
+    PeriodicSearch search;
+    search.set(pt.x, pt.y, pt.z, guess);
+    
+    KNNGather gather(pt, guess, heap, search);
+    walkNgbTree(search, gather);
+#endif
+
+    if( heap.full() || guess >= boxHalf )
+      break;
+      
+    guess *= 2.0;
+  }
+  
+  // the k nearest (or all within a half box if there are fewer gas particles)
+  ngb.clear();
+  
+  for( unsigned int i=0; i < heap.h.size(); i++ )
+    ngb.add( heap.h[i].second, heap.h[i].first );
+  
+  *hsml = heap.full() ? max( sqrtf(heap.top()), hsmlMin ) : guess;
+  
+  int numngb = interpNeighbors(ngb, *hsml, vals);
+  *numngb_int = numngb;
+  
+  IF_DEBUG(cout << " FindNearestNeighbors(): k = " << k << " numngb = " << numngb << " hsml = " << *hsml << endl);
+  
+  if( !numngb )
+    return false; // skip
+
+  return true;
+}
+#endif // TREE_KNN
+
+#ifdef TREE_ANALYTIC_PROJECTION
+// projColDens without stepping: every particle whose kernel intersects the ray segment
+// [min_t,max_t] adds its values over the effective path length (m/rho) * int W dl, i.e. the
+// raw integrals of the SPH field sum_i (m_i/rho_i) A_i W(r,h_i). the ray is split into pieces
+// shorter than a half box less the largest hsml, such that the minimum image relative to the
+// start of a piece is the only image of a particle which can reach it, and each particle is
+// counted in the piece containing its projection (the first and last piece take those before
+// and after the ray), with its chord clipped to the ends of the ray only
+void ArepoTree::IntegrateRayAnalytic(const Ray &ray, int threadNum)
+{
+  vector<SupportHit> &hits = supportHits[threadNum];
+  vector<float> vals(TF_NUM_VALS);
+  
+  double dlen = ray.d.Length();
+  Vector dir = ray.d / dlen;
+  double len = (ray.max_t - ray.min_t) * dlen;
+  double pieceLen = boxHalf - gasTree.MaxSupport();
+  int nPieces = max( (int)ceil(len / pieceLen), 1 );
+  
+  for( int c = 0; c < nPieces; c++ )
+  {
+    double s0 = len * c / nPieces;
+    double s1 = len * (c+1) / nPieces;
+    
+    hits.clear();
+    gasTree.Support( ray(ray.min_t + s0 / dlen), dir, s1 - s0, hits );
+    
+    for( unsigned int i = 0; i < hits.size(); i++ )
+    {
+      double sp = s0 + hits[i].s; // projection, along the ray from ray(min_t)
+      
+      if( (c > 0 && sp < s0) || (c < nPieces-1 && sp >= s1) )
+        continue; // counted in a neighboring piece
+      
+      int p = hits[i].p;
+      float hinv = 1.0f / hits[i].h;
+      float col = projKernel.chord( hits[i].b2 * hinv * hinv, -sp * hinv, (len - sp) * hinv ) * hinv * hinv;
+      
+      if( col <= 0.0f || SphP[p].Density <= 0.0 )
+        continue;
+      
+      fill( vals.begin(), vals.end(), 0.0f );
+      addValsContribution( vals, p, 1.0 );
+      addRawIntegrals( ray.raw_vals, vals, P[p].Mass / SphP[p].Density * col );
+    }
+  }
+  
+  IF_DEBUG(cout << " IntegrateRayAnalytic(): len = " << len << " pieces = " << nPieces
+                << " coldens = " << ray.raw_vals[0] << endl);
+}
+#endif // TREE_ANALYTIC_PROJECTION
 
 bool ArepoTree::AdvanceRayOneStep(const Ray &ray, double *t0, double *t1, 
                                   Spectrum &Lv, Spectrum &Tr, int threadNum)
@@ -243,8 +656,28 @@ bool ArepoTree::AdvanceRayOneStep(const Ray &ray, double *t0, double *t1,
   min_t_new = Clamp(min_t_new,*t0,*t1); // clamp min_t_new to avoid integrating outside the box
   Point midpt( ray(min_t_new) );
     
+#if defined(TREE_SCATTER_SPH)
+  // scatter form: no hsml to search with, keep the smallest contributing one (for adaptive stepping)
+  float hmin;
+  
+  status = FindNeighborListScatter( midpt, &numngb_int, &hmin, vals, threadNum );
+  if( numngb_int )
+    ray.prevHSML = hmin;
+#elif defined(TREE_KNN)
+  // exact nTreeNGB nearest neighbors: the previous k-th neighbor distance grown by the distance 
+  // moved bounds the new one, hsml for the next sample point is the new k-th neighbor distance
+  float guess = ray.prevHSML + (min_t_new - min_t_old) * ray.d.Length();
+  float hsml;
+  
+  status = FindNearestNeighbors( ray, min_t_new, guess, stepSize, &hsml, &numngb_int, vals, threadNum );
+  ray.prevHSML = hsml;
+#else
   // tree search for N nearest neighbors
-  status = FindNeighborList( midpt, ray.prevHSML, &numngb_int, vals );
+#ifdef TREE_NEIGHBOR_WINDOW
+  status = FindNeighborListWindow( ray, min_t_new, ray.prevHSML, stepSize, &numngb_int, vals, threadNum );
+#else
+  status = FindNeighborList( midpt, ray.prevHSML, &numngb_int, vals, threadNum );
+#endif
   
   // adjust hsml (for the next sample point) based on difference between requested nTreeNGB
   // and the number of neighbors found with this current hsml
@@ -257,6 +690,7 @@ bool ArepoTree::AdvanceRayOneStep(const Ray &ray, double *t0, double *t1,
 #ifdef DEBUG
   cout << " newHsml = " << setprecision(6) << newHsml << " prevHSML = " << setprecision(6) << ray.prevHSML << endl;
 #endif
+#endif // TREE_SCATTER_SPH, TREE_KNN
 
   // sample quantities at this position (now have interpolated densisty,temp,etc)
   // i.e. fill vals vector (currently done in FindNeighborList())
@@ -284,33 +718,12 @@ bool ArepoTree::AdvanceRayOneStep(const Ray &ray, double *t0, double *t1,
     Tr *= Exp(-stepTau); // normal pbrt
     //Tr -= localAlpha * Tr; // similar to DVR
       
-    // update raw column density integrals, same weighting procedure as in voronoi_makeimage_new()
-    // e.g. weight (Temp,Vmag,Ent,Metal) by rho*len and then normalize out at the end
-    float weight = vals[TF_VAL_DENS] * stepSize;
-    
-    // column density
-    ray.raw_vals[0] += vals[TF_VAL_DENS] * stepSize;
-    
-    // mass-weighted values
-    ray.raw_vals[1] += vals[TF_VAL_TEMP] * weight;
-    ray.raw_vals[2] += vals[TF_VAL_VMAG] * weight;
-    ray.raw_vals[3] += vals[TF_VAL_ENTROPY] * weight;
-    ray.raw_vals[4] += vals[TF_VAL_METAL] * weight;
-
-    ray.raw_vals[7] += vals[TF_VAL_BMAG] * weight;
-    ray.raw_vals[8] += vals[TF_VAL_SHOCKDEDT] * weight;
-    
-    // un-weighted line integrals
-    ray.raw_vals[5] += vals[TF_VAL_SZY] * stepSize;
-    if( vals[TF_VAL_TEMP] >= 1e6 ) // xray restriction: hot gas only (Temp > 1e6 K)
-      ray.raw_vals[6] += vals[TF_VAL_XRAY] * stepSize;
-    if( vals[TF_VAL_TEMP] >= 5e5 && vals[TF_VAL_TEMP] < 1e6 ) // ramp off this step
-      ray.raw_vals[6] += (vals[TF_VAL_TEMP]-5e5)/5e5 * vals[TF_VAL_XRAY] * stepSize;
+    addRawIntegrals(ray.raw_vals, vals, stepSize);
   }
 
   // update ray: transfer to next voronoi cell (possibly on different task)
   ray.depth++;
-  ray.task = 0;
+  ray.task = ThisTask;
   ray.min_t = Clamp(min_t_new,ray.min_t,ray.max_t);
     
   IF_DEBUG(cout << " updated ray new task = " << ray.task << " depth = " << ray.depth 
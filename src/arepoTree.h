@@ -7,11 +7,47 @@
 #define AREPO_RT_AREPOTREE_H
 
 #include "transfer.h"
+#include "kernels.h"
+#include "gasTree.h"
 
 #if (NUM_THREADS > 1)
 #include <omp.h>
 #endif
 
+// sliding neighbor window along each ray (SPH/IDW)
+#if defined(TREE_WINDOW_STEPS) && (defined(NATURAL_NEIGHBOR_SPHKERNEL) || defined(NATURAL_NEIGHBOR_IDW))
+#define TREE_NEIGHBOR_WINDOW
+#endif
+
+// exact kernel line integrals for projections
+#if defined(TREE_PROJ_ANALYTIC) && defined(GAS_TREE)
+#define TREE_ANALYTIC_PROJECTION
+#endif
+
+// scatter form SPH
+#if defined(TREE_SCATTER) && defined(GAS_TREE)
+#define TREE_SCATTER_SPH
+#endif
+
+// TREE_NEIGHBOR_WINDOW: gas particles within rad of the ray segment [t0,t1] (a capsule), sorted
+// by their projected position s along the ray (length units relative to ray(t0))
+struct NeighborWindow {
+  NeighborWindow() : t0(0.0), t1(-1.0), dlen(1.0), rad(0.0), first(0), tLast(0.0) { }
+  
+  Point o;              // ray this window belongs to
+  Vector d;
+  double t0, t1;        // covered ray interval (empty if t1 < t0)
+  double dlen;          // length of ray.d
+  float rad;            // capsule radius
+  int first;            // entries before this are behind the current sample
+  double tLast;         // last queried t (first is only valid for t >= tLast)
+  vector< pair<float,int> > ents; // (s, particle index)
+  
+  bool covers(const Ray &ray, double t, float hsml) const {
+    return hsml <= rad && t >= t0 && t <= t1 && o == ray.o && d == ray.d;
+  }
+};
+
 // ArepoTree: expose the neighbor tree data structures and encapsulate tree related functions
 class ArepoTree {
 public:
@@ -23,26 +59,50 @@ public:
   BBox WorldBound() const { return extent; }
   BBox VolumeBound() const { return extent; }
 
-  // world geometry
+  // world geometry (the part of the box rendered by this task)
   bool IntersectP(const Ray &r, double *t0, double *t1) const {
-    return extent.IntersectP(r, t0, t1);
+    return bound.IntersectP(r, t0, t1);
   }
   
   // tree search traversal
-  bool FindNeighborList(Point &pt, float hsml, int *numngb_int, vector<float> &vals);
+  bool FindNeighborList(Point &pt, float hsml, int *numngb_int, vector<float> &vals, int threadNum);
+  bool FindNeighborListWindow(const Ray &ray, double t, float hsml, float stepSize, int *numngb_int,
+                              vector<float> &vals, int threadNum);
+  void fillNeighborWindow(const Ray &ray, double t, float rad, float len, NeighborWindow &win);
+  void windowGather(const Ray &ray, double t, float hsml, float stepSize, NeighborBatch &ngb, int threadNum);
+  bool FindNeighborListScatter(const Point &pt, int *numngb_int, float *hmin, vector<float> &vals, int threadNum);
+  bool FindNearestNeighbors(const Ray &ray, double t, float guess, float stepSize, float *hsml,
+                            int *numngb_int, vector<float> &vals, int threadNum);
+  int interpNeighbors(NeighborBatch &ngb, float hsml, vector<float> &vals);
+  void benchmarkTrees();
   
   // sampling / interpolation
   bool AdvanceRayOneStep(const Ray &ray, double *t0, double *t1, Spectrum &Lv, Spectrum &Tr, int threadNum);
+  void IntegrateRayAnalytic(const Ray &ray, int threadNum);
   
   // data
   
 private:
   // rendering
   BBox extent;
+  BBox bound; // extent, or the slab of this task (mpiRender=composite)
   const TransferFunction *transferFunction;
   
-  //vector<int *> varNGBLists;
-  //int *varNGBList;
+  // per thread neighbor gather buffers
+  vector<NeighborBatch> ngbBatch;
+  vector<NeighborWindow> ngbWindow;
+  vector<KNNHeap> knnHeap;
+  float hsmlMin; // floor of k nearest neighbor radii (TREE_KNN)
+  
+#ifdef TREE_ANALYTIC_PROJECTION
+  vector< vector<SupportHit> > supportHits;
+  ProjectedKernel<SphKernel> projKernel;
+#endif
+  
+  // render-owned neighbor tree (GAS_TREE), with per particle support for scatter queries
+  GasTree gasTree;
+  vector<float> supportHsml;
+  void setupSupport();
 };
 
 #endif //AREPO_RT_AREPOTREE_H
@@ -13,6 +13,7 @@
 #include "camera.h"
 #include "spectrum.h"
 #include "snapio.h"
+#include "distributed.h"
 
 // Filter
 
@@ -33,6 +34,25 @@ BoxFilter *CreateBoxFilter()
 
 // Film
 
+// output filename of the column integrals for the current frame and job
+static string integralsFile()
+{
+  string filename = Config.imageFile;
+  if (filename == "")
+    filename = "frame";
+
+  // use job expansion (sub-jobs) if requested
+  int jobNum = Config.curJobNum;
+  if( Config.expandedJobNum > 0 )
+    jobNum = Config.expandedJobNum;
+
+  // prepend "_curJob_totJobs"
+  if( Config.totNumJobs >= 1 )
+    filename += "_" + toStr(jobNum) + "_" + toStr(Config.totNumJobs*pow(Config.jobExpansionFac,2));
+    
+  return filename + ".hdf5";
+}
+
 Film::Film(int xres, int yres, Filter *filt, const double crop[4], const string &fn, bool openWindow)
     : xResolution(xres), yResolution(yres)
 {
@@ -41,6 +61,7 @@ Film::Film(int xres, int yres, Filter *filt, const double crop[4], const string
   filter = filt;
   memcpy(cropWindow, crop, 4 * sizeof(double));
   filename = fn;
+  integralsFilename = integralsFile();
   
   // Compute film image extent
   xPixelStart = (int)ceil(xResolution * cropWindow[0]);
@@ -54,6 +75,14 @@ Film::Film(int xres, int yres, Filter *filt, const double crop[4], const string
   // Allocate film image storage
   pixels    = new BlockedArray<Pixel>(xPixelCount, yPixelCount);
   integrals = new BlockedArray<RawPixel>(xPixelCount, yPixelCount);
+  transmittance = NULL;
+  
+  if (Config.mpiRender == "composite")
+    transmittance = new BlockedArray<TransPixel>(xPixelCount, yPixelCount);
+  
+  // numaPlacement: spread the image over the memory of the workers
+  numaPlaceMemory(pixels->Data(), pixels->Bytes(), false);
+  numaPlaceMemory(integrals->Data(), integrals->Bytes(), false);
 
   // Precompute filter weight table
   filterTable = new float[FILTER_TABLE_SIZE * FILTER_TABLE_SIZE];
@@ -173,6 +202,41 @@ void Film::AddSample(const CameraSample &sample, const Spectrum &L, const Ray &r
   }
 }
 
+// mpiRender=composite: the transmittance along the camera rays, for compositing the slab images
+void Film::AddTransmittance(const CameraSample &sample, const Spectrum &T)
+{
+  if (!transmittance)
+    return;
+  
+  float dimageX = sample.imageX - 0.5f;
+  float dimageY = sample.imageY - 0.5f;
+  
+  int x0 = max((int)ceilf(dimageX - filter->xWidth), xPixelStart);
+  int x1 = min((int)floorf(dimageX + filter->xWidth), xPixelStart + xPixelCount - 1);
+  int y0 = max((int)ceilf(dimageY - filter->yWidth), yPixelStart);
+  int y1 = min((int)floorf(dimageY + filter->yWidth), yPixelStart + yPixelCount - 1);
+  
+  float rgb[3];
+  T.ToRGB(rgb);
+  
+  // same filter weights as AddSample
+  for (int y = y0; y <= y1; ++y)
+  {
+    int fy = min((int)floorf(fabsf((y - dimageY) * filter->invYWidth * FILTER_TABLE_SIZE)), FILTER_TABLE_SIZE-1);
+    
+    for (int x = x0; x <= x1; ++x)
+    {
+      int fx = min((int)floorf(fabsf((x - dimageX) * filter->invXWidth * FILTER_TABLE_SIZE)), FILTER_TABLE_SIZE-1);
+      float filterWt = filterTable[fy * FILTER_TABLE_SIZE + fx];
+      
+      TransPixel &tpx = (*transmittance)(x - xPixelStart, y - yPixelStart);
+      
+      for (int i = 0; i < 3; i++)
+        tpx.T[i] += filterWt * rgb[i];
+    }
+  }
+}
+
 bool Film::DrawLine(float x1, float y1, float x2, float y2, const Spectrum &L)
 {
   // (x1,y1) and (x2,y2) line segment endpoints in raster space
@@ -452,11 +516,15 @@ void Film::GetPixelExtent(int *xstart, int *xend, int *ystart, int *yend) const
 }
 
 
-void Film::WriteImage(int frameNum, float splatScale)
+// progressive rendering: with stride > 1 each pixel takes the value of the pixel at the corner of
+// its stride^2 block (upsampled), pass > 0 writes a preview which does not set the scaling
+void Film::WriteImage(int frameNum, float splatScale, int stride, int pass)
 {
-IF_DEBUG(cout << "Film:WriteImage(" << frameNum << "," << splatScale << ") nx = " 
+IF_DEBUG(cout << "Film:WriteImage(" << frameNum << "," << splatScale << "," << stride << "," << pass << ") nx = " 
         << xPixelCount << " ny = " << yPixelCount << endl);
   
+  float prevScale[4] = { Config.minScale, Config.maxScale, Config.minAlpha, Config.maxAlpha };
+  
   // Convert image to RGB and compute final pixel values
   int nPix = xPixelCount * yPixelCount;
   float *rgb = new float[3*nPix];
@@ -468,12 +536,16 @@ IF_DEBUG(cout << "Film:WriteImage(" << frameNum << "," << splatScale << ") nx =
   float minAlpha = INFINITY;
   
   for (int y = 0; y < yPixelCount; ++y) {
+      int sy = y - y % stride;
+      
       for (int x = 0; x < xPixelCount; ++x) {
+          int sx = x - x % stride;
+          
           // Convert pixel XYZ color to RGB
-          XYZToRGB((*pixels)(x, y).Lxyz, &rgb[3*offset]);
+          XYZToRGB((*pixels)(sx, sy).Lxyz, &rgb[3*offset]);
 
           // Normalize pixel with weight sum
-          float weightSum = (*pixels)(x, y).weightSum;
+          float weightSum = (*pixels)(sx, sy).weightSum;
           if (weightSum != 0.0f) {
               float invWt = 1.0f / weightSum;
               rgb[3*offset  ] = max(0.0f, rgb[3*offset  ] * invWt);
@@ -482,7 +554,7 @@ IF_DEBUG(cout << "Film:WriteImage(" << frameNum << "," << splatScale << ") nx =
           }
           
           // save min/max of raw density integral
-          alpha[offset] = (*integrals)(x, y).raw_vals[0];
+          alpha[offset] = (*integrals)(sx, sy).raw_vals[0];
           
           if( alpha[offset] < minAlpha ) minAlpha = alpha[offset];
           if( alpha[offset] > maxAlpha ) maxAlpha = alpha[offset];
@@ -498,7 +570,7 @@ IF_DEBUG(cout << "Film:WriteImage(" << frameNum << "," << splatScale << ") nx =
 
           // Add splat value at pixel
           float splatRGB[3];
-          XYZToRGB((*pixels)(x, y).splatXYZ, splatRGB);
+          XYZToRGB((*pixels)(sx, sy).splatXYZ, splatRGB);
           rgb[3*offset  ] += splatScale * splatRGB[0];
           rgb[3*offset+1] += splatScale * splatRGB[1];
           rgb[3*offset+2] += splatScale * splatRGB[2];
@@ -559,8 +631,23 @@ IF_DEBUG(cout << "Film:WriteImage(" << frameNum << "," << splatScale << ") nx =
     }
   }
 
-  // Write RGB image
-  ::WriteImage(filename, rgb, alpha, xPixelCount, yPixelCount,
+  // Write RGB image (previews: "frame.png" -> "frame.pass1.png")
+  string outName = filename;
+  
+  if (pass > 0) {
+    size_t ext = outName.rfind('.');
+    if (ext == string::npos)
+      ext = outName.size();
+    outName.insert(ext, ".pass" + toStr(pass));
+    
+    // scaling is set by the final image
+    Config.minScale = prevScale[0];
+    Config.maxScale = prevScale[1];
+    Config.minAlpha = prevScale[2];
+    Config.maxAlpha = prevScale[3];
+  }
+  
+  ::WriteImage(outName, rgb, alpha, xPixelCount, yPixelCount,
                xResolution, yResolution, xPixelStart, yPixelStart);
 
   // Release temporary image memory
@@ -568,30 +655,17 @@ IF_DEBUG(cout << "Film:WriteImage(" << frameNum << "," << splatScale << ") nx =
   delete[] rgb;
 }
 
-void Film::WriteIntegrals()
+void Film::WriteIntegrals(int stride)
 {
   if( !Config.projColDens )
     return;
     
   IF_DEBUG(cout << "Film:WriteIntegrals() nx = " << xPixelCount << " ny = " << yPixelCount << endl);
   
-  ArepoSnapshot hdf5( Config.imageFile ); // just for hdf5 writing functions
-    
-  // construct hdf5 filename
-  string filename = Config.imageFile;
-  if (filename == "")
-    filename = "frame";
-
-  // use job expansion (sub-jobs) if requested, for output filename and crop[] calculation
-  int jobNum = Config.curJobNum;
-  if( Config.expandedJobNum > 0 )
-    jobNum = Config.expandedJobNum;
-
-  // prepend "_curJob_totJobs"
-  if( Config.totNumJobs >= 1 )
-    filename += "_" + toStr(jobNum) + "_" + toStr(Config.totNumJobs*pow(Config.jobExpansionFac,2));
-    
-  filename += ".hdf5";
+  // hdf5 filename of the frame this film holds
+  string filename = integralsFilename;
+  
+  ArepoSnapshot hdf5( filename ); // just for hdf5 writing functions
   
   // make hdf5 file and groups for different fields
   hdf5.createNewFile( filename );
@@ -611,23 +685,26 @@ void Film::WriteIntegrals()
     
   for (int x = 0; x < xPixelCount; ++x) {
     for (int y = 0; y < yPixelCount; ++y) {
+      // progressive: upsampled from the pixel at the corner of the stride^2 block
+      const RawPixel &rawpx = (*integrals)(x - x % stride, y - y % stride);
+      
       // verify weighting (one sample per pixel)
-      float wt = (*integrals)(x, y).weightSum;
+      float wt = rawpx.weightSum;
       
       if( fabs(wt-TF_NUM_VALS) > INSIDE_EPS )
         cout << "WARNING: wt = " << wt << endl;
 
       // add values into vectors
-      float val_dens  = (*integrals)(x, y).raw_vals[0];
+      float val_dens  = rawpx.raw_vals[0];
       float invWeight = 1.0 / val_dens;
       
-      float val_temp  = (*integrals)(x, y).raw_vals[1] * invWeight;
-      float val_vmag  = (*integrals)(x, y).raw_vals[2] * invWeight;
-      float val_entr  = (*integrals)(x, y).raw_vals[3] * invWeight;
-      float val_metal = (*integrals)(x, y).raw_vals[4] * invWeight;
+      float val_temp  = rawpx.raw_vals[1] * invWeight;
+      float val_vmag  = rawpx.raw_vals[2] * invWeight;
+      float val_entr  = rawpx.raw_vals[3] * invWeight;
+      float val_metal = rawpx.raw_vals[4] * invWeight;
       
-      float val_szy   = (*integrals)(x, y).raw_vals[5];
-      float val_xray  = (*integrals)(x, y).raw_vals[6];
+      float val_szy   = rawpx.raw_vals[5];
+      float val_xray  = rawpx.raw_vals[6];
 
       q_dens.push_back(  val_dens );
       q_temp.push_back(  val_temp );
@@ -652,6 +729,17 @@ void Film::WriteIntegrals()
     cout << " Wrote: [" << filename << "]." << endl << endl;
 }
 
+void Film::SetRawPixel(int x, int y, const double *raw_vals)
+{
+  // x,y in raster space, as AddSample() (one sample per pixel, unit filter weight)
+  RawPixel &rawpx = (*integrals)(x - xPixelStart, y - yPixelStart);
+  
+  for( int i=0; i < TF_NUM_VALS; i++ )
+    rawpx.raw_vals[i] = raw_vals[i];
+    
+  rawpx.weightSum = TF_NUM_VALS;
+}
+
 void Film::WriteRawRGB()
 {
   IF_DEBUG(cout << "Film:WriteRawRGB()" << endl);
@@ -784,10 +872,9 @@ void Film::CalculateScreenWindow(float *screen, int jobNum)
   //  cout << " screen: " << screen[0] << " " << screen[1] << " " << screen[2] << " " << screen[3] << endl;
 }
 
-Film *CreateFilm(Filter *filter)
+// output filename for the current frame and job
+static string filmFilename()
 {
-  double crop[4];
-  
   string filename = Config.imageFile;
   if (filename == "")
     filename = "frame";
@@ -814,6 +901,261 @@ Film *CreateFilm(Filter *filter)
       filename += ".tga";
     }
   }
+  
+  return filename;
+}
+
+// reuse for the next frame: zero the image in place and take its filenames
+void Film::Clear()
+{
+  pixels->Clear();
+  integrals->Clear();
+  if (transmittance)
+    transmittance->Clear();
+  
+  filename = filmFilename();
+  integralsFilename = integralsFile();
+}
+
+// exchange the image storage and output filenames with another film of the same extent (writeQueue)
+void Film::Swap(Film &other)
+{
+  if (other.xPixelCount != xPixelCount || other.yPixelCount != yPixelCount)
+    terminate("Film::Swap() with a film of different extent.");
+  
+  swap(pixels, other.pixels);
+  swap(integrals, other.integrals);
+  swap(transmittance, other.transmittance);
+  swap(filename, other.filename);
+  swap(integralsFilename, other.integralsFilename);
+}
+
+// sum n floats over all tasks onto task 0, in chunks (int counts)
+static void reduceFloats(float *data, size_t n)
+{
+  const size_t chunk = 1 << 24;
+  
+  for (size_t off = 0; off < n; off += chunk) {
+    int count = (int)min(n - off, chunk);
+    
+    if (ThisTask == 0)
+      MPI_Reduce(MPI_IN_PLACE, data + off, count, MPI_FLOAT, MPI_SUM, 0, MPI_COMM_WORLD);
+    else
+      MPI_Reduce(data + off, NULL, count, MPI_FLOAT, MPI_SUM, 0, MPI_COMM_WORLD);
+  }
+}
+
+// mpiRender=rays,tiles: each pixel was added by the one task where its ray completed or which
+// rendered its tile (zero on all others), so the image and raw integrals of task 0 become the full ones by summation
+void Film::Reduce()
+{
+  reduceFloats((float *)pixels->Data(), pixels->Bytes() / sizeof(float));
+  reduceFloats((float *)integrals->Data(), integrals->Bytes() / sizeof(float));
+}
+
+// send elements [send0,send1) of data to the partner task, receive its elements [recv0,recv1) into buf
+template<typename T> static void swapRange(T *data, vector<T> &buf, int partner, size_t send0, size_t send1,
+                                           size_t recv0, size_t recv1)
+{
+  MPI_Datatype type;
+  MPI_Type_contiguous(sizeof(T), MPI_BYTE, &type);
+  MPI_Type_commit(&type);
+  
+  buf.resize(recv1 - recv0);
+  
+  MPI_Sendrecv(data + send0, (int)(send1 - send0), type, partner, 0,
+               buf.empty() ? NULL : &buf[0], (int)(recv1 - recv0), type, partner, 0,
+               MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+  
+  MPI_Type_free(&type);
+}
+
+// collect elements [i0,i1) of data from every task (disjoint, empty if none) on task 0
+template<typename T> static void gatherRanges(T *data, size_t i0, size_t i1)
+{
+  MPI_Datatype type;
+  MPI_Type_contiguous(sizeof(T), MPI_BYTE, &type);
+  MPI_Type_commit(&type);
+  
+  int range[2] = {(int)i0, (int)(i1 - i0)};
+  vector<int> ranges(2 * NTask), offsets(NTask), counts(NTask);
+  
+  MPI_Gather(range, 2, MPI_INT, &ranges[0], 2, MPI_INT, 0, MPI_COMM_WORLD);
+  
+  for (int task = 0; task < NTask; task++) {
+    offsets[task] = ranges[2*task];
+    counts[task]  = ranges[2*task+1];
+  }
+  
+  if (ThisTask == 0)
+    MPI_Gatherv(MPI_IN_PLACE, 0, type, data, &counts[0], &offsets[0], type, 0, MPI_COMM_WORLD);
+  else
+    MPI_Gatherv(data + i0, range[1], type, NULL, NULL, NULL, type, 0, MPI_COMM_WORLD);
+  
+  MPI_Type_free(&type);
+}
+
+// combine the partial image of pixels [i0,i1) with the one received for them, lower if this task
+// holds the lower slabs: emission of the back part attenuated by the transmittance of the front part
+// (the pixel mean, exact for one sample per pixel), raw integrals and projections add up
+void Film::compositeRange(size_t i0, size_t i1, bool lower, const vector<char> &lowerFront,
+                          const Pixel *px, const RawPixel *rawpx, const TransPixel *tpx)
+{
+  Pixel *pixelData       = pixels->Data();
+  RawPixel *rawData      = integrals->Data();
+  TransPixel *transData  = transmittance->Data();
+  
+  for (size_t i = i0; i < i1; i++)
+  {
+    Pixel &pixel        = pixelData[i];
+    RawPixel &raw       = rawData[i];
+    TransPixel &trans   = transData[i];
+    const Pixel &other  = px[i - i0];
+    
+    for (int k = 0; k < TF_NUM_VALS; k++)
+      raw.raw_vals[k] += rawpx[i - i0].raw_vals[k];
+    
+    if (Config.projColDens) {
+      for (int k = 0; k < 3; k++)
+        pixel.Lxyz[k] += other.Lxyz[k];
+      continue;
+    }
+    
+    if (pixel.weightSum <= 0.0f)
+      continue;
+    
+    bool front = (lower == (lowerFront[i] != 0)); // this part in front
+    
+    const float *Lf = front ? pixel.Lxyz : other.Lxyz;
+    const float *Lb = front ? other.Lxyz : pixel.Lxyz;
+    const float *Tf = front ? trans.T : tpx[i - i0].T;
+    const float *Tb = front ? tpx[i - i0].T : trans.T;
+    
+    float invWt = 1.0f / pixel.weightSum;
+    float rgb[3], xyz[3], T[3];
+    
+    XYZToRGB(Lb, rgb);
+    for (int k = 0; k < 3; k++)
+      rgb[k] *= Tf[k] * invWt;
+    RGBToXYZ(rgb, xyz);
+    
+    for (int k = 0; k < 3; k++) {
+      T[k] = Tf[k] * Tb[k] * invWt;
+      xyz[k] += Lf[k];
+    }
+    
+    for (int k = 0; k < 3; k++) {
+      pixel.Lxyz[k] = xyz[k];
+      trans.T[k] = T[k];
+    }
+  }
+}
+
+/* mpiRender=composite: binary-swap compositing of the slab images, in log2(NTask) rounds each task
+ * exchanges half of its current pixel range with the task holding the neighboring group of slabs
+ * and combines the half it keeps, such that every task ends with the complete 1/NTask of the image
+ * (the first tasks are folded in pairs beforehand if NTask is not a power of two), the pieces are
+ * then gathered on task 0
+ */
+void Film::Composite(const Camera *camera)
+{
+  Timer timer;
+  timer.Start();
+  
+  size_t n = pixels->Bytes() / sizeof(Pixel);
+  
+  // depth order of the slabs for each pixel: lower slabs in front if its ray runs up the slab axis
+  int axis = compositeAxis();
+  vector<char> lowerFront(n, 1);
+  
+  for (int y = 0; y < yPixelCount; y++) {
+    for (int x = 0; x < xPixelCount; x++) {
+      CameraSample sample;
+      sample.imageX = xPixelStart + x + 0.5f;
+      sample.imageY = yPixelStart + y + 0.5f;
+      sample.lensU  = sample.lensV = 0.5f;
+      sample.time   = 0.0f;
+      
+      Ray ray;
+      camera->GenerateRay(sample, &ray);
+      
+      lowerFront[ &(*pixels)(x, y) - pixels->Data() ] = (ray.d[axis] >= 0.0);
+    }
+  }
+  
+  vector<Pixel> px;
+  vector<RawPixel> rawpx;
+  vector<TransPixel> tpx;
+  
+  // fold the first 2*extra tasks in pairs, such that a power of two (nSwap) remain, rank in slab order
+  int nSwap = 1;
+  while (2 * nSwap <= NTask)
+    nSwap *= 2;
+  
+  int extra = NTask - nSwap;
+  int rank = (ThisTask < 2 * extra) ? ThisTask / 2 : ThisTask - extra;
+  size_t i0 = 0, i1 = n;
+  
+  if (ThisTask < 2 * extra)
+  {
+    int partner = ThisTask ^ 1;
+    bool lower = (ThisTask % 2 == 0);
+    
+    size_t recv1 = lower ? n : 0;
+    size_t send1 = lower ? 0 : n;
+    
+    swapRange(pixels->Data(), px, partner, 0, send1, 0, recv1);
+    swapRange(integrals->Data(), rawpx, partner, 0, send1, 0, recv1);
+    swapRange(transmittance->Data(), tpx, partner, 0, send1, 0, recv1);
+    
+    if (lower) {
+      compositeRange(0, n, true, lowerFront, &px[0], &rawpx[0], &tpx[0]);
+    } else {
+      rank = -1; // sent all, nothing to gather
+      i1 = 0;
+    }
+  }
+  
+  for (int bit = 1; rank >= 0 && bit < nSwap; bit *= 2)
+  {
+    int partnerRank = rank ^ bit;
+    int partner = (partnerRank < extra) ? 2 * partnerRank : partnerRank + extra;
+    bool lower = !(rank & bit);
+    
+    // the task holding the lower slabs keeps the first half of the range
+    size_t mid = i0 + (i1 - i0) / 2;
+    size_t keep0 = lower ? i0 : mid, keep1 = lower ? mid : i1;
+    size_t send0 = lower ? mid : i0, send1 = lower ? i1 : mid;
+    
+    swapRange(pixels->Data(), px, partner, send0, send1, keep0, keep1);
+    swapRange(integrals->Data(), rawpx, partner, send0, send1, keep0, keep1);
+    swapRange(transmittance->Data(), tpx, partner, send0, send1, keep0, keep1);
+    
+    if (keep1 > keep0)
+      compositeRange(keep0, keep1, lower, lowerFront, &px[0], &rawpx[0], &tpx[0]);
+    
+    i0 = keep0;
+    i1 = keep1;
+  }
+  
+  gatherRanges(pixels->Data(), i0, i1);
+  gatherRanges(integrals->Data(), i0, i1);
+  
+  if (Config.verbose)
+    cout << "[" << ThisTask << "] Film: composited [" << NTask << "] slab images in [" 
+         << (float)timer.Time() << "] seconds." << endl;
+}
+
+Film *CreateFilm(Filter *filter)
+{
+  double crop[4];
+  
+  string filename = filmFilename();
+  
+  // use job expansion (sub-jobs) if requested, for crop[] calculation
+  int jobNum = Config.curJobNum;
+  if( Config.expandedJobNum > 0 )
+    jobNum = Config.expandedJobNum;
     
   // do not modify Film resolution for job subdivisions
   int xres = Config.imageXPixels;
@@ -860,6 +1202,121 @@ Film *CreateFilm(Filter *filter)
   return new Film(xres, yres, filter, crop, filename, openwin);
 }
 
+// FrameWriter
+
+FrameWriter::FrameWriter(int nBuf)
+{
+  IF_DEBUG(cout << "FrameWriter(" << nBuf << ") constructor." << endl);
+  
+  maxBuffers = nBuf;
+  nBuffers = 0;
+  busy = shutdown = false;
+  condition = new ConditionVariable;
+  
+  int err = pthread_create(&thread, NULL, &FrameWriter::entryPoint, this);
+  if (err != 0)
+    terminate("FrameWriter: ERROR from pthread_create [%d]", err);
+}
+
+// write all pending frames, then stop the thread
+FrameWriter::~FrameWriter()
+{
+  condition->Lock();
+  shutdown = true;
+  condition->Broadcast();
+  condition->Unlock();
+  
+  pthread_join(thread, NULL);
+  
+  for (unsigned int i = 0; i < freeFilms.size(); i++)
+    delete freeFilms[i];
+  delete condition;
+}
+
+void *FrameWriter::entryPoint(void *arg)
+{
+  ((FrameWriter *)arg)->run();
+  return NULL;
+}
+
+// queue the image of film for writing, film keeps the storage of a written frame (to be cleared)
+void FrameWriter::Submit(Film *film, int frameNum, int stride)
+{
+  Job job;
+  job.film = NULL;
+  
+  condition->Lock();
+  while (freeFilms.empty() && nBuffers == maxBuffers)
+    condition->Wait();
+  
+  if (!freeFilms.empty()) {
+    job.film = freeFilms.back();
+    freeFilms.pop_back();
+  }
+  condition->Unlock();
+  
+  if (!job.film) {
+    job.film = CreateFilm(CreateBoxFilter());
+    nBuffers++;
+  }
+  
+  job.film->Swap(*film);
+  job.frameNum = frameNum;
+  job.stride = stride;
+  
+  condition->Lock();
+  queue.push_back(job);
+  condition->Broadcast();
+  condition->Unlock();
+}
+
+// wait until all queued frames are written (e.g. before writing a preview on this thread)
+void FrameWriter::Drain()
+{
+  condition->Lock();
+  while (!queue.empty() || busy)
+    condition->Wait();
+  condition->Unlock();
+}
+
+void FrameWriter::run()
+{
+  while (true)
+  {
+    condition->Lock();
+    while (queue.empty() && !shutdown)
+      condition->Wait();
+    
+    if (queue.empty()) {
+      condition->Unlock();
+      return;
+    }
+    
+    Job job = queue.front();
+    queue.erase(queue.begin());
+    busy = true;
+    condition->Unlock();
+    
+    Timer timer;
+    timer.Start();
+    
+    // store image, column integrals, and raw floats
+    job.film->WriteImage(job.frameNum, 1.f, job.stride);
+    job.film->WriteIntegrals(job.stride);
+    IF_DEBUG(job.film->WriteRawRGB());
+    
+    if (Config.verbose)
+      cout << "[" << setw(3) << job.frameNum << "] FrameWriter: written in [" << (float)timer.Time() 
+           << "] seconds." << endl;
+    
+    condition->Lock();
+    freeFilms.push_back(job.film);
+    busy = false;
+    condition->Broadcast();
+    condition->Unlock();
+  }
+}
+
 // Camera
 Camera::~Camera() {
     delete film;
@@ -871,6 +1328,7 @@ Camera::Camera(const Transform &cam2world, float sopen, float sclose, Film *f)
   IF_DEBUG(cout << "Camera(c2w," << sopen << "," << sclose << ",f) constructor." << endl);
   
   film = f;
+  projective = false;
   //if (CameraToWorld.HasScale())
   //    cout << "Warning! CameraToWorld has a scale factor." << endl;
 }
@@ -883,6 +1341,7 @@ Camera::Camera(const Transform &cam2world, const Transform &proj, const float sc
                 << "f) constructor." << endl);
   
   film = f;
+  projective = true;
 
   // Initialize depth of field parameters
   lensRadius = lensr;
@@ -901,6 +1360,49 @@ Camera::Camera(const Transform &cam2world, const Transform &proj, const float sc
   RasterToScreen = Inverse(ScreenToRaster);
   RasterToCamera = Inverse(CameraToScreen) * RasterToScreen;
   WorldToRaster  = Inverse(RasterToCamera) * Inverse(CameraToWorld);
+  WorldToCamera  = Inverse(CameraToWorld);
+  CameraToRaster = Inverse(RasterToCamera);
+}
+
+unsigned char Camera::RasterOutcode(const Point &p) const
+{
+  // no culling for non-projective cameras
+  if (!projective)
+    return 0;
+  
+  // behind the camera: the projected raster position is meaningless
+  if (WorldToCamera(p).z < 0.0f)
+    return 16;
+  
+  // one pixel margin for the filter
+  Point pr = WorldToRaster(p);
+  unsigned char code = 0;
+  
+  if (pr.x < -1.0f)                    code |= 1;
+  if (pr.x > film->xResolution + 1.0f) code |= 2;
+  if (pr.y < -1.0f)                    code |= 4;
+  if (pr.y > film->yResolution + 1.0f) code |= 8;
+  
+  return code;
+}
+
+bool Camera::ProjectSphere(const Point &p, float h, Point *pr, float *hr) const
+{
+  // only orthographic and perspective, and in front of the camera
+  if (!projective)
+    return false;
+  
+  Point pc = WorldToCamera(p);
+  
+  if (pc.z < 0.0f)
+    return false;
+  
+  // radius: offset along camera x at the depth of the center
+  *pr = CameraToRaster(pc);
+  Point pe = CameraToRaster(pc + Vector(h, 0.0f, 0.0f));
+  *hr = fabsf(pe.x - pr->x);
+  
+  return true;
 }
 
 // OrthoCamera
@@ -45,6 +45,7 @@ public:
   ~Film() {
       delete pixels;
       delete integrals;
+      delete transmittance;
       delete filter;
       delete[] filterTable;
   }
@@ -55,9 +56,15 @@ public:
   void GetSampleExtent(int *xstart, int *xend, int *ystart, int *yend) const;
   void GetPixelExtent(int *xstart, int *xend, int *ystart, int *yend) const;
   void UpdateDisplay(int x0, int y0, int x1, int y1, float splatScale = 1.f);
-  void WriteImage(int frameNum, float splatScale = 1.f);
-  void WriteIntegrals();
+  void WriteImage(int frameNum, float splatScale = 1.f, int stride = 1, int pass = 0);
+  void WriteIntegrals(int stride = 1);
   void WriteRawRGB();
+  void SetRawPixel(int x, int y, const double *raw_vals);
+  void AddTransmittance(const CameraSample &sample, const Spectrum &T);
+  void Clear();
+  void Reduce();
+  void Composite(const Camera *camera);
+  void Swap(Film &other);
   
   void CalculateScreenWindow(float *screen, int jobNum);
   bool DrawLine(float x1, float y1, float x2, float y2, const Spectrum &L);
@@ -68,6 +75,7 @@ private:
   Filter *filter;
   double cropWindow[4];
   string filename;
+  string integralsFilename;
   int xPixelStart, yPixelStart, xPixelCount, yPixelCount;
   
   struct Pixel {
@@ -90,14 +98,57 @@ private:
     float raw_vals[TF_NUM_VALS];
     float weightSum;
   };
+  struct TransPixel {
+    TransPixel() {
+      for (int i = 0; i < 3; ++i)
+        T[i] = 0.0f;
+    }
+    float T[3]; // filter weighted sum of the transmittance (RGB)
+  };
+  
+  void compositeRange(size_t i0, size_t i1, bool lower, const vector<char> &lowerFront,
+                      const Pixel *px, const RawPixel *rawpx, const TransPixel *tpx);
   
   BlockedArray<Pixel> *pixels;
   BlockedArray<RawPixel> *integrals;
+  BlockedArray<TransPixel> *transmittance; // mpiRender=composite
   float *filterTable;
 };
 
 Film *CreateFilm(Filter *filter);
 
+/* FrameWriter (writeQueue > 0): finished frames are written (WriteImage, WriteIntegrals) by a
+ * separate thread while the next frame renders. Submit() swaps the image storage of the rendered
+ * film with a free buffer film and queues that, waiting only if writeQueue frames are pending
+ */
+class FrameWriter {
+public:
+  // construction
+  FrameWriter(int nBuffers);
+  ~FrameWriter();
+  
+  // methods
+  void Submit(Film *film, int frameNum, int stride);
+  void Drain();
+  
+private:
+  struct Job {
+    Film *film;
+    int frameNum, stride;
+  };
+  
+  static void *entryPoint(void *arg);
+  void run();
+  
+  // data
+  int maxBuffers, nBuffers;
+  vector<Film *> freeFilms;
+  vector<Job> queue; // in frame order
+  bool busy, shutdown;
+  ConditionVariable *condition;
+  pthread_t thread;
+};
+
 class Camera {
 public:
   // construction
@@ -110,6 +161,12 @@ public:
   virtual float GenerateRay(const CameraSample &sample, Ray *ray) const = 0;
   
   virtual bool RasterizeLine(const Point &p1, const Point &p2, const Spectrum &L) const = 0;
+  
+  // view culling: outside mask of raster window sides (bits 0-3) and the near plane (bit 4)
+  unsigned char RasterOutcode(const Point &p) const;
+  
+  // splatting: raster position and raster radius of a sphere (false if not projectable)
+  bool ProjectSphere(const Point &p, float h, Point *pr, float *hr) const;
 
   // data
   Transform CameraToWorld;
@@ -120,7 +177,8 @@ protected:
   // private data
   Transform CameraToScreen, RasterToCamera;
   Transform ScreenToRaster, RasterToScreen;
-  Transform WorldToRaster;
+  Transform WorldToRaster, WorldToCamera, CameraToRaster;
+  bool projective; // raster transforms set (not for fisheye/environment)
   float lensRadius, focalDistance;
 };
 
@@ -0,0 +1,277 @@
+/*
+ * distributed.cpp
+ * dnelson
+ */
+
+#include "transform.h"
+#include "util.h"
+#include "spectrum.h"
+#include "sampler.h"
+#include "camera.h"
+#include "arepo.h"
+#include "renderer.h"
+#include "distributed.h"
+
+// RayContinuation: continue the rays received from other tasks, from their entry into this domain
+struct RayContinuation {
+  RayContinuation(RayExchange *e, const Scene *sc, const Renderer *r, Film *f, int rd)
+    : ex(e), scene(sc), renderer(r), film(f), round(rd)
+  {
+    prevEntryCell.assign(numberOfCores(), -1);
+    prevEntryTetra.assign(numberOfCores(), 0);
+  }
+
+  void operator()(int i0, int i1, int threadNum) {
+    RNG rng(round * 1000003 + i0);
+
+    for (int i = i0; i < i1; i++) {
+      const ExportedRay &er = ex->imported[i];
+
+      Ray ray(Point(er.o[0], er.o[1], er.o[2]), Vector(er.d[0], er.d[1], er.d[2]), er.min_t, er.max_t,
+              er.time, er.depth);
+
+      for (int k = 0; k < TF_NUM_VALS; k++)
+        ray.raw_vals[k] = er.raw_vals[k];
+
+      CameraSample sample;
+      sample.imageX = er.imageX;
+      sample.imageY = er.imageY;
+      sample.lensU = sample.lensV = 0.5f;
+      sample.time = er.time;
+
+      Spectrum T = Spectrum::FromRGB(er.Tr);
+      Spectrum L = renderer->LiContinue(scene, ray, Spectrum::FromRGB(er.Lv), rng, &T,
+                                        &prevEntryCell[threadNum], &prevEntryTetra[threadNum], threadNum);
+
+      if (ray.task != ThisTask)
+        ex->Export(sample, er.weight, ray, L, T, threadNum);
+      else
+        film->AddSample(sample, er.weight * L, ray, threadNum);
+    }
+  }
+
+  RayExchange *ex;
+  const Scene *scene;
+  const Renderer *renderer;
+  Film *film;
+  int round;
+  vector<int> prevEntryCell, prevEntryTetra;
+};
+
+// RayExchange
+
+RayExchange::RayExchange()
+{
+  IF_DEBUG(cout << "RayExchange() constructor." << endl);
+
+  MPI_Type_contiguous(sizeof(ExportedRay), MPI_BYTE, &rayType);
+  MPI_Type_commit(&rayType);
+
+  outgoing.resize(numberOfCores());
+}
+
+RayExchange::~RayExchange()
+{
+  MPI_Type_free(&rayType);
+}
+
+// queue a ray for the task owning its next cell (ray.task), called by the render workers
+void RayExchange::Export(const CameraSample &sample, float weight, const Ray &ray, const Spectrum &Lv,
+                         const Spectrum &T, int threadNum)
+{
+  ExportedRay er;
+
+  er.task   = ray.task;
+  er.depth  = ray.depth;
+  er.imageX = sample.imageX;
+  er.imageY = sample.imageY;
+  er.weight = weight;
+
+  Lv.ToRGB(er.Lv);
+  T.ToRGB(er.Tr);
+
+  for (int k = 0; k < 3; k++) {
+    er.o[k] = ray.o[k];
+    er.d[k] = ray.d[k];
+  }
+
+  er.min_t = ray.min_t;
+  er.max_t = ray.max_t;
+  er.time  = ray.time;
+
+  for (int k = 0; k < TF_NUM_VALS; k++)
+    er.raw_vals[k] = ray.raw_vals[k];
+
+  outgoing[threadNum].push_back(er);
+}
+
+// exchange and continue rays until all are done, collective over all tasks
+void RayExchange::Run(const Scene *scene, const Renderer *renderer, Film *film)
+{
+  Timer timer;
+  timer.Start();
+
+  vector<int> sendCount(NTask), sendOffset(NTask), recvCount(NTask), recvOffset(NTask);
+  long long nSent = 0, nReceived = 0;
+  int round;
+
+  for (round = 0; ; round++)
+  {
+    // rays queued by all threads, grouped by destination
+    fill(sendCount.begin(), sendCount.end(), 0);
+
+    for (unsigned int t = 0; t < outgoing.size(); t++)
+      for (unsigned int i = 0; i < outgoing[t].size(); i++)
+        sendCount[outgoing[t][i].task]++;
+
+    sendOffset[0] = 0;
+    for (int task = 1; task < NTask; task++)
+      sendOffset[task] = sendOffset[task-1] + sendCount[task-1];
+
+    long long nLocal = sendOffset[NTask-1] + sendCount[NTask-1], nGlobal;
+
+    sendBuf.resize(nLocal);
+    vector<int> pos(sendOffset);
+
+    for (unsigned int t = 0; t < outgoing.size(); t++) {
+      for (unsigned int i = 0; i < outgoing[t].size(); i++)
+        sendBuf[ pos[outgoing[t][i].task]++ ] = outgoing[t][i];
+      outgoing[t].clear();
+    }
+
+    // done once no task has a ray in flight
+    MPI_Allreduce(&nLocal, &nGlobal, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+
+    if (nGlobal == 0)
+      break;
+
+    MPI_Alltoall(&sendCount[0], 1, MPI_INT, &recvCount[0], 1, MPI_INT, MPI_COMM_WORLD);
+
+    recvOffset[0] = 0;
+    for (int task = 1; task < NTask; task++)
+      recvOffset[task] = recvOffset[task-1] + recvCount[task-1];
+
+    int nRecv = recvOffset[NTask-1] + recvCount[NTask-1];
+    imported.resize(nRecv);
+
+    MPI_Alltoallv(sendBuf.empty() ? NULL : &sendBuf[0], &sendCount[0], &sendOffset[0], rayType,
+                  imported.empty() ? NULL : &imported[0], &recvCount[0], &recvOffset[0], rayType,
+                  MPI_COMM_WORLD);
+
+    nSent += nLocal;
+    nReceived += nRecv;
+
+    // continue the received rays, those leaving this domain again are queued for the next round
+    RayContinuation continuation(this, scene, renderer, film, round);
+    parallelFor(nRecv, continuation, RAYEXCHANGE_MIN_CHUNK);
+  }
+
+  if (Config.verbose)
+    cout << "[" << ThisTask << "] RayExchange: [" << round << "] rounds, [" << nSent << "] rays sent, ["
+         << nReceived << "] received, [" << (float)timer.Time() << "] seconds." << endl;
+}
+
+// mpiRender=composite: slab axis, the dominant component of the viewing direction
+int compositeAxis()
+{
+  float dir[3];
+  
+  for (int k = 0; k < 3; k++)
+    dir[k] = fabs(Config.cameraLookAt[k] - Config.cameraPosition[k]);
+  
+  if (dir[0] >= dir[1] && dir[0] >= dir[2])
+    return 0;
+  return (dir[1] >= dir[2]) ? 1 : 2;
+}
+
+// extent of the slab of a task along the slab axis
+void compositeSlab(int task, double *lo, double *hi)
+{
+  *lo = All.BoxSize * task / NTask;
+  *hi = All.BoxSize * (task+1) / NTask;
+}
+
+// is coordinate x (along the slab axis) within pad of the slab of this task, periodic
+bool insideSlab(double x, double pad)
+{
+  double lo, hi;
+  compositeSlab(ThisTask, &lo, &hi);
+  
+  double dx = x - 0.5 * (lo + hi);
+  
+  if (dx > 0.5 * All.BoxSize)
+    dx -= All.BoxSize;
+  if (dx < -0.5 * All.BoxSize)
+    dx += All.BoxSize;
+  
+  return fabs(dx) <= 0.5 * (hi - lo) + pad;
+}
+
+// TileScheduler
+
+TileScheduler::TileScheduler(int xstart, int xend, int ystart, int yend)
+  : xPixelStart(xstart), xPixelEnd(xend), yPixelStart(ystart), yPixelEnd(yend)
+{
+  int size = Config.mpiTileSize;
+  
+  nx = (xPixelEnd - xPixelStart + size - 1) / size;
+  nTiles = nx * ((yPixelEnd - yPixelStart + size - 1) / size);
+  
+  next = 0;
+  nStopped = 0;
+}
+
+// pixel window of a tile, row by row
+void TileScheduler::Window(int tile, int *x0, int *x1, int *y0, int *y1) const
+{
+  int size = Config.mpiTileSize;
+  
+  *x0 = xPixelStart + (tile % nx) * size;
+  *y0 = yPixelStart + (tile / nx) * size;
+  *x1 = min(*x0 + size, xPixelEnd);
+  *y1 = min(*y0 + size, yPixelEnd);
+}
+
+int TileScheduler::dealTile()
+{
+  return (next < nTiles) ? next++ : -1;
+}
+
+// the next tile for this task to render, -1 once all are dealt (asks task 0)
+int TileScheduler::Next()
+{
+  if (ThisTask == 0)
+    return dealTile();
+  
+  int tile, request = ThisTask;
+  
+  MPI_Send(&request, 1, MPI_INT, 0, TAG_TILE_REQUEST, MPI_COMM_WORLD);
+  MPI_Recv(&tile, 1, MPI_INT, 0, TAG_TILE, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+  
+  return tile;
+}
+
+// task 0: answer the tile requests of the other tasks, those pending or (wait) at least one
+void TileScheduler::Serve(bool wait)
+{
+  while (!Finished())
+  {
+    int flag = 1, request;
+    MPI_Status status;
+    
+    if (!wait)
+      MPI_Iprobe(MPI_ANY_SOURCE, TAG_TILE_REQUEST, MPI_COMM_WORLD, &flag, &status);
+    
+    if (!flag)
+      return;
+    
+    MPI_Recv(&request, 1, MPI_INT, MPI_ANY_SOURCE, TAG_TILE_REQUEST, MPI_COMM_WORLD, &status);
+    
+    int tile = dealTile();
+    if (tile < 0)
+      nStopped++;
+    
+    MPI_Send(&tile, 1, MPI_INT, status.MPI_SOURCE, TAG_TILE, MPI_COMM_WORLD);
+    wait = false;
+  }
+}
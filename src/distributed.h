@@ -0,0 +1,94 @@
+/*
+ * distributed.h
+ * dnelson
+ */
+
+#ifndef AREPO_RT_DISTRIBUTED_H
+#define AREPO_RT_DISTRIBUTED_H
+
+#include "mpi.h"
+
+#include "ArepoRT.h"
+
+#define RAYEXCHANGE_MIN_CHUNK 64 // received rays per parallelFor chunk
+#define TILE_POLL_USEC        200 // mpiRender=tiles: task 0 checks for tile requests this often
+
+#define TAG_TILE_REQUEST 7100
+#define TAG_TILE         7101
+
+// ExportedRay: a ray in flight to the task owning its next cell, with its state along the ray and
+// where it goes in the image (plain data, sent as bytes)
+struct ExportedRay {
+  int task;                     // destination
+  int depth;
+  float imageX, imageY;         // raster position (CameraSample)
+  float weight;                 // camera ray weight
+  float Lv[3], Tr[3];           // accumulated emission (unweighted) and transmittance (RGB)
+  double o[3], d[3];
+  double min_t, max_t;
+  double time;
+  double raw_vals[TF_NUM_VALS];
+};
+
+/* RayExchange (mpiRender=rays): the rays which leave the domain of this task are collected per
+ * thread while rendering, then all tasks exchange them (MPI_Alltoallv) and continue the ones they
+ * received, in rounds until no ray is in flight on any task. a ray is added to the film of the task
+ * where it completes, the films are then summed over all tasks (Film::Reduce)
+ */
+class RayExchange {
+public:
+  // construction
+  RayExchange();
+  ~RayExchange();
+
+  // methods
+  void Export(const CameraSample &sample, float weight, const Ray &ray, const Spectrum &Lv,
+              const Spectrum &T, int threadNum);
+  void Run(const Scene *scene, const Renderer *renderer, Film *film);
+
+  // data
+  vector<ExportedRay> imported; // rays received in the current round
+
+private:
+  MPI_Datatype rayType;
+  vector< vector<ExportedRay> > outgoing; // [thread] rays to send in the next round
+  vector<ExportedRay> sendBuf;            // grouped by destination task
+};
+
+/* mpiRender=composite: the box is cut into NTask equal slabs along the axis closest to the viewing
+ * direction, task i loads the gas of slab i (padded by maskPadFac, periodic) and renders the part of
+ * every camera ray inside it, the partial images are then composited in depth order (Film::Composite)
+ */
+int compositeAxis();
+void compositeSlab(int task, double *lo, double *hi);
+bool insideSlab(double x, double pad);
+
+/* TileScheduler (mpiRender=tiles): every task holds the whole snapshot, the image is cut into tiles
+ * of mpiTileSize pixels which task 0 deals out in order, one at a time, to the tasks asking for work
+ * (itself included). Next() is called by the main thread of each task, task 0 answers the others
+ * in Serve() while its own workers render
+ */
+class TileScheduler {
+public:
+  // construction
+  TileScheduler(int xstart, int xend, int ystart, int yend);
+  
+  // methods
+  int Next();
+  void Serve(bool wait);
+  bool Finished() const { return nStopped == NTask - 1; }
+  void Window(int tile, int *x0, int *x1, int *y0, int *y1) const;
+  
+  // data
+  int nTiles;
+  
+private:
+  int dealTile();
+  
+  int xPixelStart, xPixelEnd, yPixelStart, yPixelEnd;
+  int nx;        // tiles per row
+  int next;      // task 0: next tile to deal
+  int nStopped;  // task 0: tasks told that no tile is left
+};
+
+#endif //AREPO_RT_DISTRIBUTED_H
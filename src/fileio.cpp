@@ -73,6 +73,7 @@ void ConfigSet::ReadFile(string cfgfile)
   writeRGB8bit  = readValue<bool>("writeRGB8bit",  true); // png
   writeRGB16bit = readValue<bool>("writeRGB16bit", false); // png
   writeRGBA8bit = readValue<bool>("writeRGBA8bit", false); // png
+  writeQueue    = readValue<int> ("writeQueue",    0); // frames
 
   dumpMeshText   = readValue<bool>("dumpMeshText", false);
   dumpMeshBinary = readValue<bool>("dumpMeshBinary", false);
@@ -81,6 +82,12 @@ void ConfigSet::ReadFile(string cfgfile)
   // General
   nTasks        = readValue<int> ("nTasks",        1);
   nCores        = readValue<int> ("nCores",        0);
+  balanceTiles  = readValue<bool>("balanceTiles",  false);
+  progressive   = readValue<int> ("progressive",   0);
+  timeBudget    = readValue<float>("timeBudget",   0.0f); // seconds per frame
+  numaPlacement = readValue<string>("numaPlacement", "none");
+  mpiRender     = readValue<string>("mpiRender",     "none");
+  mpiTileSize   = readValue<int>  ("mpiTileSize",   128); // pixels
   quickRender   = readValue<bool>("quickRender",   false);
   openWindow    = readValue<bool>("openWindow",    false);
   verbose       = readValue<bool>("verbose",       false);
@@ -127,6 +134,7 @@ void ConfigSet::ReadFile(string cfgfile)
   drawSphere    = readValue<bool>("drawSphere",    false);
 
   projColDens   = readValue<bool>("projColDens",     false); // write raw values
+  projSplat     = readValue<bool>("projSplat",       false); // raw values by splatting, no rays
   nTreeNGB      = readValue<int>("nTreeNGB",             0); // disabled by default
   viStepSize    = readValue<float>("viStepSize",      0.0f); // disabled by default
   rayMaxT       = readValue<float>("rayMaxT",         0.0f);
@@ -161,6 +169,39 @@ void ConfigSet::ReadFile(string cfgfile)
     terminate("Config: ERROR! Must enable IDW or SPHKERNEL for nTreeNGB>0.");
 #endif
     
+  if (projSplat && !projColDens)
+    terminate("Config: ERROR! projSplat only makes raw projections, requires projColDens.");
+  if (progressive < 0 || (progressive & (progressive-1)))
+    terminate("Config: ERROR! progressive should be zero or a power of two.");
+  if (timeBudget > 0.0 && progressive <= 1)
+    progressive = 8; // a budget needs coarse passes to fall back to
+  if (numaPlacement != "none" && numaPlacement != "firsttouch" && numaPlacement != "interleave")
+    terminate("Config: ERROR! numaPlacement should be one of none, firsttouch, interleave.");
+  if (writeQueue < 0)
+    terminate("Config: ERROR! writeQueue should not be negative.");
+  if (mpiRender != "none" && mpiRender != "rays" && mpiRender != "composite" && mpiRender != "tiles")
+    terminate("Config: ERROR! mpiRender should be one of none, rays, composite, tiles.");
+  if (mpiRender == "rays" && (nTreeNGB || projSplat))
+    terminate("Config: ERROR! mpiRender=rays needs the Voronoi mesh (nTreeNGB=0, projSplat=0).");
+  if (mpiRender == "rays" && (progressive > 1 || timeBudget > 0.0 || totNumJobs >= 1))
+    terminate("Config: ERROR! mpiRender=rays renders complete frames (no progressive, timeBudget or jobs).");
+  if (mpiRender == "rays" && readPartType != 0)
+    terminate("Config: ERROR! mpiRender=rays needs readPartType=0 (density estimate of other types is local to each task).");
+  if (mpiRender == "composite" && (!nTreeNGB || projSplat))
+    terminate("Config: ERROR! mpiRender=composite needs tree search ray tracing (nTreeNGB>0, projSplat=0).");
+  if (mpiRender == "composite" && (progressive > 1 || timeBudget > 0.0 || totNumJobs >= 1))
+    terminate("Config: ERROR! mpiRender=composite renders complete frames (no progressive, timeBudget or jobs).");
+  if (mpiRender == "tiles" && (!nTreeNGB || projSplat))
+    terminate("Config: ERROR! mpiRender=tiles needs tree search ray tracing (nTreeNGB>0, projSplat=0).");
+  if (mpiRender == "tiles" && (progressive > 1 || timeBudget > 0.0 || totNumJobs >= 1 || balanceTiles))
+    terminate("Config: ERROR! mpiRender=tiles balances complete frames itself (no progressive, timeBudget, jobs or balanceTiles).");
+  if (mpiRender == "tiles" && mpiTileSize < 1)
+    terminate("Config: ERROR! mpiTileSize should be at least one pixel.");
+#ifndef GAS_TREE
+  if (mpiRender == "composite" || mpiRender == "tiles")
+    terminate("Config: ERROR! mpiRender=%s requires GAS_TREE.", mpiRender.c_str());
+#endif
+    
   // camera type mappings
   if (cameraType == "ortho") { cameraType = "orthographic"; }
   if (cameraType == "persp") { cameraType = "perspective"; }
@@ -181,6 +222,8 @@ void ConfigSet::ReadFile(string cfgfile)
     terminate("Config: ERROR! FOV not used for ortho camera (leave at 0.0).");
   if (cameraType == "perspective" && (cameraFOV <= 0.0 || cameraFOV >= 180.0))
     terminate("Config: ERROR! Perspective camera expects sane FOV.");
+  if (projSplat && cameraType != "orthographic" && cameraType != "perspective")
+    terminate("Config: ERROR! projSplat requires an orthographic or perspective camera.");
     
   // validation not directly related to config file
 #if defined(NATURAL_NEIGHBOR_INTERP) && !defined(NATURAL_NEIGHBOR_INNER)
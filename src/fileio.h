@@ -30,11 +30,18 @@ public:
   string imageFile, rawRGBFile;
   string filename, paramFilename;
   bool writeRGB8bit, writeRGB16bit, writeRGBA8bit;
+  int writeQueue;
 
   bool dumpMeshText, dumpMeshBinary, dumpMeshCells;
   
   // General
   int nTasks, nCores;
+  bool balanceTiles;
+  int progressive;
+  float timeBudget;
+  string numaPlacement;
+  string mpiRender;
+  int mpiTileSize;
   bool quickRender, verbose, openWindow;
   
   int totNumJobs, curJobNum;
@@ -70,6 +77,7 @@ public:
   // Render
   bool drawBBox, drawTetra, drawVoronoi, drawSphere;
   bool projColDens;   
+  bool projSplat;
   
   int nTreeNGB;
   float viStepSize;
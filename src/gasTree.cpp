@@ -0,0 +1,618 @@
+/*
+ * gasTree.cpp
+ * dnelson
+ */
+
+#include "transform.h"
+#include "arepo.h"
+#include "gasTree.h"
+#include "util.h"
+
+#include <algorithm> // sort/inplace_merge
+
+typedef pair<uint64_t,int> MortonKey; // (key, P index)
+
+// spread the lower 21 bits of v to every third bit
+static inline uint64_t mortonSpread(uint64_t v)
+{
+  v &= 0x1fffff;
+  v = (v | v << 32) & 0x1f00000000ffffULL;
+  v = (v | v << 16) & 0x1f0000ff0000ffULL;
+  v = (v | v << 8)  & 0x100f00f00f00f00fULL;
+  v = (v | v << 4)  & 0x10c30c30c30c30c3ULL;
+  v = (v | v << 2)  & 0x1249249249249249ULL;
+  return v;
+}
+
+// construction functors (see parallelFor)
+struct MortonKeyFiller {
+  MortonKeyFiller(const vector<int> &g, vector<MortonKey> &k) : gas(g), keys(k) {
+    for( int j = 0; j < 3; j++ )
+      keyFac[j] = (double)(1 << 21) / box.size[j];
+  }
+
+  void operator()(int i0, int i1, int threadNum) {
+    for( int i = i0; i < i1; i++ ) {
+      int p = gas[i];
+      double pos[3] = { box.wrap<0>(P[p].Pos[0]), box.wrap<1>(P[p].Pos[1]), box.wrap<2>(P[p].Pos[2]) };
+      uint64_t key = 0;
+
+      for( int j = 0; j < 3; j++ ) {
+        int64_t q = (int64_t)(pos[j] * keyFac[j]);
+        q = q < 0 ? 0 : (q > 0x1fffff ? 0x1fffff : q);
+        key |= mortonSpread(q) << j;
+      }
+
+      keys[i] = make_pair(key, p);
+    }
+  }
+
+  PeriodicBox<double> box;
+  double keyFac[3];
+  const vector<int> &gas;
+  vector<MortonKey> &keys;
+};
+
+// sort (width 1) or pairwise merge (width > 1) runs of chunks, chunk c spans [bounds[c],bounds[c+1])
+struct ChunkSorter {
+  ChunkSorter(vector<MortonKey> &k, const vector<int> &b, int w) : keys(k), bounds(b), width(w) { }
+
+  void operator()(int i0, int i1, int threadNum) {
+    int nChunks = bounds.size() - 1;
+
+    for( int c = i0; c < i1; c++ ) {
+      int lo  = bounds[ min(c * width, nChunks) ];
+      int mid = bounds[ min(c * width + width / 2, nChunks) ];
+      int hi  = bounds[ min((c+1) * width, nChunks) ];
+
+      if( width == 1 )
+        sort( keys.begin() + lo, keys.begin() + hi );
+      else
+        inplace_merge( keys.begin() + lo, keys.begin() + mid, keys.begin() + hi );
+    }
+  }
+
+  vector<MortonKey> &keys;
+  const vector<int> &bounds;
+  int width;
+};
+
+struct SoAFiller {
+  SoAFiller(const vector<MortonKey> &k, GasTree &t) : keys(k), tree(t) { }
+
+  void operator()(int i0, int i1, int threadNum) {
+    for( int i = i0; i < i1; i++ ) {
+      int p = keys[i].second;
+      tree.ind[i] = p;
+      tree.x[i] = box.wrap<0>(P[p].Pos[0]);
+      tree.y[i] = box.wrap<1>(P[p].Pos[1]);
+      tree.z[i] = box.wrap<2>(P[p].Pos[2]);
+    }
+  }
+
+  PeriodicBox<double> box;
+  const vector<MortonKey> &keys;
+  GasTree &tree;
+};
+
+// quantised bounds of the leaves (level 0) from the particles, or of the nodes of a level from
+// the two children in the level below (union, exact in the quantised representation)
+struct NodeBoundsBuilder {
+  NodeBoundsBuilder(const GasTree &t, unsigned short *qmin, unsigned short *qmax, const double *qs,
+                    int off, int childOff, int childCount)
+    : tree(t), qmin(qmin), qmax(qmax), qscale(qs), off(off), childOff(childOff), childCount(childCount) { }
+
+  void operator()(int i0, int i1, int threadNum) {
+    for( int i = i0; i < i1; i++ ) {
+      unsigned short *lo = &qmin[3*(off+i)];
+      unsigned short *hi = &qmax[3*(off+i)];
+
+      if( childOff < 0 ) {
+        // leaf: particles [i*LEAF,(i+1)*LEAF), round outwards
+        int j0 = i * GASTREE_LEAF_SIZE;
+        int j1 = min(j0 + GASTREE_LEAF_SIZE, tree.NumPart());
+        const vector<double> *pos[3] = { &tree.x, &tree.y, &tree.z };
+
+        for( int k = 0; k < 3; k++ ) {
+          double pmin = (*pos[k])[j0], pmax = (*pos[k])[j0];
+
+          for( int j = j0+1; j < j1; j++ ) {
+            pmin = min(pmin, (*pos[k])[j]);
+            pmax = max(pmax, (*pos[k])[j]);
+          }
+
+          lo[k] = (unsigned short)Clamp(floor(pmin / qscale[k]), 0.0, (double)GASTREE_QMAX);
+          hi[k] = (unsigned short)Clamp(ceil(pmax / qscale[k]), 0.0, (double)GASTREE_QMAX);
+        }
+      }
+      else {
+        // internal: union of children 2i and 2i+1 (if present)
+        int c0 = childOff + 2*i;
+        int c1 = 2*i+1 < childCount ? c0 + 1 : c0;
+
+        for( int k = 0; k < 3; k++ ) {
+          lo[k] = min(qmin[3*c0+k], qmin[3*c1+k]);
+          hi[k] = max(qmax[3*c0+k], qmax[3*c1+k]);
+        }
+      }
+    }
+  }
+
+  const GasTree &tree;
+  unsigned short *qmin, *qmax;
+  const double *qscale;
+  int off, childOff, childCount;
+};
+
+// maximum support radius of the leaves (level 0) from the particles, or of the nodes of a level
+// from the two children in the level below
+struct NodeSupportBuilder {
+  NodeSupportBuilder(GasTree &t, vector<float> &nh, int off, int childOff, int childCount)
+    : tree(t), nodeH(nh), off(off), childOff(childOff), childCount(childCount) { }
+
+  void operator()(int i0, int i1, int threadNum) {
+    for( int i = i0; i < i1; i++ ) {
+      float hmax = 0.0f;
+
+      if( childOff < 0 ) {
+        int j0 = i * GASTREE_LEAF_SIZE;
+        int j1 = min(j0 + GASTREE_LEAF_SIZE, tree.NumPart());
+
+        for( int j = j0; j < j1; j++ )
+          hmax = max(hmax, tree.h[j]);
+      }
+      else {
+        int c0 = childOff + 2*i;
+        int c1 = 2*i+1 < childCount ? c0 + 1 : c0;
+        hmax = max(nodeH[c0], nodeH[c1]);
+      }
+
+      nodeH[off+i] = hmax;
+    }
+  }
+
+  GasTree &tree;
+  vector<float> &nodeH;
+  int off, childOff, childCount;
+};
+
+struct SupportFiller {
+  SupportFiller(GasTree &t, const vector<float> &hs) : tree(t), hsml(hs) { }
+
+  void operator()(int i0, int i1, int threadNum) {
+    for( int i = i0; i < i1; i++ )
+      tree.h[i] = hsml[ tree.ind[i] ];
+  }
+
+  GasTree &tree;
+  const vector<float> &hsml;
+};
+
+void GasTree::Build()
+{
+  Timer timer;
+  timer.Start();
+
+  // gas only
+  vector<int> gas;
+  gas.reserve(NumGas);
+
+  for( int i = 0; i < NumGas; i++ )
+    if( P[i].Type == 0 )
+      gas.push_back(i);
+
+  numPart = gas.size();
+
+  x.resize(numPart);
+  y.resize(numPart);
+  z.resize(numPart);
+  ind.resize(numPart);
+
+  if( !numPart )
+    return;
+
+  // Morton keys, then sort (chunks in parallel, followed by pairwise merge passes)
+  vector<MortonKey> keys(numPart);
+
+  MortonKeyFiller keyFiller(gas, keys);
+  parallelFor(numPart, keyFiller);
+
+  int nChunks = min(numberOfCores(), numPart);
+  vector<int> bounds(nChunks+1);
+
+  for( int c = 0; c <= nChunks; c++ )
+    bounds[c] = (int)((long long)numPart * c / nChunks);
+
+  for( int width = 1; width < 2*nChunks; width *= 2 ) {
+    ChunkSorter sorter(keys, bounds, width);
+    parallelFor((nChunks + width - 1) / width, sorter, 1);
+  }
+
+  SoAFiller soaFiller(keys, *this);
+  parallelFor(numPart, soaFiller);
+
+  // implicit levels: leaves, then pairs of the level below up to the single root
+  levelOffset.clear();
+  levelOffset.push_back(0);
+
+  int count = (numPart + GASTREE_LEAF_SIZE - 1) / GASTREE_LEAF_SIZE;
+
+  while( true ) {
+    levelOffset.push_back( levelOffset.back() + count );
+    if( count == 1 )
+      break;
+    count = (count + 1) / 2;
+  }
+
+  numLevels = levelOffset.size() - 1;
+
+  if( numLevels + 1 > GASTREE_STACK )
+    terminate("GasTree: too many levels [%d].", numLevels);
+
+  qmin.resize( 3 * NumNodes() );
+  qmax.resize( 3 * NumNodes() );
+
+  PeriodicBox<double> box;
+  for( int k = 0; k < 3; k++ )
+    qscale[k] = box.size[k] / GASTREE_QMAX;
+
+  for( int lev = 0; lev < numLevels; lev++ ) {
+    int levCount = levelOffset[lev+1] - levelOffset[lev];
+    int childOff = lev ? levelOffset[lev-1] : -1;
+    int childCount = lev ? levelOffset[lev] - levelOffset[lev-1] : 0;
+
+    NodeBoundsBuilder builder(*this, &qmin[0], &qmax[0], qscale, levelOffset[lev], childOff, childCount);
+    parallelFor(levCount, builder);
+  }
+
+  if (Config.verbose)
+    cout << "[" << ThisTask << "] GasTree: [" << numPart << "] gas particles, [" << NumNodes()
+         << "] nodes in [" << numLevels << "] levels, built in [" << (float)timer.Time() << "] seconds." << endl;
+}
+
+// attach a support radius to each particle (hsml indexed by P index) for Support() queries
+void GasTree::SetSupport(const vector<float> &hsml)
+{
+  h.resize(numPart);
+  nodeH.resize( NumNodes() );
+
+  if( !numPart )
+    return;
+
+  SupportFiller filler(*this, hsml);
+  parallelFor(numPart, filler);
+
+  for( int lev = 0; lev < numLevels; lev++ ) {
+    int levCount = levelOffset[lev+1] - levelOffset[lev];
+    int childOff = lev ? levelOffset[lev-1] : -1;
+    int childCount = lev ? levelOffset[lev] - levelOffset[lev-1] : 0;
+
+    NodeSupportBuilder builder(*this, nodeH, levelOffset[lev], childOff, childCount);
+    parallelFor(levCount, builder);
+  }
+}
+
+inline void GasTree::nodeBounds(int node, double *lo, double *hi) const
+{
+  for( int k = 0; k < 3; k++ ) {
+    lo[k] = qmin[3*node+k] * qscale[k];
+    hi[k] = qmax[3*node+k] * qscale[k];
+  }
+}
+
+// depth first traversal, nearer child first, pruning nodes further than q.maxDistSq() (which the
+// query may shrink as it goes). Query provides nodeDistSq(node,lo,hi), maxDistSq() and leaf(j0,j1)
+template <class Query> void GasTree::walk(Query &q) const
+{
+  if( !numPart )
+    return;
+
+  int stackLev[GASTREE_STACK], stackInd[GASTREE_STACK];
+  double stackDist[GASTREE_STACK];
+  double lo[3], hi[3];
+
+  nodeBounds(levelOffset[numLevels-1], lo, hi);
+  stackLev[0] = numLevels-1;
+  stackInd[0] = 0;
+  stackDist[0] = q.nodeDistSq(levelOffset[numLevels-1], lo, hi);
+  int n = 1;
+
+  while( n > 0 )
+  {
+    n--;
+    int lev = stackLev[n];
+    int j = stackInd[n];
+
+    if( stackDist[n] > q.maxDistSq() )
+      continue;
+
+    if( lev == 0 ) {
+      int j0 = j * GASTREE_LEAF_SIZE;
+      q.leaf(j0, min(j0 + GASTREE_LEAF_SIZE, numPart));
+      continue;
+    }
+
+    // children
+    int childOff = levelOffset[lev-1];
+    int childCount = levelOffset[lev] - childOff;
+    int c0 = 2*j, c1 = 2*j+1;
+
+    nodeBounds(childOff + c0, lo, hi);
+    double d0 = q.nodeDistSq(childOff + c0, lo, hi);
+    double d1 = INFINITY;
+
+    if( c1 < childCount ) {
+      nodeBounds(childOff + c1, lo, hi);
+      d1 = q.nodeDistSq(childOff + c1, lo, hi);
+    }
+
+    // push the further child first, such that the nearer one is visited first
+    if( d0 <= d1 ) {
+      if( d1 <= q.maxDistSq() ) { stackLev[n] = lev-1; stackInd[n] = c1; stackDist[n] = d1; n++; }
+      if( d0 <= q.maxDistSq() ) { stackLev[n] = lev-1; stackInd[n] = c0; stackDist[n] = d0; n++; }
+    } else {
+      if( d0 <= q.maxDistSq() ) { stackLev[n] = lev-1; stackInd[n] = c0; stackDist[n] = d0; n++; }
+      if( d1 <= q.maxDistSq() ) { stackLev[n] = lev-1; stackInd[n] = c1; stackDist[n] = d1; n++; }
+    }
+  }
+}
+
+// queries: minimum image squared distance from a point to node boxes
+struct PointQuery {
+  PointQuery(const GasTree &t, const Point &pt) : tree(t), px(pt.x), py(pt.y), pz(pt.z) { }
+
+  double nodeDistSq(int node, const double *lo, const double *hi) const {
+    double gx = box.gap<0>(px, px, lo[0], hi[0]);
+    double gy = box.gap<1>(py, py, lo[1], hi[1]);
+    double gz = box.gap<2>(pz, pz, lo[2], hi[2]);
+    return gx*gx + gy*gy + gz*gz;
+  }
+
+  double distSq(int j) const {
+    return box.distSq(tree.x[j] - px, tree.y[j] - py, tree.z[j] - pz);
+  }
+
+  PeriodicBox<double> box;
+  const GasTree &tree;
+  double px, py, pz;
+};
+
+struct NearestQuery : public PointQuery {
+  NearestQuery(const GasTree &t, const Point &pt) : PointQuery(t, pt), r2min(INFINITY), best(-1) { }
+
+  double maxDistSq() const { return r2min; }
+
+  void leaf(int j0, int j1) {
+    for( int j = j0; j < j1; j++ ) {
+      double r2 = distSq(j);
+      if( r2 < r2min ) {
+        r2min = r2;
+        best = tree.ind[j];
+      }
+    }
+  }
+
+  double r2min;
+  int best;
+};
+
+struct BallQuery : public PointQuery {
+  BallQuery(const GasTree &t, const Point &pt, float hsml, NeighborBatch &n)
+    : PointQuery(t, pt), h2((double)hsml*hsml), ngb(n) { }
+
+  double maxDistSq() const { return h2; }
+
+  void leaf(int j0, int j1) {
+    for( int j = j0; j < j1; j++ ) {
+      double r2 = distSq(j);
+      if( r2 < h2 )
+        ngb.add( tree.ind[j], r2 );
+    }
+  }
+
+  double h2;
+  NeighborBatch &ngb;
+};
+
+struct KNNQuery : public PointQuery {
+  KNNQuery(const GasTree &t, const Point &pt, float guess, KNNHeap &h)
+    : PointQuery(t, pt), r2max((double)guess*guess), heap(h) { }
+
+  double maxDistSq() const { return r2max; }
+
+  void leaf(int j0, int j1) {
+    for( int j = j0; j < j1; j++ ) {
+      double r2 = distSq(j);
+      if( r2 < r2max && heap.push(r2, tree.ind[j]) && heap.full() )
+        r2max = heap.top();
+    }
+  }
+
+  double r2max;
+  KNNHeap &heap;
+};
+
+// all particles within rad of the segment a + s*dir, s in [0,len] (dir normalized), nodes are
+// tested against the bounding box of the capsule
+struct CapsuleQuery {
+  CapsuleQuery(const GasTree &t, const Point &a, const Vector &dir, float len, float rad,
+               vector< pair<float,int> > &e) : tree(t), len(len), rad2(rad*rad), ents(e)
+  {
+    Point b = a + dir * len;
+
+    for( int k = 0; k < 3; k++ ) {
+      as[k] = a[k];
+      ds[k] = dir[k];
+      clo[k] = min(a[k], b[k]) - rad;
+      chi[k] = max(a[k], b[k]) + rad;
+    }
+  }
+
+  double maxDistSq() const { return 0.0; }
+
+  double nodeDistSq(int node, const double *lo, const double *hi) const {
+    double gx = box.gap<0>(clo[0], chi[0], lo[0], hi[0]);
+    double gy = box.gap<1>(clo[1], chi[1], lo[1], hi[1]);
+    double gz = box.gap<2>(clo[2], chi[2], lo[2], hi[2]);
+    return gx*gx + gy*gy + gz*gz;
+  }
+
+  void leaf(int j0, int j1) {
+    for( int j = j0; j < j1; j++ ) {
+      double ox = box.nearest<0>(tree.x[j] - as[0]);
+      double oy = box.nearest<1>(tree.y[j] - as[1]);
+      double oz = box.nearest<2>(tree.z[j] - as[2]);
+
+      // projection onto the ray, distance to the closest point of the segment
+      double s  = ox*ds[0] + oy*ds[1] + oz*ds[2];
+      double sc = s < 0.0 ? 0.0 : (s > len ? len : s);
+
+      ox -= sc * ds[0];
+      oy -= sc * ds[1];
+      oz -= sc * ds[2];
+
+      if( ox*ox + oy*oy + oz*oz < rad2 )
+        ents.push_back( make_pair((float)s, tree.ind[j]) );
+    }
+  }
+
+  PeriodicBox<double> box;
+  const GasTree &tree;
+  double as[3], ds[3], clo[3], chi[3];
+  double len, rad2;
+  vector< pair<float,int> > &ents;
+};
+
+// all particles whose support sphere (radius h) intersects the segment a + s*dir, s in [0,len]
+// (dir normalized), nodes are tested against the bounding box of the segment grown by their
+// maximum support
+struct SupportQuery {
+  SupportQuery(const GasTree &t, const Point &a, const Vector &dir, float len, vector<SupportHit> &hits)
+    : tree(t), len(len), hits(hits)
+  {
+    Point b = a + dir * len;
+
+    for( int k = 0; k < 3; k++ ) {
+      as[k] = a[k];
+      ds[k] = dir[k];
+      clo[k] = min(a[k], b[k]);
+      chi[k] = max(a[k], b[k]);
+    }
+  }
+
+  double maxDistSq() const { return 0.0; }
+
+  double nodeDistSq(int node, const double *lo, const double *hi) const {
+    double gx = box.gap<0>(clo[0], chi[0], lo[0], hi[0]);
+    double gy = box.gap<1>(clo[1], chi[1], lo[1], hi[1]);
+    double gz = box.gap<2>(clo[2], chi[2], lo[2], hi[2]);
+    double nh = tree.NodeSupport(node);
+    return gx*gx + gy*gy + gz*gz - nh*nh;
+  }
+
+  void leaf(int j0, int j1) {
+    for( int j = j0; j < j1; j++ ) {
+      double ox = box.nearest<0>(tree.x[j] - as[0]);
+      double oy = box.nearest<1>(tree.y[j] - as[1]);
+      double oz = box.nearest<2>(tree.z[j] - as[2]);
+      double h2 = (double)tree.h[j] * tree.h[j];
+
+      // projection onto the ray, distance to the closest point of the segment
+      double s  = ox*ds[0] + oy*ds[1] + oz*ds[2];
+      double sc = s < 0.0 ? 0.0 : (s > len ? len : s);
+      double o2 = ox*ox + oy*oy + oz*oz;
+      double ex = ox - sc * ds[0], ey = oy - sc * ds[1], ez = oz - sc * ds[2];
+
+      if( ex*ex + ey*ey + ez*ez < h2 ) {
+        SupportHit hit = { (float)s, (float)max(o2 - s*s, 0.0), tree.h[j], tree.ind[j] };
+        hits.push_back(hit);
+      }
+    }
+  }
+
+  PeriodicBox<double> box;
+  const GasTree &tree;
+  double as[3], ds[3], clo[3], chi[3];
+  double len;
+  vector<SupportHit> &hits;
+};
+
+// all particles whose support sphere (radius h) contains the point, nodes are tested against their
+// maximum support
+struct ScatterQuery : public PointQuery {
+  ScatterQuery(const GasTree &t, const Point &pt, NeighborBatch &n) : PointQuery(t, pt), ngb(n) { }
+
+  double maxDistSq() const { return 0.0; }
+
+  double nodeDistSq(int node, const double *lo, const double *hi) const {
+    double nh = tree.NodeSupport(node);
+    return PointQuery::nodeDistSq(node, lo, hi) - nh*nh;
+  }
+
+  void leaf(int j0, int j1) {
+    for( int j = j0; j < j1; j++ ) {
+      double r2 = distSq(j);
+      if( r2 < (double)tree.h[j] * tree.h[j] )
+        ngb.add( tree.ind[j], r2 );
+    }
+  }
+
+  NeighborBatch &ngb;
+};
+
+// nearest gas particle, guess (if >= 0) seeds the search radius
+int GasTree::Nearest(const Point &pt, int guess, double *mindist) const
+{
+  NearestQuery q(*this, pt);
+
+  if( guess >= 0 ) {
+    q.best = guess;
+    q.r2min = q.box.distSq(P[guess].Pos[0] - pt.x, P[guess].Pos[1] - pt.y, P[guess].Pos[2] - pt.z);
+  }
+
+  walk(q);
+
+  *mindist = sqrt(q.r2min);
+  return q.best;
+}
+
+// all gas particles within hsml of pt, appended to ngb
+void GasTree::Ball(const Point &pt, float hsml, NeighborBatch &ngb) const
+{
+  BallQuery q(*this, pt, hsml, ngb);
+  walk(q);
+}
+
+// offer all gas particles within guess of pt to heap, pruning by its top once full
+void GasTree::KNearest(const Point &pt, float guess, KNNHeap &heap) const
+{
+  KNNQuery q(*this, pt, guess, heap);
+  walk(q);
+}
+
+// all gas particles within rad of a segment, as (projected position along dir, index)
+void GasTree::Capsule(const Point &a, const Vector &dir, float len, float rad, vector< pair<float,int> > &ents) const
+{
+  CapsuleQuery q(*this, a, dir, len, rad, ents);
+  walk(q);
+}
+
+// all gas particles whose support (see SetSupport) intersects a segment, appended to hits
+void GasTree::Support(const Point &a, const Vector &dir, float len, vector<SupportHit> &hits) const
+{
+  if( (int)h.size() != numPart )
+    terminate("GasTree: Support() query without SetSupport().");
+
+  SupportQuery q(*this, a, dir, len, hits);
+  walk(q);
+}
+
+// all gas particles whose support (see SetSupport) contains pt, appended to ngb
+void GasTree::Scatter(const Point &pt, NeighborBatch &ngb) const
+{
+  if( (int)h.size() != numPart )
+    terminate("GasTree: Scatter() query without SetSupport().");
+
+  ScatterQuery q(*this, pt, ngb);
+  walk(q);
+}
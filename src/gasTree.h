@@ -0,0 +1,67 @@
+/*
+ * gasTree.h
+ * dnelson
+ */
+
+#ifndef AREPO_RT_GASTREE_H
+#define AREPO_RT_GASTREE_H
+
+#include "kernels.h"
+
+#define GASTREE_QMAX  65535 // quantised node bounds (16 bit per axis)
+#define GASTREE_STACK 64    // maximum traversal depth
+#define GASTREE_BENCH_QUERIES 10000 // ball queries to compare against the Arepo tree (verbose)
+
+// Support() query result: particle p with support radius h, projected position s along the
+// segment and squared distance b2 from the (infinite) line
+struct SupportHit {
+  float s, b2, h;
+  int p;
+};
+
+/* GasTree: render-owned bounding volume hierarchy over the gas particles only (independent of the
+ * Arepo neighbor tree, which is built for gravity/hydro). particles are sorted along a Morton curve
+ * and their positions stored as SoA, consecutive runs of GASTREE_LEAF_SIZE form the leaves and each
+ * level above pairs up the nodes of the level below (implicit layout, no child pointers). node bounds
+ * are quantised to 16 bits per axis relative to the box, rounded outwards.
+ */
+class GasTree {
+public:
+  GasTree() : numPart(0), numLevels(0) { }
+
+  // construction (parallel, after the snapshot is loaded)
+  void Build();
+  void SetSupport(const vector<float> &hsml);
+
+  int NumPart() const { return numPart; }
+  int NumNodes() const { return levelOffset.empty() ? 0 : levelOffset.back(); }
+  float NodeSupport(int node) const { return nodeH[node]; }
+  float MaxSupport() const { return nodeH.empty() ? 0.0f : nodeH.back(); }
+
+  // queries, all results are P/SphP indices
+  int Nearest(const Point &pt, int guess, double *mindist) const;
+  void Ball(const Point &pt, float hsml, NeighborBatch &ngb) const;
+  void KNearest(const Point &pt, float guess, KNNHeap &heap) const;
+  void Capsule(const Point &a, const Vector &dir, float len, float rad, vector< pair<float,int> > &ents) const;
+  void Support(const Point &a, const Vector &dir, float len, vector<SupportHit> &hits) const;
+  void Scatter(const Point &pt, NeighborBatch &ngb) const;
+
+  // data (SoA, in Morton order, positions wrapped into the box)
+  vector<double> x, y, z;
+  vector<int> ind;
+  vector<float> h;                 // support radius (optional, see SetSupport)
+
+private:
+  template <class Query> void walk(Query &q) const;
+  inline void nodeBounds(int node, double *lo, double *hi) const;
+
+  int numPart;
+  int numLevels;                   // level 0 are the leaves, numLevels-1 the root
+  vector<int> levelOffset;         // first node of each level, levelOffset[numLevels] = total
+  vector<unsigned short> qmin;     // quantised node bounds, 3 per node
+  vector<unsigned short> qmax;
+  double qscale[3];                // box length per quantisation step
+  vector<float> nodeH;             // maximum support radius per node
+};
+
+#endif //AREPO_RT_GASTREE_H
@@ -12,6 +12,15 @@
 #include "camera.h"
 #include "renderer.h"
 
+// ------------------------------- VolumeIntegrator -------------------------------
+Spectrum VolumeIntegrator::LiContinue(const Scene *scene, const Renderer *renderer, const Ray &ray,
+                                      const Spectrum &Lv, RNG &rng, Spectrum *T, int *prevEntryCell,
+                                      int *prevEntryTetra, int threadNum) const
+{
+  terminate("VolumeIntegrator: this integrator cannot continue rays from other tasks (mpiRender).");
+  return Lv;
+}
+
 // ------------------------------- EmissionIntegrator -------------------------------
 void EmissionIntegrator::RequestSamples(Sampler *sampler, Sample *sample, const Scene *scene)
 {
@@ -91,6 +100,10 @@ EmissionIntegrator *CreateEmissionVolumeIntegrator(const float stepSize)
 // ------------------------------- VoronoiIntegrator -------------------------------
 void VoronoiIntegrator::Preprocess(const Scene *scene, const Camera *camera, const Renderer *renderer)
 {
+  // per-tetra data for the current view (DTFE)
+  if (scene->arepoMesh)
+    scene->arepoMesh->precomputeTetraGrads(camera);
+    
   // find entry voronoi cells for rays
   
   // distribute rays to appropriate start tasks
@@ -122,6 +135,10 @@ Spectrum VoronoiIntegrator::Li(const Scene *scene, const Renderer *renderer, con
   if (!scene->arepoMesh || !scene->arepoMesh->IntersectP(ray, &t0, &t1) || (t1-t0) == 0.0f) {
     IF_DEBUG(cout << " Returning! IntersectP t0 = " << t0 << " t1 = " << t1 << endl);
     *T = Spectrum(1.0f);
+    
+    // mpiRender=rays: a ray missing the box is added to the image by task 0 only
+    if (Config.mpiRender == "rays")
+      ray.task = (ThisTask == 0) ? 0 : -1;
     return 0.0f;
   }
     
@@ -145,13 +162,30 @@ Spectrum VoronoiIntegrator::Li(const Scene *scene, const Renderer *renderer, con
   IF_DEBUG(cout << " t0 = " << t0 << " t1 = " << t1
                 << " ray.min_t = " << ray.min_t << " ray.max_t = " << ray.max_t << endl);   
   
+  // mpiRender=rays: all tasks generate the same camera rays, each is traced from its entry point
+  // by the task whose domain contains it (ray.task < 0: not traced here)
+  if (Config.mpiRender == "rays" && scene->arepoMesh->TaskOfPoint(ray(ray.min_t)) != ThisTask) {
+    ray.task = -1;
+    *T = Tr;
+    return Lv;
+  }
+  
   // no actual gas cells (no snapshot loaded, doing something else)?
-  if( !NumGas )
+  if( !NumGas ) {
+    ray.task = ThisTask;
+    *T = Tr;
     return Lv;
+  }
 
   // find the voronoi cell the ray will enter (or be in) first
   scene->arepoMesh->LocateEntryCell(ray, prevEntryCell);
   
+  // entry cell is a ghost (mpiRender=rays): forwarded to its task, which continues with LiContinue()
+  if (ray.task != ThisTask) {
+    *T = Tr;
+    return Lv;
+  }
+  
 #if defined(DEBUG_VERIFY_ENTRY_CELLS)
   Point pos = ray(ray.min_t);
       
@@ -163,9 +197,50 @@ Spectrum VoronoiIntegrator::Li(const Scene *scene, const Renderer *renderer, con
   scene->arepoMesh->LocateEntryTetra(ray, prevEntryTetra);
 #endif
 
-  // TODO: exchange?
+  march(scene, ray, t0, t1, Lv, Tr, rng, threadNum);
+  
+  *T = Tr;
+  return Lv;
+}
+
+// mpiRender=rays: the ray left the domain of another task at ray.min_t, into a cell of this one
+Spectrum VoronoiIntegrator::LiContinue(const Scene *scene, const Renderer *renderer, const Ray &ray,
+                                       const Spectrum &Lv, RNG &rng, Spectrum *T, int *prevEntryCell,
+                                       int *prevEntryTetra, int threadNum) const
+{
+  IF_DEBUG(cout << "VoronoiIntegrator::LiContinue()" << endl);
+  
+  double t0, t1;
+  Spectrum Lc = Lv;
+  Spectrum Tr = *T;
+  
+  // box entry and exit of the camera ray (which starts at t=0), as in Li()
+  if (!scene->arepoMesh->IntersectP(Ray(ray.o, ray.d, 0.0), &t0, &t1))
+    t0 = t1 = ray.min_t;
+  
+  scene->arepoMesh->LocateEntryCell(ray, prevEntryCell);
+  
+  if (ray.task != ThisTask) {
+    *T = Tr;
+    return Lc;
+  }
+  
+#if defined(DTFE_INTERP) || defined(NNI_WATSON_SAMBRIDGE) || defined(NNI_LIANG_HALE)
+  scene->arepoMesh->LocateEntryTetra(ray, prevEntryTetra);
+#endif
+
+  march(scene, ray, t0, t1, Lc, Tr, rng, threadNum);
   
-  // advance ray through voronoi cells
+  *T = Tr;
+  return Lc;
+}
+
+// advance ray through voronoi cells, accumulating into Lv and Tr, until it leaves the box (or 
+// rayMaxT), is terminated by roulette (then ray.task = ThisTask), or enters a cell of another 
+// task (ray.task, mpiRender=rays), where it continues with LiContinue()
+void VoronoiIntegrator::march(const Scene *scene, const Ray &ray, double t0, double t1, 
+                              Spectrum &Lv, Spectrum &Tr, RNG &rng, int threadNum) const
+{
   int count = 0;
 #ifdef DEBUG
   Point p = ray(ray.min_t);
@@ -200,6 +275,10 @@ Spectrum VoronoiIntegrator::Li(const Scene *scene, const Renderer *renderer, con
     if (!scene->arepoMesh->AdvanceRayOneCellNew(ray, &t0, &t1, Lv, Tr, threadNum) )
       break;
     
+    // next cell is owned by another task
+    if (ray.task != ThisTask)
+      return;
+    
     // roulette terminate ray marching if transmittance is small (only if not doing raw integrals)
     if (!Config.projColDens && Tr.y() < 1e-3)
     {
@@ -216,14 +295,15 @@ Spectrum VoronoiIntegrator::Li(const Scene *scene, const Renderer *renderer, con
     }
   }
   
+  // ray done (its last step may have been into a cell of another task at the exit)
+  ray.task = ThisTask;
+  
 #ifdef DEBUG
   p = ray(ray.min_t);
   cout << " VoronoiIntegrator::Li(done_f) Lv.y = " << setw(6) << Lv.y()
        << " Tr.y = " << Tr.y() << " ray.x = " << setw(5) << p.x 
        << " ray.y = " << setw(5) << p.y << " ray.z = " << setw(5) << p.z << endl << endl;
 #endif
-  *T = Tr;
-  return Lv;
 }
 
 VoronoiIntegrator *CreateVoronoiVolumeIntegrator()
@@ -287,8 +367,23 @@ Spectrum TreeSearchIntegrator::Li(const Scene *scene, const Renderer *renderer,
                 << " ray.min_t = " << ray.min_t << " ray.max_t = " << ray.max_t << endl);   
   
 
-  // TODO: find initial tasks and exchange (or in preprocess)?
-  ray.task = 0;
+#ifdef TREE_ANALYTIC_PROJECTION
+  // raw column densities: exact kernel line integrals along the whole ray, which replace the sums
+  // over the steps below (still taken for the image)
+  double rawAnalytic[TF_NUM_VALS];
+  
+  if (Config.projColDens) {
+    scene->arepoTree->IntegrateRayAnalytic(ray, threadNum);
+    
+    for (int i = 0; i < TF_NUM_VALS; i++) {
+      rawAnalytic[i] = ray.raw_vals[i];
+      ray.raw_vals[i] = 0.0;
+    }
+  }
+#endif
+
+  // traced entirely on this task (mpiRender=composite: within its slab)
+  ray.task = ThisTask;
   ray.prevHSML = 10.0;
   
   // advance ray through box
@@ -341,6 +436,11 @@ Spectrum TreeSearchIntegrator::Li(const Scene *scene, const Renderer *renderer,
   cout << " TreeSearchIntegrator::Li(done_f) Lv.y = " << setw(6) << Lv.y()
        << " Tr.y = " << Tr.y() << " ray.x = " << setw(5) << p.x 
        << " ray.y = " << setw(5) << p.y << " ray.z = " << setw(5) << p.z << endl << endl;
+#endif
+#ifdef TREE_ANALYTIC_PROJECTION
+  if (Config.projColDens)
+    for (int i = 0; i < TF_NUM_VALS; i++)
+      ray.raw_vals[i] = rawAnalytic[i];
 #endif
   *T = Tr;
   return Lv;
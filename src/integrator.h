@@ -23,6 +23,11 @@ public:
                       int *prevEntryCell, int *prevEntryTetra, int taskNum) const = 0;
   virtual Spectrum Transmittance(const Scene *scene, const Renderer *renderer, const Ray &ray,
                                  const Sample *sample, RNG &rng) const = 0;
+  
+  // mpiRender=rays: continue a ray forwarded by another task, starting from its Lv and *transmittance
+  virtual Spectrum LiContinue(const Scene *scene, const Renderer *renderer, const Ray &ray, const Spectrum &Lv,
+                              RNG &rng, Spectrum *transmittance, int *prevEntryCell, int *prevEntryTetra,
+                              int threadNum) const;
 };
 
 class EmissionIntegrator : public VolumeIntegrator {
@@ -62,7 +67,12 @@ public:
               const Sample *sample, RNG &rng, Spectrum *transmittance, int *prevEntryCell, int *prevEntryTetra, int taskNum) const;
   Spectrum Transmittance(const Scene *scene, const Renderer *,
                          const Ray &ray, const Sample *sample, RNG &rng) const;
+  Spectrum LiContinue(const Scene *scene, const Renderer *renderer, const Ray &ray, const Spectrum &Lv,
+                      RNG &rng, Spectrum *transmittance, int *prevEntryCell, int *prevEntryTetra, int threadNum) const;
 private:
+  void march(const Scene *scene, const Ray &ray, double t0, double t1, Spectrum &Lv, Spectrum &Tr, 
+             RNG &rng, int threadNum) const;
+  
   // data
   int tauSampleOffset, scatterSampleOffset;
 };
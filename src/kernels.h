@@ -0,0 +1,278 @@
+/*
+ * kernels.h
+ * dnelson
+ */
+
+#ifndef AREPO_RT_KERNELS_H
+#define AREPO_RT_KERNELS_H
+
+#include <algorithm> // push_heap/pop_heap
+
+/* interpolation weight kernels, specialised at compile time on the kernel shape, the IDW power
+ * and HSML_FAC. all batch evaluators take the squared distances of the k neighbors of one sample
+ * point as a contiguous float array, write the weights into a second array and return their sum.
+ * the inner loops are branch-free (selects only). the IDW loops vectorize at -O3, the SPH kernel
+ * loops (sqrtf) also need -fno-math-errno -fno-trapping-math (see OPTIMIZE in the Makefile).
+ */
+
+// IDW exponent and HSML_FAC as integer template arguments (power in halves, hsml factor in percent)
+#define IDW_POWER_X2  ((2.0*POWER_PARAM == (int)(2.0*POWER_PARAM)) ? (int)(2.0*POWER_PARAM) : -1)
+#define HSML_FAC_PCT  ((int)(HSML_FAC*100.0+0.5))
+
+// x^N with N known at compile time (no pow)
+template <int N> struct IntPow {
+  static inline float eval(float x) { return x * IntPow<N-1>::eval(x); }
+};
+template <> struct IntPow<0> {
+  static inline float eval(float x) { return 1.0f; }
+};
+
+/* SPH kernels: W(u) for u = r/h, compact support on [0,1], 3D normalization without the h^-3
+ * (which cancels in the normalized interpolant)
+ */
+
+// M4 cubic spline (Arepo/Gadget convention, identical to KERNEL_COEFF_1,2,5)
+struct CubicSplineKernel {
+  static inline float W(float u) {
+    float w1 = 2.546479089470f + 15.278874536822f * (u - 1.0f) * u * u;
+    float om = 1.0f - u;
+    float w2 = 5.092958178941f * om * om * om;
+    return u < 0.5f ? w1 : (u < 1.0f ? w2 : 0.0f);
+  }
+};
+
+// M6 quintic spline (q = 3u on [0,3])
+struct QuinticSplineKernel {
+  static inline float W(float u) {
+    float q  = 3.0f * u;
+    float a  = 3.0f - q > 0.0f ? 3.0f - q : 0.0f;
+    float b  = 2.0f - q > 0.0f ? 2.0f - q : 0.0f;
+    float c  = 1.0f - q > 0.0f ? 1.0f - q : 0.0f;
+    return 0.0716197243914f * (IntPow<5>::eval(a) - 6.0f * IntPow<5>::eval(b) + 15.0f * IntPow<5>::eval(c));
+  }
+};
+
+// Wendland C2 (Dehnen & Aly 2012)
+struct WendlandC2Kernel {
+  static inline float W(float u) {
+    float om = 1.0f - u > 0.0f ? 1.0f - u : 0.0f;
+    return 3.342253804930f * IntPow<4>::eval(om) * (1.0f + 4.0f * u);
+  }
+};
+
+// inverse distance weights 1/r^p from r^2 with PowX2 = 2p: even p needs no sqrt at all
+template <int PowX2> struct IDWWeight {
+  static inline float w(float r2) {
+    float d = IntPow<PowX2/4>::eval(r2);
+    if( PowX2 & 2 )
+      d *= sqrtf(r2);
+    if( PowX2 & 1 )
+      d *= sqrtf(sqrtf(r2));
+    return 1.0f / d;
+  }
+};
+
+// non (half-)integer POWER_PARAM falls back to pow
+template <> struct IDWWeight<-1> {
+  static inline float w(float r2) {
+    return powf(r2, -0.5f * (float)POWER_PARAM);
+  }
+};
+
+// batch evaluation: SPH kernel with hinv the inverse neighbor radius (scaled by HsmlFacPct/100)
+template <class Kernel, int HsmlFacPct>
+inline float sphKernelWeights(const float * __restrict__ r2, float * __restrict__ w, int n, float hinv)
+{
+  const float hinv_fac = hinv * (HsmlFacPct * 0.01f);
+  float wsum = 0.0f;
+
+  for( int i=0; i < n; i++ ) {
+    w[i] = Kernel::W( sqrtf(r2[i]) * hinv_fac );
+    wsum += w[i];
+  }
+
+  return wsum;
+}
+
+// batch evaluation: IDW
+template <int PowX2>
+inline float idwWeights(const float * __restrict__ r2, float * __restrict__ w, int n)
+{
+  float wsum = 0.0f;
+
+  for( int i=0; i < n; i++ ) {
+    w[i] = IDWWeight<PowX2>::w(r2[i]);
+    wsum += w[i];
+  }
+
+  return wsum;
+}
+
+// kernel shape selection (see ArepoRT.h)
+#if defined(SPH_KERNEL_QUINTIC)
+typedef QuinticSplineKernel SphKernel;
+#elif defined(SPH_KERNEL_WENDLAND_C2)
+typedef WendlandC2Kernel SphKernel;
+#else
+typedef CubicSplineKernel SphKernel;
+#endif
+
+/* line of sight integrals of a kernel (support 1), tabulated once: with q the impact parameter
+ * and u the position along the line (both in units of the support)
+ *   full chord    F(q^2) = int W(sqrt(q^2+u^2)) du over the whole chord (1D, in q^2, no sqrt)
+ *   partial chord G(q,u) = int_0^u W(sqrt(q^2+u'^2)) du' (odd in u, for chords cut by the ends
+ *                                                         of a ray, bilinear)
+ * such that a particle of support h contributes h^-2 * chord(q^2,u0,u1) to the column of W/h^3
+ */
+#define PROJ_KERNEL_NTAB  1024
+#define PROJ_KERNEL_NTAB2 128
+
+template <class Kernel>
+struct ProjectedKernel {
+  float full_[PROJ_KERNEL_NTAB];
+  float part_[PROJ_KERNEL_NTAB2][PROJ_KERNEL_NTAB2];
+
+  ProjectedKernel() {
+    const int nSub = 64; // Simpson intervals per table step (partial) or chord (full)
+
+    for( int i=0; i < PROJ_KERNEL_NTAB; i++ ) {
+      double q2 = (double)i / (PROJ_KERNEL_NTAB-1);
+      full_[i] = 2.0 * simpson(q2, 0.0, sqrt(1.0 - q2), 4*nSub);
+    }
+
+    for( int i=0; i < PROJ_KERNEL_NTAB2; i++ ) {
+      double q = (double)i / (PROJ_KERNEL_NTAB2-1);
+      double du = 1.0 / (PROJ_KERNEL_NTAB2-1);
+      double sum = 0.0;
+      part_[i][0] = 0.0f;
+
+      for( int j=1; j < PROJ_KERNEL_NTAB2; j++ ) {
+        sum += simpson(q*q, (j-1) * du, j * du, nSub);
+        part_[i][j] = (float)sum;
+      }
+    }
+  }
+
+  static double simpson(double q2, double a, double b, int n) {
+    double h = (b - a) / n;
+    double sum = W(q2, a) + W(q2, b);
+
+    for( int i=1; i < n; i++ )
+      sum += (i & 1 ? 4.0 : 2.0) * W(q2, a + i * h);
+
+    return sum * h / 3.0;
+  }
+
+  static double W(double q2, double u) {
+    return Kernel::W( (float)sqrt(q2 + u*u) );
+  }
+
+  inline float full(float q2) const {
+    float x = q2 * (PROJ_KERNEL_NTAB-1);
+    int i = (int)x;
+    if( i >= PROJ_KERNEL_NTAB-1 )
+      return 0.0f;
+    float f = x - i;
+    return full_[i] + f * (full_[i+1] - full_[i]);
+  }
+
+  inline float partial(float q, float u) const {
+    float sgn = u < 0.0f ? -1.0f : 1.0f;
+    float x = q * (PROJ_KERNEL_NTAB2-1);
+    float y = min(u * sgn, 1.0f) * (PROJ_KERNEL_NTAB2-1);
+    int i = min((int)x, PROJ_KERNEL_NTAB2-2);
+    int j = min((int)y, PROJ_KERNEL_NTAB2-2);
+    float fx = x - i, fy = y - j;
+
+    float g0 = part_[i][j]   + fy * (part_[i][j+1]   - part_[i][j]);
+    float g1 = part_[i+1][j] + fy * (part_[i+1][j+1] - part_[i+1][j]);
+    return sgn * (g0 + fx * (g1 - g0));
+  }
+
+  // integral over [u0,u1] of the line at squared impact parameter q2 (all in units of the support)
+  inline float chord(float q2, float u0, float u1) const {
+    if( q2 >= 1.0f )
+      return 0.0f;
+
+    float umax2 = 1.0f - q2;
+
+    if( u0 <= 0.0f && u1 >= 0.0f && u0*u0 >= umax2 && u1*u1 >= umax2 )
+      return full(q2);
+
+    float q = sqrtf(q2);
+    return partial(q, u1) - partial(q, u0);
+  }
+};
+
+// per-thread neighbor gather buffers (capacity is kept between samples)
+struct NeighborBatch {
+  vector<int>   inds;
+  vector<float> distsq;
+  vector<float> weights;
+  
+  // batch form (many samples, one neighbor set): neighbor positions relative to the parent cell,
+  // neighbor values (one row of k per quantity), and the nSamples x k distance and weight matrices
+  vector<float> posx, posy, posz;
+  vector<float> nvals;
+  vector<float> distsqMat, weightsMat;
+
+  void clear() { inds.clear(); distsq.clear(); }
+  void add(int ind, float r2) { inds.push_back(ind); distsq.push_back(r2); }
+  int size() const { return (int)inds.size(); }
+
+  // weights of the configured method for one row of n squared distances, hinv unused for IDW
+  template <int HsmlFacPct>
+  static float evalWeights(const float *r2, float *w, int n, float hinv) {
+#ifdef NATURAL_NEIGHBOR_IDW
+    return idwWeights<IDW_POWER_X2>(r2, w, n);
+#else
+    return sphKernelWeights<SphKernel,HsmlFacPct>(r2, w, n, hinv);
+#endif
+  }
+
+  template <int HsmlFacPct>
+  float computeWeights(float hinv) {
+    weights.resize(inds.size());
+    if( inds.empty() )
+      return 0.0f;
+    return evalWeights<HsmlFacPct>(&distsq[0], &weights[0], size(), hinv);
+  }
+};
+
+// smallest k nearest neighbor radius (and initial search radius), in mean interparticle spacings:
+// with k or more coincident particles the k-th distance is zero, which would neither grow by
+// doubling nor give a finite kernel normalisation
+#define KNN_HSML_MIN_FAC 1e-3
+
+inline float knnHsmlMin(double boxSize, int numPart) {
+  return KNN_HSML_MIN_FAC * boxSize / cbrt( (double)max(numPart, 1) );
+}
+
+// k nearest neighbor searches: bounded max-heap of (r2, index), the k nearest candidates offered
+struct KNNHeap {
+  KNNHeap() : k(0) { }
+  
+  vector< pair<float,int> > h;
+  int k;
+  
+  void reset(int kk) { h.clear(); k = kk; }
+  bool full() const { return (int)h.size() >= k; }
+  float top() const { return h.front().first; } // largest kept r2
+  
+  // returns true if the candidate was kept
+  bool push(float r2, int ind) {
+    if( !full() ) {
+      h.push_back( make_pair(r2, ind) );
+      push_heap( h.begin(), h.end() );
+      return true;
+    }
+    if( r2 >= top() )
+      return false;
+    pop_heap( h.begin(), h.end() );
+    h.back() = make_pair(r2, ind);
+    push_heap( h.begin(), h.end() );
+    return true;
+  }
+};
+
+#endif //AREPO_RT_KERNELS_H
@@ -0,0 +1,133 @@
+/*
+ * periodic.h
+ * dnelson
+ */
+
+#ifndef AREPO_RT_PERIODIC_H
+#define AREPO_RT_PERIODIC_H
+
+/* minimum image geometry of the periodic box, replacing the NGB_PERIODIC_LONG, NEAREST and WRAP
+ * macros (allvars.h) in the hot loops. each operation is a pair of selects or a min instead of
+ * nested ternaries through a shared temporary, such that they compile branch-free and inline into
+ * the callers' loops. REFLECTIVE_X/Y/Z axes reduce to the plain (unwrapped) operations at compile
+ * time. as for the macros, displacements are assumed to be less than one box length in magnitude.
+ */
+
+template <int Axis> struct PeriodicAxis { enum { on = 1 }; };
+#ifdef REFLECTIVE_X
+template <> struct PeriodicAxis<0> { enum { on = 0 }; };
+#endif
+#ifdef REFLECTIVE_Y
+template <> struct PeriodicAxis<1> { enum { on = 0 }; };
+#endif
+#ifdef REFLECTIVE_Z
+template <> struct PeriodicAxis<2> { enum { on = 0 }; };
+#endif
+
+template <typename T>
+struct PeriodicBox {
+  T size[3];
+  T half[3];
+
+  // copy of the box globals, such that loops keep them in registers
+  PeriodicBox() {
+    size[0] = boxSize_X; half[0] = boxHalf_X;
+    size[1] = boxSize_Y; half[1] = boxHalf_Y;
+    size[2] = boxSize_Z; half[2] = boxHalf_Z;
+  }
+
+  // signed displacement to the nearest periodic image (NEAREST_X)
+  template <int Axis> inline T nearest(T d) const {
+    if( !PeriodicAxis<Axis>::on )
+      return d;
+    d -= (d > half[Axis])  ? size[Axis] : T(0);
+    d += (d < -half[Axis]) ? size[Axis] : T(0);
+    return d;
+  }
+
+  // absolute minimum image distance along one axis (NGB_PERIODIC_LONG_X)
+  template <int Axis> inline T dist(T d) const {
+    T a = d < T(0) ? -d : d;
+    if( !PeriodicAxis<Axis>::on )
+      return a;
+    T b = size[Axis] - a;
+    return a < b ? a : b;
+  }
+
+  // position wrapped back into [0,size) (WRAP_X)
+  template <int Axis> inline T wrap(T x) const {
+    if( !PeriodicAxis<Axis>::on )
+      return x;
+    x -= (x > size[Axis]) ? size[Axis] : T(0);
+    x += (x < T(0))       ? size[Axis] : T(0);
+    return x;
+  }
+
+  // minimum image gap between the intervals [a0,a1] and [b0,b1] along one axis (0 if they overlap)
+  template <int Axis> inline T gap(T a0, T a1, T b0, T b1) const {
+    T g = intervalGap(a0, a1, b0, b1);
+    if( !PeriodicAxis<Axis>::on )
+      return g;
+    T gm = intervalGap(a0 - size[Axis], a1 - size[Axis], b0, b1);
+    T gp = intervalGap(a0 + size[Axis], a1 + size[Axis], b0, b1);
+    g = gm < g ? gm : g;
+    return gp < g ? gp : g;
+  }
+
+  static inline T intervalGap(T a0, T a1, T b0, T b1) {
+    T g = b0 - a1;
+    T h = a0 - b1;
+    g = h > g ? h : g;
+    return g > T(0) ? g : T(0);
+  }
+
+  // squared minimum image distance of a displacement
+  inline T distSq(T dx, T dy, T dz) const {
+    dx = dist<0>(dx);
+    dy = dist<1>(dy);
+    dz = dist<2>(dz);
+    return dx*dx + dy*dy + dz*dz;
+  }
+
+  // move pos to the periodic image closest to ref (periodic_wrap_point)
+  template <typename U> inline void nearestImage(U pos[3], const U ref[3]) const {
+    pos[0] = ref[0] + nearest<0>(pos[0] - ref[0]);
+    pos[1] = ref[1] + nearest<1>(pos[1] - ref[1]);
+    pos[2] = ref[2] + nearest<2>(pos[2] - ref[2]);
+  }
+};
+
+/* search box (e.g. cube of half-width h around a point) for the neighbor tree walks, including its
+ * copies shifted by one box length, such that a node test is a single expression over all three axes
+ */
+struct PeriodicSearch {
+  float min[3], max[3], maxLsub[3], minLadd[3];
+
+  void set(float x, float y, float z, float h) {
+    float lo[3] = {x - h, y - h, z - h};
+    float hi[3] = {x + h, y + h, z + h};
+    setBounds(lo, hi);
+  }
+
+  // general axis aligned search box [lo,hi]
+  void setBounds(const float lo[3], const float hi[3]) {
+    float size[3] = {(float)boxSize_X, (float)boxSize_Y, (float)boxSize_Z};
+
+    for( int k=0; k < 3; k++ ) {
+      min[k]     = lo[k];
+      max[k]     = hi[k];
+      maxLsub[k] = max[k] - size[k];
+      minLadd[k] = min[k] + size[k];
+    }
+  }
+
+  // true if the node extent [rmin,rmax] cannot overlap the search cube (node can be discarded)
+  template <typename F> inline bool disjoint(const F *rmin, const F *rmax) const {
+    int out = 0;
+    for( int k=0; k < 3; k++ )
+      out |= ((min[k] > rmax[k]) & (maxLsub[k] < rmin[k])) | ((minLadd[k] > rmax[k]) & (max[k] < rmin[k]));
+    return out != 0;
+  }
+};
+
+#endif //AREPO_RT_PERIODIC_H
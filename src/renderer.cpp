@@ -12,6 +12,8 @@
 #include "sampler.h"
 #include "volume.h"
 #include "integrator.h"
+#include "splat.h"
+#include "distributed.h"
 
 // RendererTask
 
@@ -31,22 +33,25 @@ void RendererTask::Run(int threadNum)
   //if( Config.filename.substr(0,4) == "none" && typeid(*renderer) != typeid(QuadIntersectionIntegrator) )
   //  return;
     
-  // Get sub-_Sampler_ for _SamplerRendererTask_
-  Sampler *sampler = mainSampler->GetSubSampler(taskNum, taskCount);
+  // Get sub-_Sampler_ for _SamplerRendererTask_ (already given if split off another task)
+  Sampler *sampler = subSampler ? subSampler : mainSampler->GetSubSampler(taskNum, taskCount);
   if (!sampler) {
       return;
   }
+  subSampler = NULL;
 
   // Declare local variables used for rendering loop
-  RNG rng(taskNum);
+  RNG rng(seed);
 
-  // Allocate space for samples and intersections
+  // Space for samples and intersections (per thread, kept across tasks)
   int maxSamples = sampler->MaximumSampleCount();
-  Sample *samples = origSample->Duplicate(maxSamples);
-  Ray *rays = new Ray[maxSamples];
-  Spectrum *Ls = new Spectrum[maxSamples];
-  Spectrum *Ts = new Spectrum[maxSamples];
-  float *rayWeights = new float[maxSamples];
+  RenderArena *arena = renderer->Arena(threadNum, origSample, maxSamples);
+  
+  Sample *samples = arena->samples;
+  Ray *rays = arena->rays;
+  Spectrum *Ls = arena->Ls;
+  Spectrum *Ts = arena->Ts;
+  float *rayWeights = arena->rayWeights;
 
   // Get samples from _Sampler_ and update image
   int sampleCount;
@@ -54,13 +59,28 @@ void RendererTask::Run(int threadNum)
   // accelerate entry point location by using the entry point of the previous ray from this task
   int prevEntryCell  = -1;
   int prevEntryTetra = 0;
+  int nRays = 0;
   
   while ((sampleCount = sampler->GetMoreSamples(samples, rng)) > 0)
   {
+    // timeBudget: stop refining
+    if (renderer->OutOfTime())
+      break;
+    
+    // idle workers: give them the second half of the remaining rows of this task
+    if (shouldSplitTask(threadNum)) {
+      Sampler *rest = sampler->Split();
+      if (rest)
+        spawnTask(new RendererTask(scene, renderer, camera, rest, origSample, taskNum, taskCount,
+                                   rng.RandomUInt(), true), threadNum);
+    }
+    
     IF_DEBUG(cout << " [Thread=" << setw(2) << threadNum << " Task=" << setw(3) << taskNum 
                   << "] RendererTask::Run() maxSamples = " << maxSamples 
                   << " sampleCount = " << sampleCount << endl);
     
+    nRays += sampleCount;
+    
     // generate camera rays and compute radiance along rays
     for (int i = 0; i < sampleCount; i++)
     {
@@ -87,8 +107,10 @@ void RendererTask::Run(int threadNum)
     {
       for (int i = 0; i < sampleCount; ++i)
       {
-        if( rayWeights[i] > 0 )
+        if( rayWeights[i] > 0 && !renderer->ExportRay(samples[i], rayWeights[i], rays[i], Ls[i], Ts[i], threadNum) ) {
           camera->film->AddSample(samples[i], Ls[i], rays[i], threadNum);
+          camera->film->AddTransmittance(samples[i], Ts[i]);
+        }
       }
       // TODO:
       // mark taskFinishedArray[taskNum] = 1;
@@ -101,23 +123,243 @@ void RendererTask::Run(int threadNum)
     cout << " [Thread=" << setw(2) << threadNum << " Task=" << setw(3) << taskNum 
         << "] Raytracing phase: [" << setw(6) << time << "] seconds." << endl;
   }
-  else {
+  else if( !split ) {
     cout << ".";
     if( taskNum % 80 == 0 && taskNum > 0 && taskCount > 100 )
       cout << "]" << endl << " [";
     fflush(stdout);
   }
   
+  renderer->RecordTaskTime(sampler, time, nRays, threadNum);
+  
   // Clean up after _SamplerRendererTask_ is done with its image region
   camera->film->UpdateDisplay(sampler->xPixelStart, sampler->yPixelStart, 
                               sampler->xPixelEnd+1, sampler->yPixelEnd+1);
       
   delete sampler;
+}
+
+// RenderArena
+void RenderArena::Reserve(const Sample *sample, int count)
+{
+  // the sample layout (integrator requests) is fixed, so this only allocates once per thread
+  if (samples && count <= size && samples[0].n1D == sample->n1D && samples[0].n2D == sample->n2D)
+    return;
+  
+  release();
+  
+  size = count;
+  samples = sample->Duplicate(size);
+  rays = new Ray[size];
+  Ls = new Spectrum[size];
+  Ts = new Spectrum[size];
+  rayWeights = new float[size];
+}
+
+void RenderArena::release()
+{
   delete[] samples;
   delete[] rays;
   delete[] Ls;
   delete[] Ts;
   delete[] rayWeights;
+  
+  samples = NULL; rays = NULL;
+  Ls = Ts = NULL;
+  rayWeights = NULL;
+  size = 0;
+}
+
+// MeshEdgeGather: edges of a range of tetra (or Voronoi faces) into per thread lists, which are
+// then drawn by one thread, since Film::DrawLine accumulates without synchronization
+struct MeshEdgeGather {
+  MeshEdgeGather(ArepoMesh *m, bool vor) : mesh(m), voronoi(vor), edges(numberOfCores()) { }
+
+  void operator()(int i0, int i1, int threadNum) {
+    for (int i = i0; i < i1; i++) {
+      if (voronoi)
+        mesh->VoronoiEdges(i, &edges[threadNum]);
+      else
+        mesh->TetraEdges(i, &edges[threadNum]);
+    }
+  }
+
+  ArepoMesh *mesh;
+  bool voronoi;
+  vector< vector<Line> > edges;
+};
+
+// TileCostMap
+void TileCostMap::Reset(int xs, int xe, int ys, int ye)
+{
+  xStart = xs; xEnd = xe;
+  yStart = ys; yEnd = ye;
+  
+  nx = (xEnd - xStart + TILE_COST_BLOCK - 1) / TILE_COST_BLOCK;
+  ny = (yEnd - yStart + TILE_COST_BLOCK - 1) / TILE_COST_BLOCK;
+  
+  cost.assign(nx * ny, 0.0);
+}
+
+bool TileCostMap::Matches(int xs, int xe, int ys, int ye) const
+{
+  return xs == xStart && xe == xEnd && ys == yStart && ye == yEnd;
+}
+
+double TileCostMap::Total() const
+{
+  return blockCost(0, nx, 0, ny);
+}
+
+// distribute the time of a rendered window uniformly over its pixels
+void TileCostMap::AddTime(const TileWindow &w)
+{
+  double perPixel = w.cost / ((w.x1 - w.x0) * (w.y1 - w.y0));
+  
+  for (int y = w.y0; y < w.y1; y++) {
+    double *row = &cost[ (y - yStart) / TILE_COST_BLOCK * nx ];
+    
+    for (int x = w.x0; x < w.x1; x++)
+      row[ (x - xStart) / TILE_COST_BLOCK ] += perPixel;
+  }
+}
+
+double TileCostMap::blockCost(int bx0, int bx1, int by0, int by1) const
+{
+  double sum = 0.0;
+  
+  for (int by = by0; by < by1; by++)
+    for (int bx = bx0; bx < bx1; bx++)
+      sum += cost[by * nx + bx];
+  
+  return sum;
+}
+
+// recursive bisection of the blocks [bx0,bx1) x [by0,by1) into n tiles: split the longer side
+// where the cost fraction of the first part reaches its share of the tiles
+void TileCostMap::split(int bx0, int bx1, int by0, int by1, int n, vector<TileWindow> &tiles) const
+{
+  bool alongX = (bx1 - bx0) >= (by1 - by0);
+  int len = alongX ? bx1 - bx0 : by1 - by0;
+  
+  if (n == 1 || len == 1) {
+    tiles.push_back(TileWindow(xStart + bx0 * TILE_COST_BLOCK, min(xStart + bx1 * TILE_COST_BLOCK, xEnd),
+                               yStart + by0 * TILE_COST_BLOCK, min(yStart + by1 * TILE_COST_BLOCK, yEnd),
+                               blockCost(bx0, bx1, by0, by1)));
+    return;
+  }
+  
+  int nA = n / 2;
+  double total = blockCost(bx0, bx1, by0, by1);
+  double target = total * nA / n;
+  
+  // split position (at least one block on each side), geometric if there is no cost
+  int s = len / 2;
+  
+  if (total > 0.0) {
+    double sum = 0.0;
+    
+    for (s = 1; s < len - 1; s++) {
+      sum += alongX ? blockCost(bx0 + s - 1, bx0 + s, by0, by1) : blockCost(bx0, bx1, by0 + s - 1, by0 + s);
+      if (sum >= target)
+        break;
+    }
+  }
+  
+  if (alongX) {
+    split(bx0, bx0 + s, by0, by1, nA, tiles);
+    split(bx0 + s, bx1, by0, by1, n - nA, tiles);
+  } else {
+    split(bx0, bx1, by0, by0 + s, nA, tiles);
+    split(bx0, bx1, by0 + s, by1, n - nA, tiles);
+  }
+}
+
+// tiles of equal cost, most expensive first
+void TileCostMap::MakeTiles(int nTiles, vector<TileWindow> &tiles) const
+{
+  tiles.clear();
+  
+  if (nx && ny)
+    split(0, nx, 0, ny, max(nTiles, 1), tiles);
+  
+  sort(tiles.begin(), tiles.end());
+}
+
+// CostPrePass: time one ray through the center of each cost map block
+struct CostPrePass {
+  CostPrePass(const Scene *sc, const Renderer *r, Camera *c, const Sample *s, TileCostMap &m)
+    : scene(sc), renderer(r), camera(c), costs(m)
+  {
+    int nThreads = numberOfCores();
+    
+    for (int i = 0; i < nThreads; i++)
+      samples.push_back(s->Duplicate(1));
+    
+    prevEntryCell.assign(nThreads, -1);
+    prevEntryTetra.assign(nThreads, 0);
+  }
+  
+  ~CostPrePass() {
+    for (unsigned int i = 0; i < samples.size(); i++)
+      delete[] samples[i];
+  }
+
+  void operator()(int by0, int by1, int threadNum) {
+    Sample *sample = samples[threadNum];
+    RNG rng(by0);
+    Ray ray;
+    Spectrum T;
+    
+    // no stratification, all sample dimensions at the center
+    sample->lensU = sample->lensV = 0.5f;
+    sample->time = camera->shutterOpen;
+    
+    for (uint32_t j = 0; j < sample->n1D.size(); j++)
+      for (uint32_t k = 0; k < sample->n1D[j]; k++)
+        sample->oneD[j][k] = 0.5f;
+    for (uint32_t j = 0; j < sample->n2D.size(); j++)
+      for (uint32_t k = 0; k < 2 * sample->n2D[j]; k++)
+        sample->twoD[j][k] = 0.5f;
+    
+    for (int by = by0; by < by1; by++) {
+      int y0 = costs.yStart + by * TILE_COST_BLOCK;
+      int y1 = min(y0 + TILE_COST_BLOCK, costs.yEnd);
+      
+      for (int bx = 0; bx < costs.nx; bx++) {
+        int x0 = costs.xStart + bx * TILE_COST_BLOCK;
+        int x1 = min(x0 + TILE_COST_BLOCK, costs.xEnd);
+        
+        sample->imageX = 0.5f * (x0 + x1);
+        sample->imageY = 0.5f * (y0 + y1);
+        
+        if (camera->GenerateRay(*sample, &ray) <= 0)
+          continue;
+        
+        Timer timer;
+        timer.Start();
+        
+        renderer->Li(scene, ray, sample, rng, &T, &prevEntryCell[threadNum], &prevEntryTetra[threadNum], 
+                     threadNum);
+        
+        costs.cost[by * costs.nx + bx] = timer.Time() * (x1 - x0) * (y1 - y0);
+      }
+    }
+  }
+
+  const Scene *scene;
+  const Renderer *renderer;
+  Camera *camera;
+  TileCostMap &costs;
+  vector<Sample *> samples;
+  vector<int> prevEntryCell, prevEntryTetra;
+};
+
+static double wallClock()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + 1e-6 * tv.tv_usec;
 }
 
 // Renderer
@@ -129,20 +371,54 @@ Renderer::Renderer(Sampler *s, Camera *c, VolumeIntegrator *vi)
   sampler = s;
   camera = c;
   volumeIntegrator = vi;
+  sample = NULL;
+  rayExchange = (Config.mpiRender == "rays") ? new RayExchange() : NULL;
+  
+  // writeQueue: frames are written by a separate thread (on the task writing them)
+  writer = NULL;
+  if (Config.writeQueue > 0 && (Config.mpiRender == "none" || ThisTask == 0))
+    writer = new FrameWriter(Config.writeQueue);
+  
+  arenas.assign(numberOfCores(), NULL);
+  
+  renderStart = wallClock();
+  abortablePass = false;
 }
 
 Renderer::~Renderer()
 {
+  // worker threads are kept for all frames
+  TasksCleanup();
+  
+  for (unsigned int i=0; i < arenas.size(); i++)
+    delete arenas[i];
+  
+  delete writer; // after the pending frames are written
+  delete sample;
+  delete rayExchange;
   delete sampler;
   delete camera;
   delete volumeIntegrator;
 }
 
+// next frame: replace the camera, keeping its film (cleared by the caller)
+void Renderer::SetCamera(Camera *c)
+{
+  if (c != camera) {
+    if (c->film == camera->film)
+      camera->film = NULL;
+    delete camera;
+  }
+  
+  camera = c;
+}
+
 void Renderer::Render(const Scene *scene, int frameNum)
 {
   volumeIntegrator->Preprocess(scene, camera, this);
-  // Allocate and initialize _sample_
-  Sample *sample = new Sample(sampler, volumeIntegrator, scene);
+  // Allocate and initialize _sample_ (once, its layout only depends on the integrator)
+  if (!sample)
+    sample = new Sample(sampler, volumeIntegrator, scene);
   
   // Make timer
   Timer *timer = new Timer();
@@ -171,24 +447,97 @@ void Renderer::Render(const Scene *scene, int frameNum)
   if( !Config.verbose )
     cout << " [";
   
-  // add render tasks to queue
-  vector<Task *> renderTasks;
-  
-  for (int i=0; i < Config.nTasks; i++)
-    renderTasks.push_back(new RendererTask(scene, this, camera, sampler, sample, 
-                                           nTasks-1-i, nTasks));
-
-  // TODO: we are loading from a restart? if so load the taskFinishedArray now and fill it in
-                                             
-  // init tasks and run
-  startTasks(renderTasks);
+  int imageStride = 1; // progressive: finest complete pixel grid
   
-  // wait with this thread until workers are done
-  waitUntilAllTasksDone();
-
-  // free tasks when all done
-  for (unsigned int i=0; i < renderTasks.size(); i++)
-    delete renderTasks[i];
+  if (Config.projSplat)
+  {
+    // projections only: splat the particles into the film instead of tracing rays
+    SplatRenderer *splat = new SplatRenderer(camera);
+    splat->Render();
+    delete splat;
+  }
+  else
+  {
+    // progressive: passes over the pixel grids of stride k, k/2, .., 1, each after the first skipping
+    // the pixels of the previous one, such that the last completes the image
+    int firstStride = max(Config.progressive, 1);
+    float passTime = 0.0;
+    
+    renderStart = wallClock();
+    
+    if (Config.balanceTiles)
+      taskTimes.assign(nCores, vector<TileWindow>());
+    
+    threadRays.assign(nCores, 0);
+    threadTime.assign(nCores, 0.0);
+    
+    for (int stride = firstStride, pass = 0; stride >= 1; stride /= 2, pass++)
+    {
+      // timeBudget: skip a pass which would not finish (3x the rays of the first, then 4x the last)
+      if (pass > 0 && Config.timeBudget > 0.0 && 
+          wallClock() - renderStart + passTime * (pass == 1 ? 3 : 4) > Config.timeBudget) {
+        cout << endl << " [Task=00] Time budget: stopping at pixel stride [" << imageStride << "]." << endl;
+        break;
+      }
+      
+      Timer passTimer;
+      passTimer.Start();
+      
+      sampler->SetPixelStride(stride, pass > 0);
+      abortablePass = (pass > 0);
+      
+      if (Config.mpiRender == "tiles")
+        renderTiles(scene, sample);
+      else
+        renderPass(scene, sample);
+      passTime = (float)passTimer.Time();
+      
+      if (OutOfTime()) {
+        cout << endl << " [Task=00] Time budget: pass at pixel stride [" << stride << "] incomplete, using ["
+             << imageStride << "]." << endl;
+        break;
+      }
+      
+      imageStride = stride;
+      
+      if (stride > 1) {
+        if (Config.verbose)
+          cout << " [Task=00] Progressive pass [" << pass+1 << "] pixel stride [" << stride << "]: [" 
+               << passTime << "] seconds." << endl;
+        
+        // the image scaling may still be set by the previous frame on the writer thread
+        if (writer)
+          writer->Drain();
+        camera->film->WriteImage(frameNum, 1.f, stride, pass+1);
+      }
+    }
+    
+    sampler->SetPixelStride(1, false);
+    abortablePass = false;
+      
+    // balanceTiles: the measured task times are the cost estimate for the next frame
+    if (Config.balanceTiles) {
+      frameCost.Reset(sampler->xPixelStart, sampler->xPixelEnd, sampler->yPixelStart, sampler->yPixelEnd);
+      
+      for (unsigned int i=0; i < taskTimes.size(); i++)
+        for (unsigned int j=0; j < taskTimes[i].size(); j++)
+          frameCost.AddTime(taskTimes[i][j]);
+    }
+    
+    // mpiRender=rays: finish the rays which left the domain of this task, then sum the images
+    if (rayExchange) {
+      rayExchange->Run(scene, this, camera->film);
+      camera->film->Reduce();
+    }
+    
+    // mpiRender=tiles: each tile was rendered by one task, sum the images
+    if (Config.mpiRender == "tiles")
+      camera->film->Reduce();
+    
+    // mpiRender=composite: combine the images of the slabs
+    if (Config.mpiRender == "composite")
+      camera->film->Composite(camera);
+  }
   
   if( !Config.verbose )
     cout << "]" << endl;
@@ -199,20 +548,32 @@ void Renderer::Render(const Scene *scene, int frameNum)
   //   write restart file: pixels/integrals BlockedArrays, taskFinishedArray, Config parameters (nTasks etc)
   //   return;
   
+  // mpiRender=rays,composite: only task 0 has the complete image
+  bool writeOutput = (Config.mpiRender == "none" || ThisTask == 0);
+  
   // do rasterization stage with just one task
-  if (Config.drawTetra || Config.drawVoronoi || Config.drawBBox || Config.drawSphere)
+  if (writeOutput && (Config.drawTetra || Config.drawVoronoi || Config.drawBBox || Config.drawSphere))
     Renderer::RasterizeStage(scene);    
   
   float seconds = (float)timer->Time();
   cout << endl << "[" << setw(3) << frameNum << "] Render complete (" 
        << setw(6) << seconds << " seconds)." << endl << endl;
   
-  // cleanup and store image, column integrals, and raw floats
-  TasksCleanup();
-  delete sample;
+  if (Config.numaPlacement != "none" && !Config.projSplat)
+    reportNodeThroughput(seconds);
   
-  camera->film->WriteImage(frameNum);
-  camera->film->WriteIntegrals();
+  if (!writeOutput)
+    return;
+  
+  // writeQueue: hand the image to the writer thread, the film is cleared for the next frame
+  if (writer) {
+    writer->Submit(camera->film, frameNum, imageStride);
+    return;
+  }
+  
+  // store image, column integrals, and raw floats
+  camera->film->WriteImage(frameNum, 1.f, imageStride);
+  camera->film->WriteIntegrals(imageStride);
   IF_DEBUG(camera->film->WriteRawRGB());
 }
 
@@ -227,16 +588,17 @@ void Renderer::RasterizeStage(const Scene *scene)
   // testing: rasterize edges of AM tetra
   if (Config.drawTetra && scene->arepoMesh) {
     Spectrum Ltetra = Spectrum::FromRGB(Config.rgbTetra);
-    for (int i = 0; i < scene->arepoMesh->Ndt; i++) {
-      edges.clear();
+    MeshEdgeGather gather(scene->arepoMesh, false);
+    parallelFor(scene->arepoMesh->Ndt, gather);
+    
+    for (unsigned int k = 0; k < gather.edges.size(); k++) {
+      const vector<Line> &tedges = gather.edges[k];
       
-      if(scene->arepoMesh->TetraEdges(i,&edges)) {
-        for (unsigned int j = 0; j < edges.size(); j++) {
-          IF_DEBUG(cout << " RL p1.x = " << edges[j].p1.x << " p1.y = " << edges[j].p1.y
-                        << " p1.z = " << edges[j].p1.z << " p2.x = " << edges[j].p2.x
-                        << " p2.y = " << edges[j].p2.y << " p2.z = " << edges[j].p2.z << endl);
-          camera->RasterizeLine(edges[j].p1,edges[j].p2,Ltetra);
-        }
+      for (unsigned int j = 0; j < tedges.size(); j++) {
+        IF_DEBUG(cout << " RL p1.x = " << tedges[j].p1.x << " p1.y = " << tedges[j].p1.y
+                      << " p1.z = " << tedges[j].p1.z << " p2.x = " << tedges[j].p2.x
+                      << " p2.y = " << tedges[j].p2.y << " p2.z = " << tedges[j].p2.z << endl);
+        camera->RasterizeLine(tedges[j].p1,tedges[j].p2,Ltetra);
       }
     }
   }
@@ -248,15 +610,17 @@ void Renderer::RasterizeStage(const Scene *scene)
     
     // compute edges
     int numFaces = scene->arepoMesh->ComputeVoronoiEdges(); 
+    MeshEdgeGather gather(scene->arepoMesh, true);
+    parallelFor(numFaces-1, gather);
     
-    for (int i = 0; i < numFaces-1; i++) {
-      if (scene->arepoMesh->VoronoiEdges(i,&edges)) {
-        for (unsigned int j = 0; j < edges.size(); j++) {
-          IF_DEBUG(cout << " VE p1.x = " << edges[j].p1.x << " p1.y = " << edges[j].p1.y
-                        << " p1.z = " << edges[j].p1.z << " p2.x = " << edges[j].p2.x
-                        << " p2.y = " << edges[j].p2.y << " p2.z = " << edges[j].p2.z << endl);
-          camera->RasterizeLine(edges[j].p1,edges[j].p2,Lvor);
-        }
+    for (unsigned int k = 0; k < gather.edges.size(); k++) {
+      const vector<Line> &vedges = gather.edges[k];
+      
+      for (unsigned int j = 0; j < vedges.size(); j++) {
+        IF_DEBUG(cout << " VE p1.x = " << vedges[j].p1.x << " p1.y = " << vedges[j].p1.y
+                      << " p1.z = " << vedges[j].p1.z << " p2.x = " << vedges[j].p2.x
+                      << " p2.y = " << vedges[j].p2.y << " p2.z = " << vedges[j].p2.z << endl);
+        camera->RasterizeLine(vedges[j].p1,vedges[j].p2,Lvor);
       }
     }
   } 
@@ -374,6 +738,196 @@ Spectrum Renderer::Li(const Scene *scene, const Ray &ray, const Sample *sample,
   return Lvi;
 }
 
+Spectrum Renderer::LiContinue(const Scene *scene, const Ray &ray, const Spectrum &Lv, RNG &rng, Spectrum *T,
+                              int *prevEntryCell, int *prevEntryTetra, int threadNum) const
+{
+  return volumeIntegrator->LiContinue(scene, this, ray, Lv, rng, T, prevEntryCell, prevEntryTetra, threadNum);
+}
+
+// mpiRender=rays: true if the ray is not added to the image here, queued for the task owning its
+// next cell if it left this domain (L weighted, as the image sample), or dropped if traced elsewhere
+bool Renderer::ExportRay(const CameraSample &sample, float weight, const Ray &ray, const Spectrum &L,
+                         const Spectrum &T, int threadNum) const
+{
+  if (!rayExchange || ray.task == ThisTask)
+    return false;
+  
+  if (ray.task >= 0)
+    rayExchange->Export(sample, weight, ray, L / weight, T, threadNum);
+  
+  return true;
+}
+
+// render all pixels of the current pass of the sampler
+void Renderer::renderPass(const Scene *scene, Sample *sample)
+{
+  // add render tasks to queue (run in this order, idle workers steal from the back and split
+  // running tasks once nothing is left to steal)
+  vector<Task *> renderTasks;
+  
+  if (Config.balanceTiles)
+  {
+    // tiles of equal estimated cost, from the previous frame or a pre-pass, most expensive first
+    if (!frameCost.Matches(sampler->xPixelStart, sampler->xPixelEnd, sampler->yPixelStart, sampler->yPixelEnd) ||
+        frameCost.Total() <= 0.0)
+      costPrePass(scene, sample, frameCost);
+      
+    vector<TileWindow> tiles;
+    frameCost.MakeTiles(Config.nTasks, tiles);
+    
+    for (unsigned int i=0; i < tiles.size(); i++)
+      renderTasks.push_back(new RendererTask(scene, this, camera, 
+                                             sampler->GetWindowSampler(tiles[i].x0, tiles[i].x1, tiles[i].y0, tiles[i].y1),
+                                             sample, i, tiles.size(), i, false));
+    
+    if (Config.verbose && tiles.size())
+      cout << " [Task=00] Balanced tiles: [" << tiles.size() << "] estimated cost max/mean = [" 
+           << tiles[0].cost * tiles.size() / max(frameCost.Total(), 1e-30) << "]" << endl;
+  }
+  else
+  {
+    for (int i=0; i < Config.nTasks; i++)
+      renderTasks.push_back(new RendererTask(scene, this, camera, sampler, sample, 
+                                             i, Config.nTasks));
+  }
+
+  // TODO: we are loading from a restart? if so load the taskFinishedArray now and fill it in
+                                             
+  // init tasks and run
+  startTasks(renderTasks);
+  
+  // wait with this thread until workers are done
+  waitUntilAllTasksDone();
+
+  // free tasks when all done
+  for (unsigned int i=0; i < renderTasks.size(); i++)
+    delete renderTasks[i];
+}
+
+// mpiRender=tiles: render the tiles dealt to this task by task 0, one after the other with all
+// threads, asking for the next one while the current renders (task 0 deals to the others meanwhile)
+void Renderer::renderTiles(const Scene *scene, Sample *sample)
+{
+  TileScheduler tiles(sampler->xPixelStart, sampler->xPixelEnd, sampler->yPixelStart, sampler->yPixelEnd);
+  
+  int nLocal = RoundUpPowerOfTwo(TASK_MULT_FACT * numberOfCores());
+  int nRendered = 0;
+  int tile = tiles.Next();
+  
+  while (tile >= 0)
+  {
+    int x0, x1, y0, y1;
+    tiles.Window(tile, &x0, &x1, &y0, &y1);
+    
+    Sampler *tileSampler = sampler->GetWindowSampler(x0, x1, y0, y1);
+    vector<Task *> renderTasks;
+    
+    for (int i=0; i < nLocal; i++)
+      renderTasks.push_back(new RendererTask(scene, this, camera, tileSampler, sample, i, nLocal));
+    
+    startTasks(renderTasks);
+    
+    if (ThisTask == 0) {
+      while (!allTasksDone()) {
+        tiles.Serve(false);
+        usleep(TILE_POLL_USEC);
+      }
+    }
+    
+    int next = tiles.Next();
+    
+    waitUntilAllTasksDone();
+    
+    for (unsigned int i=0; i < renderTasks.size(); i++)
+      delete renderTasks[i];
+    delete tileSampler;
+    
+    nRendered++;
+    tile = next;
+  }
+  
+  // task 0: until every task was told that no tile is left
+  if (ThisTask == 0)
+    while (!tiles.Finished())
+      tiles.Serve(true);
+  
+  if (Config.verbose)
+    cout << "[" << ThisTask << "] Renderer: rendered [" << nRendered << "] of [" << tiles.nTiles 
+         << "] tiles." << endl;
+}
+
+// per thread totals, and for balanceTiles the time taken for the (final) pixel window of a sampler
+void Renderer::RecordTaskTime(const Sampler *s, float time, int nRays, int threadNum) const
+{
+  if (threadNum < (int)threadRays.size()) {
+    threadRays[threadNum] += nRays;
+    threadTime[threadNum] += time;
+  }
+  
+  if (taskTimes.empty() || s->xPixelStart >= s->xPixelEnd || s->yPixelStart >= s->yPixelEnd)
+    return;
+  
+  taskTimes[threadNum].push_back(TileWindow(s->xPixelStart, s->xPixelEnd, s->yPixelStart, s->yPixelEnd, time));
+}
+
+// per thread RendererTask buffers for at least count samples, allocated by the calling worker
+RenderArena *Renderer::Arena(int threadNum, const Sample *sample, int count) const
+{
+  if (!arenas[threadNum])
+    arenas[threadNum] = new RenderArena();
+  
+  arenas[threadNum]->Reserve(sample, count);
+  return arenas[threadNum];
+}
+
+// numaPlacement: rays per second traced by the workers of each NUMA node
+void Renderer::reportNodeThroughput(float seconds) const
+{
+  int nNodes = numaNodes();
+  vector<long long> rays(nNodes, 0);
+  vector<double> busy(nNodes, 0.0);
+  vector<int> threads(nNodes, 0);
+  
+  for (unsigned int i=0; i < threadRays.size(); i++) {
+    int node = numaNodeOfThread(i);
+    rays[node] += threadRays[i];
+    busy[node] += threadTime[i];
+    threads[node]++;
+  }
+  
+  for (int node=0; node < nNodes; node++) {
+    if (!threads[node])
+      continue;
+    
+    cout << " [Task=00] Node [" << node << "]: [" << threads[node] << "] threads, [" << rays[node] << "] rays, ["
+         << rays[node] / max(seconds, 1e-6f) << "] rays/sec, busy [" 
+         << busy[node] / (threads[node] * max(seconds, 1e-6f)) << "]." << endl;
+  }
+  cout << endl;
+}
+
+// timeBudget: out of time during a refinement pass
+bool Renderer::OutOfTime() const
+{
+  return abortablePass && Config.timeBudget > 0.0 && wallClock() - renderStart > Config.timeBudget;
+}
+
+// balanceTiles: estimate the cost map with one timed ray per block
+void Renderer::costPrePass(const Scene *scene, const Sample *sample, TileCostMap &costs)
+{
+  Timer timer;
+  timer.Start();
+  
+  costs.Reset(sampler->xPixelStart, sampler->xPixelEnd, sampler->yPixelStart, sampler->yPixelEnd);
+  
+  CostPrePass prePass(scene, this, camera, sample, costs);
+  parallelFor(costs.ny, prePass, 1);
+  
+  if (Config.verbose)
+    cout << " [Task=00] Cost pre-pass: [" << costs.nx * costs.ny << "] rays in [" 
+         << (float)timer.Time() << "] seconds." << endl;
+}
+
 Spectrum Renderer::Transmittance(const Scene *scene, const Ray &ray, const Sample *sample, RNG &rng) const
 {
   return volumeIntegrator->Transmittance(scene, this, ray, sample, rng);
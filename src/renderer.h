@@ -9,7 +9,64 @@
 #include "ArepoRT.h"
 #include "util.h"
 
-// Renderer
+class RayExchange;
+class FrameWriter;
+
+#define TILE_COST_BLOCK 4 // pixels per side of the cost map blocks (pre-pass at 1/16 resolution)
+
+// TileWindow: pixels [x0,x1) x [y0,y1) with their (estimated) render cost
+struct TileWindow {
+  TileWindow(int xa, int xb, int ya, int yb, double c) : x0(xa), x1(xb), y0(ya), y1(yb), cost(c) { }
+  
+  bool operator<(const TileWindow &t) const { return cost > t.cost; } // most expensive first
+  
+  int x0, x1, y0, y1;
+  double cost;
+};
+
+// TileCostMap (balanceTiles): render time per TILE_COST_BLOCK^2 pixel block of the sampler extent,
+// from task timings or a pre-pass, and its decomposition into tiles of equal cost
+class TileCostMap {
+public:
+  // construction
+  TileCostMap() : xStart(0), xEnd(0), yStart(0), yEnd(0), nx(0), ny(0) { }
+  
+  // methods
+  void Reset(int xs, int xe, int ys, int ye);
+  bool Matches(int xs, int xe, int ys, int ye) const;
+  double Total() const;
+  void AddTime(const TileWindow &w);
+  void MakeTiles(int nTiles, vector<TileWindow> &tiles) const;
+  
+  // data
+  int xStart, xEnd, yStart, yEnd; // pixel extent
+  int nx, ny;                     // number of blocks
+  vector<double> cost;            // [by*nx+bx] seconds
+  
+private:
+  double blockCost(int bx0, int bx1, int by0, int by1) const;
+  void split(int bx0, int bx1, int by0, int by1, int n, vector<TileWindow> &tiles) const;
+};
+
+// RenderArena: sample, ray and radiance buffers of RendererTask::Run for one thread, allocated by
+// the worker on its first task and reused by all later tasks and frames
+struct RenderArena {
+  RenderArena() : samples(NULL), rays(NULL), Ls(NULL), Ts(NULL), rayWeights(NULL), size(0) { }
+  ~RenderArena() { release(); }
+  
+  void Reserve(const Sample *sample, int count);
+  
+  Sample *samples;
+  Ray *rays;
+  Spectrum *Ls, *Ts;
+  float *rayWeights;
+  int size;
+  
+private:
+  void release();
+};
+
+// Renderer: kept for all frames, with the camera replaced per frame (SetCamera)
 class Renderer {
 public:
   // construction
@@ -19,30 +76,70 @@ public:
   // methods
   void Render(const Scene *scene, int frameNum);
   void RasterizeStage(const Scene *scene);
+  void SetCamera(Camera *c);
   
   Spectrum Li(const Scene *scene, const Ray &ray, const Sample *sample, RNG &rng, Spectrum *T = NULL, 
               int *prevEntryCell = NULL, int *prevEntryTetra = NULL, int threadNum = -1) const;
   Spectrum Transmittance(const Scene *scene, const Ray &ray, const Sample *sample, RNG &rng) const;
   
+  // mpiRender=rays
+  Spectrum LiContinue(const Scene *scene, const Ray &ray, const Spectrum &Lv, RNG &rng, Spectrum *T,
+                      int *prevEntryCell, int *prevEntryTetra, int threadNum) const;
+  bool ExportRay(const CameraSample &sample, float weight, const Ray &ray, const Spectrum &L, 
+                 const Spectrum &T, int threadNum) const;
+  
+  void RecordTaskTime(const Sampler *s, float time, int nRays, int threadNum) const;
+  bool OutOfTime() const;
+  RenderArena *Arena(int threadNum, const Sample *sample, int count) const;
+  
   //writeStatusBar(int cur, int total);
   
 private:
+  void costPrePass(const Scene *scene, const Sample *sample, TileCostMap &costs);
+  void renderPass(const Scene *scene, Sample *sample);
+  void renderTiles(const Scene *scene, Sample *sample);
+  void reportNodeThroughput(float seconds) const;
+  
   // data
   Sampler *sampler;
   Camera *camera;
   VolumeIntegrator *volumeIntegrator;
+  Sample *sample;
+  RayExchange *rayExchange; // mpiRender=rays
+  FrameWriter *writer;      // writeQueue
+  
+  mutable vector<RenderArena *> arenas; // [thread]
+  
+  TileCostMap frameCost; // balanceTiles: cost map of the last frame rendered
+  mutable vector< vector<TileWindow> > taskTimes; // [thread] regions rendered and their time
+  mutable vector<long long> threadRays;          // [thread] rays traced this frame
+  mutable vector<double> threadTime;             // [thread] seconds spent in render tasks
+  
+  double renderStart;  // wall clock (timeBudget)
+  bool abortablePass;  // progressive: this pass may be cut short by timeBudget
 };
 
 // RendererTask
 class RendererTask : public Task {
 public:
   // construction
-  RendererTask(const Scene *sc, Renderer *ren, Camera *c, Sampler *ms, Sample *sam, int tn, int tc)
+  RendererTask(const Scene *sc, const Renderer *ren, Camera *c, Sampler *ms, Sample *sam, int tn, int tc)
   {
     IF_DEBUG(cout << "RendererTask(" << tn << ", " << tc << ") constructor." << endl);
 
     scene = sc; renderer = ren; camera = c; mainSampler = ms;
     origSample = sam; taskNum = tn; taskCount = tc;
+    subSampler = NULL; seed = tn; split = false;
+  }
+  // render with the given sub-sampler (taken over), a tile or split off part of a running task
+  RendererTask(const Scene *sc, const Renderer *ren, Camera *c, Sampler *sub, Sample *sam, int tn, int tc,
+               uint32_t sd, bool sp)
+  {
+    IF_DEBUG(cout << "RendererTask(" << tn << ", " << tc << ", " << sd << ", " << sp << ") constructor." << endl);
+
+    scene = sc; renderer = ren; camera = c; mainSampler = NULL;
+    origSample = sam; taskNum = tn; taskCount = tc;
+    subSampler = sub; seed = sd; split = sp;
   }
   void Run(int threadNum);
   
@@ -53,7 +150,10 @@ private:
   Camera *camera;
   Sampler *mainSampler;
   Sample *origSample;
+  Sampler *subSampler;
   int taskNum, taskCount;
+  uint32_t seed;
+  bool split;
 };
 
 #endif
@@ -119,6 +119,10 @@ StratifiedSampler::StratifiedSampler(int xstart, int xend, int ystart, int yend,
   jitterSamples = jitter;
   xPos = xPixelStart;
   yPos = yPixelStart;
+  pixelStride = 1;
+  xOrigin = xPixelStart;
+  yOrigin = yPixelStart;
+  refinePass = false;
   xPixelSamples = xs;
   yPixelSamples = ys;
   sampleBuf = new float[5 * xPixelSamples * yPixelSamples];
@@ -138,16 +142,74 @@ Sampler *StratifiedSampler::GetSubSampler(int num, int count)
   IF_DEBUG(cout << "StratifiedSampler:GetSubSampler(" << num << "," << count << ") x0 = " << x0 << " x1 = " << x1
                 << " y0 = " << y0 << " y1 = " << y1 << endl);
   
-  if (x0 == x1 || y0 == y1)
+  return GetWindowSampler(x0, x1, y0, y1);
+}
+
+// sampler for the pixels [xstart,xend) x [ystart,yend), NULL if empty
+Sampler *StratifiedSampler::GetWindowSampler(int xstart, int xend, int ystart, int yend)
+{
+  if (xstart >= xend || ystart >= yend)
     return NULL;
   
-  return new StratifiedSampler(x0, x1, y0, y1, xPixelSamples,
-                               yPixelSamples, jitterSamples, shutterOpen, shutterClose);
+  StratifiedSampler *sub = new StratifiedSampler(xstart, xend, ystart, yend, xPixelSamples,
+                                                 yPixelSamples, jitterSamples, shutterOpen, shutterClose);
+  
+  sub->pixelStride = pixelStride;
+  sub->xOrigin = xOrigin;
+  sub->yOrigin = yOrigin;
+  sub->refinePass = refinePass;
+  
+  return sub;
+}
+
+// progressive rendering: samplers created from now on (and this one) only visit the pixels of a pass
+void StratifiedSampler::SetPixelStride(int stride, bool refine)
+{
+  pixelStride = max(stride, 1);
+  refinePass = refine;
+}
+
+bool StratifiedSampler::inPass(int x, int y) const
+{
+  int dx = x - xOrigin, dy = y - yOrigin;
+  
+  if (dx % pixelStride || dy % pixelStride)
+    return false;
+    
+  return !(refinePass && dx % (2*pixelStride) == 0 && dy % (2*pixelStride) == 0);
 }
 
 
+// hand the second half of the rows not yet started to a new sampler
+Sampler *StratifiedSampler::Split()
+{
+  int y0 = (xPos == xPixelStart) ? yPos : yPos + 1;
+  int nRows = yPixelEnd - y0;
+  
+  if (nRows < TASK_SPLIT_MIN_ROWS)
+    return NULL;
+  
+  int yMid = y0 + nRows / 2;
+  
+  IF_DEBUG(cout << "StratifiedSampler:Split() y0 = " << y0 << " yMid = " << yMid 
+                << " yPixelEnd = " << yPixelEnd << endl);
+  
+  Sampler *rest = GetWindowSampler(xPixelStart, xPixelEnd, yMid, yPixelEnd);
+  yPixelEnd = yMid;
+  
+  return rest;
+}
+
 int StratifiedSampler::GetMoreSamples(Sample *samples, RNG &rng)
 {
+  // progressive pass: skip to the next pixel of this pass
+  while (yPos < yPixelEnd && !inPass(xPos, yPos)) {
+    if (++xPos == xPixelEnd) {
+      xPos = xPixelStart;
+      ++yPos;
+    }
+  }
+  
   if (yPos == yPixelEnd) return 0;
   int nSamples = xPixelSamples * yPixelSamples;
   // Generate stratified camera samples for _(xPos, yPos)_
@@ -18,10 +18,14 @@ public:
   virtual int MaximumSampleCount() = 0;
   virtual bool ReportResults(Sample *samples, const Ray *rays, const Spectrum *Ls, int count);
   virtual Sampler *GetSubSampler(int num, int count) = 0;
+  virtual Sampler *GetWindowSampler(int xstart, int xend, int ystart, int yend) = 0;
+  virtual Sampler *Split() { return NULL; }
+  virtual void SetPixelStride(int stride, bool refine) = 0;
   virtual int RoundSize(int size) const = 0;
 
   // data
-  const int xPixelStart, xPixelEnd, yPixelStart, yPixelEnd;
+  const int xPixelStart, xPixelEnd, yPixelStart;
+  int yPixelEnd; // reduced by Split()
   const int samplesPerPixel;
   const float shutterOpen, shutterClose;
 protected:
@@ -73,14 +77,24 @@ public:
   // methods
   int RoundSize(int size) const { return size; }
   Sampler *GetSubSampler(int num, int count);
+  Sampler *GetWindowSampler(int xstart, int xend, int ystart, int yend);
+  Sampler *Split();
+  void SetPixelStride(int stride, bool refine);
   int GetMoreSamples(Sample *sample, RNG &rng);
   int MaximumSampleCount() { return xPixelSamples * yPixelSamples; }
 private:
+  bool inPass(int x, int y) const;
+  
   // data
   int xPixelSamples, yPixelSamples;
   bool jitterSamples;
   int xPos, yPos;
   float *sampleBuf;
+  
+  // progressive passes: only pixels on the grid of this stride (relative to the origin), without
+  // those of the previous pass (twice the stride) if refining
+  int pixelStride, xOrigin, yOrigin;
+  bool refinePass;
 };
 
 StratifiedSampler *CreateStratifiedSampler(const Film *film, const Camera *camera);
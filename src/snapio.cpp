@@ -10,6 +10,7 @@
 #include "geometry.h"
 #include "transform.h"
 #include "camera.h" 
+#include "distributed.h"
 
 void ArepoSnapshot::read_ic()
 {
@@ -404,9 +405,74 @@ void ArepoSnapshot::loadAllChunksNoMask(vector<string> snapFilenames)
   if( Config.verbose )
     cout << "Reading total of [" << partCountsTot << "] particles across all files." << endl;
   
+  // mpiRender=rays: each task loads every NTask-th file, the domain decomposition in init() then 
+  // distributes the particles over the tasks (a snapshot in a single file is loaded by task 0)
+  bool distributed = (Config.mpiRender == "rays" && NTask > 1);
+  unsigned long long partCountsLocal = partCountsTot;
+  
+  if( distributed )
+  {
+    partCountsLocal = 0;
+    
+    for( i=ThisTask; i < snapFilenames.size(); i += NTask )
+    {
+      vector<unsigned long long> numPartByType;
+      readGroupAttribute( snapFilenames[i], "Header", "NumPart_ThisFile", numPartByType );
+      partCountsLocal += numPartByType[Config.readPartType];
+    }
+    
+    if( Config.verbose )
+      cout << "[" << ThisTask << "] Reading [" << partCountsLocal << "] particles from every [" 
+           << NTask << "]th file." << endl;
+  }
+  
+  // mpiRender=composite: each task keeps the particles of its slab (padded), counted from the 
+  // coordinates along the slab axis, all files are read and the others dropped after each file
+  bool slab = (Config.mpiRender == "composite" && NTask > 1);
+  int slabAxis = compositeAxis();
+  unsigned long long maxPartFile = 0;
+  
+  if( slab )
+  {
+    vector<MyDouble> slabPos;
+    partCountsLocal = 0;
+    
+    for( unsigned int f=0; f < snapFilenames.size(); f++ )
+    {
+      vector<unsigned long long> numPartByType;
+      readGroupAttribute( snapFilenames[f], "Header", "NumPart_ThisFile", numPartByType );
+      
+      if( !numPartByType[Config.readPartType] )
+        continue;
+      
+      maxPartFile = max(maxPartFile, numPartByType[Config.readPartType]);
+      
+      readGroupDataset( snapFilenames[f], "PartType" + toStr(Config.readPartType), "Coordinates", slabAxis, slabPos );
+      recenterBoxCoords( slabPos, slabAxis );
+      
+      for( j=0; j < slabPos.size(); j++ )
+        if( insideSlab(slabPos[j], Config.maskPadFac) )
+          partCountsLocal++;
+    }
+    
+    if( Config.verbose )
+      cout << "[" << ThisTask << "] Reading [" << partCountsLocal << "] particles of slab [" << ThisTask 
+           << "] along axis [" << slabAxis << "]." << endl;
+  }
+  
   // allocate (P/SphP)
-  All.MaxPart = partCountsTot / (1.0 - 1 * ALLOC_TOLERANCE);
-  All.MaxPartSph = partCountsTot / (1.0 - 1 * ALLOC_TOLERANCE);
+  if( slab ) {
+    // room for the slab and for the whole of the largest file before it is cut
+    All.MaxPart = (partCountsLocal + maxPartFile) / (1.0 - 1 * ALLOC_TOLERANCE);
+    All.MaxPartSph = All.MaxPart;
+  } else if( distributed ) {
+    // room for the initial load and for an even share after the domain decomposition
+    All.MaxPart = max(partCountsLocal, partCountsTot / NTask) / (1.0 - 2 * ALLOC_TOLERANCE);
+    All.MaxPartSph = All.MaxPart;
+  } else {
+    All.MaxPart = partCountsTot / (1.0 - 1 * ALLOC_TOLERANCE);
+    All.MaxPartSph = partCountsTot / (1.0 - 1 * ALLOC_TOLERANCE);
+  }
   
   //if( Config.readPartType != PARTTYPE_GAS )
   //  All.MaxPartSph = 0; // don't allocate SphP
@@ -447,6 +513,10 @@ void ArepoSnapshot::loadAllChunksNoMask(vector<string> snapFilenames)
   // loop over each chunk
   for( i=0; i < snapFilenames.size(); i++ )
   {
+    // mpiRender=rays: file loaded by another task
+    if( distributed && (int)(i % NTask) != ThisTask )
+      continue;
+    
     // load header of this file, get particle count
     vector<unsigned long long> numPartByType;
     unsigned int partCounts = 0;    
@@ -663,6 +733,24 @@ void ArepoSnapshot::loadAllChunksNoMask(vector<string> snapFilenames)
 
 
     } // readPartType==1
+    
+    // mpiRender=composite: keep the particles of this file inside the (padded) slab
+    if( slab )
+    {
+      unsigned int kept = 0;
+      
+      for( j=0; j < partCounts; j++ )
+      {
+        if( !insideSlab(P[offset + j].Pos[slabAxis], Config.maskPadFac) )
+          continue;
+        
+        P[offset + kept] = P[offset + j];
+        SphP[offset + kept] = SphP[offset + j];
+        kept++;
+      }
+      
+      partCounts = kept;
+    }
 
     // increment global snapshot offset as we move to next chunk
     offset += partCounts;
@@ -680,11 +768,11 @@ void ArepoSnapshot::loadAllChunksNoMask(vector<string> snapFilenames)
   //for(i = 0; i < NTYPES; i++)
   //  All.MassTable[i] = header.mass[i];
   
-  NumPart = partCountsTot;
-  NumGas = partCountsTot;
+  NumPart = partCountsLocal;
+  NumGas = partCountsLocal;
   
   // verify our total particle counts equal partCountsTot[curJobNum]
-  if( offset != partCountsTot ) {
+  if( offset != partCountsLocal ) {
     cout << "Error: Failed to read the expected number of particles." << endl;
     exit(1192);
   }
@@ -0,0 +1,196 @@
+/*
+ * splat.cpp
+ * dnelson
+ */
+
+#include "transform.h"
+#include "util.h"
+#include "camera.h"
+#include "arepo.h"
+#include "splat.h"
+
+// project all particles, bin each to the tiles its footprint overlaps
+struct SplatProjector {
+  SplatProjector(SplatRenderer &s) : sr(s) { }
+
+  void operator()(int i0, int i1, int threadNum) {
+    vector< vector<int> > &bins = sr.bins[threadNum];
+
+    for( int i = i0; i < i1; i++ ) {
+      Point pr;
+      float hr;
+
+      sr.rh[i] = 0.0f;
+
+      if( sr.hsml[i] <= 0.0f )
+        continue;
+      if( !sr.camera->ProjectSphere(Point(P[i].Pos[0], P[i].Pos[1], P[i].Pos[2]), sr.hsml[i], &pr, &hr) )
+        continue;
+      if( hr <= 0.0f )
+        continue;
+
+      sr.rx[i] = pr.x;
+      sr.ry[i] = pr.y;
+      sr.rw[i] = sr.hsml[i] / hr;
+      sr.rh[i] = max(hr, SPLAT_MIN_HPIX);
+
+      // overlapped tiles (pixel x has its center at x+0.5)
+      int tx0 = (int)floorf(pr.x - sr.rh[i] - 0.5f - sr.xStart) / SPLAT_TILESIZE;
+      int tx1 = (int)floorf(pr.x + sr.rh[i] - 0.5f - sr.xStart) / SPLAT_TILESIZE;
+      int ty0 = (int)floorf(pr.y - sr.rh[i] - 0.5f - sr.yStart) / SPLAT_TILESIZE;
+      int ty1 = (int)floorf(pr.y + sr.rh[i] - 0.5f - sr.yStart) / SPLAT_TILESIZE;
+
+      if( pr.x + sr.rh[i] < sr.xStart || pr.x - sr.rh[i] > sr.xStart + sr.xCount ||
+          pr.y + sr.rh[i] < sr.yStart || pr.y - sr.rh[i] > sr.yStart + sr.yCount ) {
+        sr.rh[i] = 0.0f;
+        continue;
+      }
+
+      tx0 = max(tx0, 0); tx1 = min(tx1, sr.nTilesX-1);
+      ty0 = max(ty0, 0); ty1 = min(ty1, sr.nTilesY-1);
+
+      for( int ty = ty0; ty <= ty1; ty++ )
+        for( int tx = tx0; tx <= tx1; tx++ )
+          bins[ty * sr.nTilesX + tx].push_back(i);
+    }
+  }
+
+  SplatRenderer &sr;
+};
+
+// accumulate all particles binned to a tile, write the tile to the Film
+struct SplatTileRasterizer {
+  SplatTileRasterizer(SplatRenderer &s) : sr(s) { }
+
+  void operator()(int t0, int t1, int threadNum) {
+    vector<double> &buf = sr.tileBuf[threadNum];
+    vector<float> vals(TF_NUM_VALS);
+    double coeff[TF_NUM_VALS];
+
+    for( int t = t0; t < t1; t++ ) {
+      int x0 = sr.xStart + (t % sr.nTilesX) * SPLAT_TILESIZE;
+      int y0 = sr.yStart + (t / sr.nTilesX) * SPLAT_TILESIZE;
+      int x1 = min(x0 + SPLAT_TILESIZE, sr.xStart + sr.xCount);
+      int y1 = min(y0 + SPLAT_TILESIZE, sr.yStart + sr.yCount);
+
+      fill( buf.begin(), buf.end(), 0.0 );
+
+      for( unsigned int th = 0; th < sr.bins.size(); th++ ) {
+        const vector<int> &list = sr.bins[th][t];
+
+        for( unsigned int j = 0; j < list.size(); j++ ) {
+          int p = list[j];
+          float px = sr.rx[p], py = sr.ry[p], hr = sr.rh[p];
+          float hr2inv = 1.0f / (hr * hr);
+          float norm = 1.0f;
+
+          // small footprints: normalize the sum over pixel centers to the continuous one (hr^2)
+          if( hr < SPLAT_NORM_HPIX ) {
+            float sum = 0.0f;
+
+            for( int y = (int)ceilf(py - hr - 0.5f); y <= (int)floorf(py + hr - 0.5f); y++ ) {
+              float dy = y + 0.5f - py;
+              for( int x = (int)ceilf(px - hr - 0.5f); x <= (int)floorf(px + hr - 0.5f); x++ ) {
+                float dx = x + 0.5f - px;
+                sum += sr.kernel.full( (dx*dx + dy*dy) * hr2inv );
+              }
+            }
+
+            if( sum <= 0.0f )
+              continue;
+
+            norm = hr * hr / sum;
+          }
+
+          // raw integrals of this particle per unit projected kernel, as for a ray through it
+          if( SphP[p].Density <= 0.0 )
+            continue;
+
+          float hw = hr * sr.rw[p]; // (smoothed) support in world units
+          fill( vals.begin(), vals.end(), 0.0f );
+          for( int k = 0; k < TF_NUM_VALS; k++ )
+            coeff[k] = 0.0;
+
+          addValsContribution( vals, p, 1.0 );
+          addRawIntegrals( coeff, vals, P[p].Mass / SphP[p].Density / (hw * hw) * norm );
+
+          // footprint within this tile
+          int fx0 = max((int)ceilf(px - hr - 0.5f), x0), fx1 = min((int)floorf(px + hr - 0.5f), x1-1);
+          int fy0 = max((int)ceilf(py - hr - 0.5f), y0), fy1 = min((int)floorf(py + hr - 0.5f), y1-1);
+
+          for( int y = fy0; y <= fy1; y++ ) {
+            float dy = y + 0.5f - py;
+            double *row = &buf[ (y - y0) * SPLAT_TILESIZE * TF_NUM_VALS ];
+
+            for( int x = fx0; x <= fx1; x++ ) {
+              float dx = x + 0.5f - px;
+              float w = sr.kernel.full( (dx*dx + dy*dy) * hr2inv );
+
+              if( w <= 0.0f )
+                continue;
+
+              double *pix = &row[ (x - x0) * TF_NUM_VALS ];
+              for( int k = 0; k < TF_NUM_VALS; k++ )
+                pix[k] += coeff[k] * w;
+            }
+          }
+        }
+      }
+
+      // write out (every pixel of the film is covered by exactly one tile)
+      for( int y = y0; y < y1; y++ )
+        for( int x = x0; x < x1; x++ )
+          sr.camera->film->SetRawPixel(x, y, &buf[ ((y - y0) * SPLAT_TILESIZE + (x - x0)) * TF_NUM_VALS ]);
+    }
+  }
+
+  SplatRenderer &sr;
+};
+
+SplatRenderer::SplatRenderer(Camera *c)
+{
+  IF_DEBUG(cout << "SplatRenderer() constructor." << endl);
+
+  camera = c;
+
+  int xEnd, yEnd;
+  camera->film->GetPixelExtent(&xStart, &xEnd, &yStart, &yEnd);
+  xCount = xEnd - xStart;
+  yCount = yEnd - yStart;
+
+  nTilesX = (xCount + SPLAT_TILESIZE - 1) / SPLAT_TILESIZE;
+  nTilesY = (yCount + SPLAT_TILESIZE - 1) / SPLAT_TILESIZE;
+}
+
+void SplatRenderer::Render()
+{
+  Timer timer;
+  timer.Start();
+
+  int nThreads = numberOfCores();
+  int nTiles = nTilesX * nTilesY;
+
+  // smoothing lengths: nTreeNGB neighbors at the particle density (as tree mode projections)
+  particleHsml(hsml, Config.nTreeNGB ? Config.nTreeNGB : SPLAT_DEFAULT_NGB);
+
+  rx.resize(NumGas);
+  ry.resize(NumGas);
+  rh.resize(NumGas);
+  rw.resize(NumGas);
+
+  bins.assign(nThreads, vector< vector<int> >(nTiles));
+  tileBuf.assign(nThreads, vector<double>(SPLAT_TILESIZE * SPLAT_TILESIZE * TF_NUM_VALS));
+
+  SplatProjector projector(*this);
+  parallelFor(NumGas, projector);
+
+  float timeProject = (float)timer.Time();
+
+  SplatTileRasterizer rasterizer(*this);
+  parallelFor(nTiles, rasterizer, 1);
+
+  if (Config.verbose)
+    cout << "[" << ThisTask << "] SplatRenderer: [" << NumGas << "] particles, [" << nTiles << "] tiles, "
+         << "projection [" << timeProject << "] rasterization [" << (float)timer.Time() - timeProject
+         << "] seconds." << endl;
+}
@@ -0,0 +1,46 @@
+/*
+ * splat.h
+ * dnelson
+ */
+
+#ifndef AREPO_RT_SPLAT_H
+#define AREPO_RT_SPLAT_H
+
+#include "kernels.h"
+
+#define SPLAT_TILESIZE  64    // pixels per side of the image tiles particles are binned to
+#define SPLAT_MIN_HPIX  1.0f  // smallest footprint radius (pixels), smaller particles are smoothed
+#define SPLAT_NORM_HPIX 4.0f  // footprints smaller than this (pixels) are normalized to conserve mass
+#define SPLAT_DEFAULT_NGB 32  // hsml encloses this many neighbors if nTreeNGB is not set
+
+/* SplatRenderer: projections (projColDens) without rays. the footprint of each particle, its
+ * kernel integrated along the line of sight (ProjectedKernel) at the projected raster position and
+ * radius, is rasterised directly into the raw integrals of the Film. particles are projected and
+ * binned to image tiles in parallel (per thread bins), then each tile is accumulated in a per
+ * thread buffer and written to the Film once. cost O(N_particles + covered pixels)
+ */
+class SplatRenderer {
+public:
+  // construction
+  SplatRenderer(Camera *c);
+
+  // methods
+  void Render();
+
+  // data
+  Camera *camera;
+  ProjectedKernel<SphKernel> kernel;
+
+  int xStart, yStart, xCount, yCount; // film pixel extent (raster space)
+  int nTilesX, nTilesY;
+
+  // projected particles (SoA): raster position, footprint radius (pixels, 0 if not visible),
+  // world length per pixel at the particle
+  vector<float> rx, ry, rh, rw;
+  vector<float> hsml;
+
+  vector< vector< vector<int> > > bins; // [thread][tile] particle indices
+  vector< vector<double> > tileBuf;     // [thread] SPLAT_TILESIZE^2 x TF_NUM_VALS
+};
+
+#endif //AREPO_RT_SPLAT_H
@@ -5,8 +5,9 @@
  
 #include "util.h"
 
-#include <fcntl.h>
 #include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
 
 // Timer
 Timer::Timer()
@@ -165,13 +166,118 @@ struct thread_info {
   int thread_num;
 };
 
+/* TaskDeque: per worker double ended queue (Chase and Lev 2005). the owning worker pushes and pops
+ * at the bottom (LIFO), idle workers steal from the top (FIFO) without locks, racing only for the
+ * last entry (CAS on top). the buffer grows by doubling, retired buffers are freed by Reset()
+ */
+struct TaskBuffer {
+  TaskBuffer(int32_t n, TaskBuffer *p) : size(n), prev(p) { tasks = new Task*[n]; }
+  ~TaskBuffer() { delete[] tasks; }
+
+  Task *get(int32_t i) const { return tasks[i & (size-1)]; }
+  void put(int32_t i, Task *t) { tasks[i & (size-1)] = t; }
+
+  Task **tasks;
+  int32_t size;     // power of two
+  TaskBuffer *prev; // retired (may still be read by a thief until the batch ends)
+};
+
+class TaskDeque
+{
+public:
+  TaskDeque() : top(0), bottom(0) { buf = new TaskBuffer(64, NULL); }
+  ~TaskDeque() { Reset(); delete buf; }
+
+  // owner only (or startTasks() while the owner is parked)
+  void Push(Task *task) {
+    int32_t b = bottom, t = top;
+    TaskBuffer *a = buf;
+    
+    if (b - t >= a->size - 1) {
+      a = new TaskBuffer(2 * a->size, a);
+      for (int32_t i = t; i < b; i++)
+        a->put(i, buf->get(i));
+      buf = a;
+    }
+    
+    a->put(b, task);
+    __sync_synchronize();
+    bottom = b + 1;
+  }
+
+  Task *Pop() {
+    int32_t b = bottom - 1;
+    TaskBuffer *a = buf;
+    bottom = b;
+    __sync_synchronize();
+    int32_t t = top;
+    
+    if (t > b) {
+      bottom = b + 1; // empty
+      return NULL;
+    }
+    
+    Task *task = a->get(b);
+    
+    // last entry: race against thieves
+    if (t == b) {
+      if (AtomicCompareAndSwap(&top, t + 1, t) != t)
+        task = NULL;
+      bottom = b + 1;
+    }
+    
+    return task;
+  }
+
+  // any thread
+  Task *Steal() {
+    int32_t t = top;
+    __sync_synchronize();
+    int32_t b = bottom;
+    
+    if (t >= b)
+      return NULL;
+    
+    Task *task = buf->get(t);
+    
+    if (AtomicCompareAndSwap(&top, t + 1, t) != t)
+      return NULL; // lost the race
+    
+    return task;
+  }
+
+  bool Empty() const { return top >= bottom; }
+
+  // only while all workers are parked
+  void Reset() {
+    while (buf->prev) {
+      TaskBuffer *p = buf->prev;
+      buf->prev = p->prev;
+      delete p;
+    }
+    top = bottom = 0;
+  }
+
+private:
+  volatile int32_t top, bottom;
+  TaskBuffer * volatile buf;
+};
+
+// task pool: workers park on workerCondition between batches, numActiveWorkers drops to zero once
+// a batch is done (each worker leaves its loop only when no task is unfinished)
 static pthread_t *threads;
-static Mutex *taskQueueMutex = Mutex::Create();
-static std::vector<Task *> taskQueue;
-static Semaphore *workerSemaphore;
-static uint32_t numUnfinishedTasks;
+static TaskDeque *taskDeques;
+static volatile int32_t numUnfinishedTasks;
+static volatile int32_t numIdleWorkers;
+static int numActiveWorkers;
+static int taskBatch;
+static bool tasksShutdown;
+static vector<Task *> spawnedTasks;
+static Mutex *spawnedTasksMutex = Mutex::Create();
+static ConditionVariable *workerCondition;
 static ConditionVariable *tasksRunningCondition;
 static void *taskEntryPoint(void *arg);
+static void pinWorker(int threadNum);
 static struct thread_info *tinfo;
 
 // Mutex
@@ -213,42 +319,6 @@ MutexLock::~MutexLock()
     terminate("ERROR: pthread_mutex_unlock.");
 }
 
-// Semaphore
-Semaphore::Semaphore()
-{
-  char name[32];
-  sprintf(name, "areport.%d-%d", (int)getpid(), count++);
-  sem = sem_open(name, O_CREAT, S_IRUSR|S_IWUSR, 0);
-  if (!sem)
-    terminate("ERROR: sem_open");
-}
-
-int Semaphore::count = 0;
-
-Semaphore::~Semaphore()
-{
-  if (sem_close(sem))
-    terminate("ERROR: sem_close.");
-}
-
-void Semaphore::Wait()
-{
-  if (sem_wait(sem))
-    terminate("ERROR: sem_wait.");
-}
-
-bool Semaphore::TryWait()
-{
-  return (sem_trywait(sem) == 0);
-}
-
-void Semaphore::Post(int count)
-{
-  while (count-- > 0)
-    if (sem_post(sem))
-      terminate("ERROR: sem_post.");
-}
-
 // ConditionVariable
 ConditionVariable::ConditionVariable()
 {
@@ -286,43 +356,90 @@ void ConditionVariable::Signal()
     terminate("ERROR: cv_signal: %d", err);
 }
 
+void ConditionVariable::Broadcast()
+{
+  int err;
+  if ((err = pthread_cond_broadcast(&cond)) != 0)
+    terminate("ERROR: cv_broadcast: %d", err);
+}
+
 void ConditionVariable::Unlock() {
   int err;
   if ((err = pthread_mutex_unlock(&mutex)) != 0)
     terminate("ERROR: cv_unlock: %d", err);
 }
 
+// run own tasks, then steal (victims in turn starting after this worker), until the batch is done
+static void runTaskBatch(int threadNum, int nThreads)
+{
+  TaskDeque &own = taskDeques[threadNum];
+  int victim = threadNum;
+  bool idle = false;
+  
+  while (numUnfinishedTasks > 0)
+  {
+    Task *myTask = own.Pop();
+    
+    for (int i = 0; i < nThreads - 1 && !myTask; i++) {
+      victim = (victim + 1) % nThreads;
+      if (victim != threadNum)
+        myTask = taskDeques[victim].Steal();
+    }
+    
+    if (!myTask) {
+      // nothing left to take: wait for a running task to split, or for the batch to finish
+      if (!idle) {
+        AtomicAdd(&numIdleWorkers, 1);
+        idle = true;
+      }
+      sched_yield();
+      continue;
+    }
+    
+    if (idle) {
+      AtomicAdd(&numIdleWorkers, -1);
+      idle = false;
+    }
+    
+    // run acquired task
+    myTask->Run(threadNum);
+    AtomicAdd(&numUnfinishedTasks, -1);
+  }
+  
+  if (idle)
+    AtomicAdd(&numIdleWorkers, -1);
+}
+
 // thread entry point
 static void *taskEntryPoint(void *arg)
 {
   IF_DEBUG(cout << "taskEntyPoint()" << endl);
   struct thread_info *data = (struct thread_info*)arg;
   
+  static const int nThreads = numberOfCores();
+  int batch = 0;
+  
+  if (Config.numaPlacement != "none")
+    pinWorker(data->thread_num);
+  
   while (true)
   {
-    workerSemaphore->Wait();
-    
-    // get task from task queue
-    Task *myTask = NULL;
-    { MutexLock lock(*taskQueueMutex);
+    // park until the next batch (or shutdown)
+    workerCondition->Lock();
+    while (batch == taskBatch && !tasksShutdown)
+      workerCondition->Wait();
+    batch = taskBatch;
+    bool shutdown = tasksShutdown;
+    workerCondition->Unlock();
     
-    if (taskQueue.size() == 0)
+    if (shutdown)
       break;
-        
-    myTask = taskQueue.back();
-    taskQueue.pop_back();
-    }
     
-    //cout << "Thread [" << data->thread_num << "] Acquired Task, Running." << endl;
-
-    // run acquired rendererTask
-    myTask->Run(data->thread_num);
-    tasksRunningCondition->Lock();
+    runTaskBatch(data->thread_num, nThreads);
     
-    int unfinished = --numUnfinishedTasks;
-    if (unfinished == 0)
+    tasksRunningCondition->Lock();
+    if (--numActiveWorkers == 0)
       tasksRunningCondition->Signal();
-        
     tasksRunningCondition->Unlock();
   }
   
@@ -345,20 +462,42 @@ void startTasks(const vector<Task *> &tasks)
   // init
   if (!threads)
     TasksInit();
-      
-  // update taskQueue
-  { MutexLock lock(*taskQueueMutex);
-  for (unsigned int i = 0; i < tasks.size(); ++i)
-    taskQueue.push_back(tasks[i]);
+  
+  static const int nThreads = numberOfCores();
+  
+  // workers are parked (previous batch waited for), so the deques may be filled from here: deal
+  // the tasks round robin, each deque in reverse such that its owner runs them in the given order
+  tasksRunningCondition->Lock();
+  if (numActiveWorkers)
+    terminate("startTasks() while a previous batch is still running.");
+  tasksRunningCondition->Unlock();
+  
+  if (tasks.empty())
+    return;
+  
+  for (int i = 0; i < nThreads; i++) {
+    taskDeques[i].Reset();
+    
+    if (i >= (int)tasks.size())
+      continue;
+    
+    int last = i + ((int)tasks.size() - 1 - i) / nThreads * nThreads;
+    for (int j = last; j >= i; j -= nThreads)
+      taskDeques[i].Push(tasks[j]);
   }
   
-  // update running flag
+  numUnfinishedTasks = tasks.size();
+  __sync_synchronize();
+  
+  // wake workers
   tasksRunningCondition->Lock();
-  numUnfinishedTasks += tasks.size();
+  numActiveWorkers = nThreads;
   tasksRunningCondition->Unlock();
-
-  // update counter
-  workerSemaphore->Post(tasks.size());
+  
+  workerCondition->Lock();
+  taskBatch++;
+  workerCondition->Broadcast();
+  workerCondition->Unlock();
 }
 
 void waitUntilAllTasksDone()
@@ -371,11 +510,56 @@ void waitUntilAllTasksDone()
   if (!tasksRunningCondition)
     return;
       
-  // update running flag
+  // wait for all workers to park
   tasksRunningCondition->Lock();
-  while (numUnfinishedTasks > 0)
+  while (numActiveWorkers > 0)
     tasksRunningCondition->Wait();
   tasksRunningCondition->Unlock();
+  
+  // tasks split off during the batch are owned by the pool
+  { MutexLock lock(*spawnedTasksMutex);
+  for (unsigned int i = 0; i < spawnedTasks.size(); i++)
+    delete spawnedTasks[i];
+  spawnedTasks.clear();
+  }
+}
+
+// true once all workers are parked (without waiting, call waitUntilAllTasksDone() afterwards)
+bool allTasksDone()
+{
+  if (Config.nCores == 1 || !tasksRunningCondition)
+    return true;
+  
+  tasksRunningCondition->Lock();
+  bool done = (numActiveWorkers == 0);
+  tasksRunningCondition->Unlock();
+  
+  return done;
+}
+
+// true if some worker is idle and nothing queued on this worker remains to be stolen
+bool shouldSplitTask(int threadNum)
+{
+  if (Config.nCores == 1 || !taskDeques)
+    return false;
+  
+  return numIdleWorkers > 0 && taskDeques[threadNum].Empty();
+}
+
+// from a running task on worker threadNum: queue a new task (owned by the pool) on this worker
+void spawnTask(Task *task, int threadNum)
+{
+  { MutexLock lock(*spawnedTasksMutex);
+  spawnedTasks.push_back(task);
+  }
+  
+  if (Config.nCores == 1 || !taskDeques) {
+    task->Run(threadNum);
+    return;
+  }
+  
+  AtomicAdd(&numUnfinishedTasks, 1);
+  taskDeques[threadNum].Push(task);
 }
 
 Task::~Task() {
@@ -386,10 +570,17 @@ void TasksInit()
   if (Config.nCores == 1)
     return;
 
-  // setup semaphore and check
+  // setup deques and conditions (and read the topology before the workers use it)
   static const int nThreads = numberOfCores();
-  workerSemaphore = new Semaphore;
-  tasksRunningCondition = new ConditionVariable;        
+  numaNodes();
+  
+  taskDeques = new TaskDeque[nThreads];
+  workerCondition = new ConditionVariable;
+  tasksRunningCondition = new ConditionVariable;
+  
+  numUnfinishedTasks = numIdleWorkers = 0;
+  numActiveWorkers = taskBatch = 0;
+  tasksShutdown = false;
 
   // create threads
   tinfo = (struct thread_info *)calloc(nThreads, sizeof(struct thread_info));
@@ -411,32 +602,36 @@ void TasksCleanup()
   if (Config.nCores == 1)
     return;
       
-  if (!taskQueueMutex || !workerSemaphore)
+  if (!threads)
     return;
       
-  // verify task queue is empty
-  { MutexLock lock(*taskQueueMutex);
-  if(taskQueue.size() != 0)
-    terminate("TasksCleanup but have remaining taskQueue.size > 0");
-  }
+  // verify all tasks are done
+  if (numUnfinishedTasks != 0)
+    terminate("TasksCleanup but have [%d] unfinished tasks.", (int)numUnfinishedTasks);
 
-  // increment worker counter
+  // release parked workers
   static const int nThreads = numberOfCores();
   
-  if (workerSemaphore != NULL)
-    workerSemaphore->Post(nThreads);
+  workerCondition->Lock();
+  tasksShutdown = true;
+  workerCondition->Broadcast();
+  workerCondition->Unlock();
 
   // close handles and delete threads
-  if (threads != NULL) {
-    for (int i = 0; i < nThreads; ++i) {
-      IF_DEBUG(cout << "TasksCleanup:: Joining thread [" << i << "]" << endl);
-      int err = pthread_join(threads[i], NULL);
-      if (err != 0)
-        terminate("ERROR: tasks_cleanup pthread_join: %d", err);
-    }
-    delete[] threads;
-    threads = NULL;
+  for (int i = 0; i < nThreads; ++i) {
+    IF_DEBUG(cout << "TasksCleanup:: Joining thread [" << i << "]" << endl);
+    int err = pthread_join(threads[i], NULL);
+    if (err != 0)
+      terminate("ERROR: tasks_cleanup pthread_join: %d", err);
   }
+  delete[] threads;
+  threads = NULL;
+  
+  delete[] taskDeques;
+  taskDeques = NULL;
+  delete workerCondition;
+  delete tasksRunningCondition;
+  workerCondition = tasksRunningCondition = NULL;
   
   free(tinfo);
 }
@@ -448,3 +643,142 @@ int numberOfCores()
 
   return sysconf(_SC_NPROCESSORS_ONLN);
 }
+
+// NUMA topology: cpus of each node with any (sysfs), or a single node with all cpus
+static vector< vector<int> > numaCpus;
+
+static void parseCpuList(const string &list, vector<int> &cpus)
+{
+  // e.g. "0-7,16-23"
+  std::istringstream ss(list);
+  string range;
+  
+  while (getline(ss, range, ',')) {
+    int a, b;
+    int n = sscanf(range.c_str(), "%d-%d", &a, &b);
+    
+    if (n == 1)
+      b = a;
+    for (int c = a; n >= 1 && c <= b; c++)
+      cpus.push_back(c);
+  }
+}
+
+int numaNodes()
+{
+  if (!numaCpus.empty())
+    return numaCpus.size();
+  
+  for (int node = 0; node < 1024; node++) {
+    std::ifstream f(("/sys/devices/system/node/node" + toStr(node) + "/cpulist").c_str());
+    if (!f)
+      continue;
+    
+    string list;
+    vector<int> cpus;
+    getline(f, list);
+    parseCpuList(list, cpus);
+    
+    if (!cpus.empty())
+      numaCpus.push_back(cpus);
+  }
+  
+  if (numaCpus.empty()) {
+    numaCpus.resize(1);
+    for (int c = 0; c < sysconf(_SC_NPROCESSORS_ONLN); c++)
+      numaCpus[0].push_back(c);
+  }
+  
+  return numaCpus.size();
+}
+
+int numaNodeOfThread(int threadNum)
+{
+  return threadNum % numaNodes();
+}
+
+// number of workers on a node, and the worker of a node with this index
+static int numaNodeThreads(int node)
+{
+  return (numberOfCores() - node + numaNodes() - 1) / numaNodes();
+}
+
+static void pinWorker(int threadNum)
+{
+  const vector<int> &cpus = numaCpus[numaNodeOfThread(threadNum)];
+  int cpu = cpus[ (threadNum / numaNodes()) % cpus.size() ];
+  
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  
+  int err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+  if (err != 0)
+    cout << "WARNING: Could not pin thread [" << threadNum << "] to cpu [" << cpu << "] (" << err << ")." << endl;
+    
+  IF_DEBUG(cout << "pinWorker:: thread [" << threadNum << "] node [" << numaNodeOfThread(threadNum) 
+                << "] cpu [" << cpu << "]" << endl);
+}
+
+// NumaPlacement: copy back the pages of one staging window, each by the worker owning it (first touch)
+struct NumaPlacement {
+  NumaPlacement(size_t ps, bool il) : mem(NULL), staging(NULL), pageSize(ps), firstPage(0), nPages(0), 
+                                      interleave(il) { }
+  
+  int owner(size_t k) const {
+    if (!interleave)
+      return (int)(k * numberOfCores() / nPages); // contiguous share of the window
+    
+    size_t g = firstPage + k; // pages round robin over the nodes, and over the workers of each
+    int node = g % numaNodes();
+    return node + (int)((g / numaNodes()) % numaNodeThreads(node)) * numaNodes();
+  }
+  
+  void operator()(int threadNum) {
+    for (size_t k = 0; k < nPages; k++)
+      if (owner(k) == threadNum)
+        memcpy(mem + k * pageSize, staging + k * pageSize, pageSize);
+  }
+  
+  char *mem;
+  const char *staging;
+  size_t pageSize, firstPage, nPages;
+  bool interleave;
+};
+
+// numaPlacement: move the (whole) pages of [p,p+bytes) to the nodes of the workers, either each worker
+// a contiguous part (first touch) or page by page round robin over the nodes (interleave). the array
+// stays in place with its contents: each window is staged, its pages dropped and then touched again
+// by their new owners
+void numaPlaceMemory(void *p, size_t bytes, bool interleave)
+{
+  if (Config.numaPlacement == "none" || !p || numberOfCores() == 1 || numaNodes() == 1)
+    return;
+    
+  size_t pageSize = sysconf(_SC_PAGESIZE);
+  char *begin = (char *)(((uintptr_t)p + pageSize - 1) & ~(uintptr_t)(pageSize - 1));
+  char *end   = (char *)(((uintptr_t)p + bytes) & ~(uintptr_t)(pageSize - 1));
+  
+  if (end <= begin)
+    return;
+    
+  size_t window = min((size_t)(end - begin), max((size_t)NUMA_STAGING_SIZE / pageSize, (size_t)1) * pageSize);
+  vector<char> staging(window);
+  
+  NumaPlacement place(pageSize, interleave);
+  place.staging = &staging[0];
+  
+  for (char *w = begin; w < end; w += window) {
+    size_t len = min(window, (size_t)(end - w));
+    memcpy(&staging[0], w, len);
+    
+    if (madvise(w, len, MADV_DONTNEED) != 0)
+      continue; // pages kept where they are
+    
+    place.mem = w;
+    place.firstPage = (w - begin) / pageSize;
+    place.nPages = len / pageSize;
+    
+    parallelForThreads(place);
+  }
+}
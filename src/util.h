@@ -8,7 +8,7 @@
 
 #include "ArepoRT.h"
 #include <pthread.h>
-#include <semaphore.h>
+#include <sched.h>
 
 // timing
 
@@ -66,6 +66,14 @@ public:
   }
   uint32_t uSize() const { return uRes; }
   uint32_t vSize() const { return vRes; }
+  void Clear()
+  {
+    uint32_t nAlloc = RoundUp(uRes) * RoundUp(vRes);
+    for (uint32_t i = 0; i < nAlloc; ++i)
+      data[i] = T();
+  }
+  T *Data() { return data; }
+  size_t Bytes() const { return (size_t)RoundUp(uRes) * RoundUp(vRes) * sizeof(T); }
   ~BlockedArray()
   {
     for (uint32_t i = 0; i < uRes * vRes; ++i)
@@ -165,22 +173,16 @@ private:
   MutexLock &operator=(const MutexLock &);
 };
 
-class Semaphore
+// atomic operations (return the new and the previous value, respectively)
+inline int32_t AtomicAdd(volatile int32_t *v, int32_t delta)
 {
-public:
-  // construction
-  Semaphore();
-  ~Semaphore();
-  
-  // methods
-  void Post(int count = 1);
-  void Wait();
-  bool TryWait();
-private:
-  // semaphore and counter
-  sem_t *sem;
-  static int count;
-};
+  return __sync_add_and_fetch(v, delta);
+}
+
+inline int32_t AtomicCompareAndSwap(volatile int32_t *v, int32_t newValue, int32_t oldValue)
+{
+  return __sync_val_compare_and_swap(v, oldValue, newValue);
+}
 
 
 class ConditionVariable
@@ -195,6 +197,7 @@ public:
   void Unlock();
   void Wait();
   void Signal();
+  void Broadcast();
 private:
   // pthread objects
   pthread_mutex_t mutex;
@@ -214,7 +217,85 @@ void TasksCleanup();
 
 void startTasks(const vector<Task *> &tasks);
 void waitUntilAllTasksDone();
+bool allTasksDone();
+
+// work stealing: a running task may split off part of its remaining work for idle workers
+bool shouldSplitTask(int threadNum);
+void spawnTask(Task *task, int threadNum);
 
 int numberOfCores();
 
+// NUMA (numaPlacement): workers are pinned round robin over the nodes
+int numaNodes();
+int numaNodeOfThread(int threadNum);
+void numaPlaceMemory(void *p, size_t bytes, bool interleave);
+
+// parallel loop over [0,n) on the task pool: func(i0,i1,threadNum) is called once per chunk
+template <class Func> class RangeTask : public Task
+{
+public:
+  RangeTask(Func *f, int i0, int i1) : func(f), start(i0), end(i1) { }
+  void Run(int threadNum) { (*func)(start, end, threadNum); }
+  
+private:
+  Func *func;
+  int start, end;
+};
+
+template <class Func> void parallelFor(int n, Func &func, int minChunk = 1024)
+{
+  if (n <= 0)
+    return;
+    
+  int nChunks = TASK_MULT_FACT * numberOfCores();
+  if (nChunks > n / minChunk)
+    nChunks = max(1, n / minChunk);
+  
+  vector<Task *> tasks;
+  for (int i = 0; i < nChunks; i++)
+    tasks.push_back(new RangeTask<Func>(&func, (int)((long long)n * i / nChunks), 
+                                               (int)((long long)n * (i+1) / nChunks)));
+  
+  startTasks(tasks);
+  waitUntilAllTasksDone();
+  
+  for (unsigned int i = 0; i < tasks.size(); i++)
+    delete tasks[i];
+}
+
+// one task per worker, each waiting until all have started, such that every worker takes exactly one
+template <class Func> class RendezvousTask : public Task
+{
+public:
+  RendezvousTask(Func *f, volatile int32_t *a, int n) : func(f), arrived(a), count(n) { }
+  void Run(int threadNum) {
+    AtomicAdd(arrived, 1);
+    while (*arrived < count)
+      sched_yield();
+    (*func)(threadNum);
+  }
+  
+private:
+  Func *func;
+  volatile int32_t *arrived;
+  int count;
+};
+
+// func(threadNum) is called once on every worker (e.g. first touch of memory by its owner)
+template <class Func> void parallelForThreads(Func &func)
+{
+  int nThreads = numberOfCores();
+  volatile int32_t arrived = 0;
+  
+  vector<Task *> tasks;
+  for (int i = 0; i < nThreads; i++)
+    tasks.push_back(new RendezvousTask<Func>(&func, &arrived, nThreads));
+  
+  startTasks(tasks);
+  waitUntilAllTasksDone();
+  
+  for (unsigned int i = 0; i < tasks.size(); i++)
+    delete tasks[i];
+}
+
 #endif
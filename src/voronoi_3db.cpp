@@ -19,6 +19,135 @@ const int edge_end[6] = { 1, 2, 3, 2, 3, 3 };
 const int edge_opposite[6] = { 3, 1, 2, 3, 0, 1 };
 const int edge_nexttetra[6] = { 2, 3, 1, 0, 2, 0 };
  
+/* auxiliary mesh arena: plain malloc/realloc (thread safe, unlike the Arepo memory manager), such
+ * that each thread allocates (first touch) and grows its own aux mesh, kept for the whole run
+ */
+void alloc_auxmesh(tessellation * T, int maxNdp, int maxNdt)
+{
+  point *p;
+  int i;
+  
+  T->MaxNdp = maxNdp;
+  T->MaxNdt = maxNdt;
+  T->MaxNvf = 0;
+  
+  T->Indi.AllocFacNdp = maxNdp;
+  T->Indi.AllocFacNdt = maxNdt;
+  T->Indi.AllocFacNvf = 0;
+  
+  T->VF  = NULL; // voronoi faces are never constructed for aux meshes
+  T->DP  = (point *)malloc((T->MaxNdp + 5) * sizeof(point));
+  T->DT  = (tetra *)malloc(T->MaxNdt * sizeof(tetra));
+  T->DTC = (tetra_center *)malloc(T->MaxNdt * sizeof(tetra_center));
+  T->DTF = (char *)malloc(T->MaxNdt * sizeof(char));
+  
+  if(!T->DP || !T->DT || !T->DTC || !T->DTF)
+    terminate("AuxMesh allocation failed (MaxNdp = %d MaxNdt = %d).", T->MaxNdp, T->MaxNdt);
+  
+  T->DP += 5; // leave first five for bounding tetra + infinity
+  
+  /* points of the all encompassing huge tetrahedron */
+  point *DP = T->DP;
+  
+  double box = All.BoxSize;
+  double tetra_incircle, tetra_sidelength, tetra_height, tetra_face_height;
+  
+  tetra_incircle = 1.5 * box;
+  tetra_sidelength = tetra_incircle * sqrt(24);
+  tetra_height = sqrt(2.0 / 3) * tetra_sidelength;
+  tetra_face_height = sqrt(3.0) / 2.0 * tetra_sidelength;
+  
+  DP[-4].x = 0.5 * tetra_sidelength;
+  DP[-4].y = -1.0 / 3 * tetra_face_height;
+  DP[-4].z = -0.25 * tetra_height;
+
+  DP[-3].x = 0;
+  DP[-3].y = 2.0 / 3 * tetra_face_height;
+  DP[-3].z = -0.25 * tetra_height;
+
+  DP[-2].x = -0.5 * tetra_sidelength;
+  DP[-2].y = -1.0 / 3 * tetra_face_height;
+  DP[-2].z = -0.25 * tetra_height;
+
+  DP[-1].x = 0;
+  DP[-1].y = 0;
+  DP[-1].z = 0.75 * tetra_height;
+
+  for(i = -4; i <= -1; i++)
+    {
+      DP[i].x += 0.5 * box;
+      DP[i].y += 0.5 * box;
+      DP[i].z += 0.5 * box;
+    }
+
+  for(i = -4, p = &DP[-4]; i < 0; i++, p++)
+    {
+      p->index = -1;
+      p->task = ThisTask;
+      p->timebin = 0;
+    }
+
+  /* we also define a neutral element at infinity */
+  DP[DPinfinity].x = GSL_POSINF;
+  DP[DPinfinity].y = GSL_POSINF;
+  DP[DPinfinity].z = GSL_POSINF;
+  DP[DPinfinity].index = -1;
+  DP[DPinfinity].task = ThisTask;
+  DP[DPinfinity].timebin = 0;
+  
+  init_clear_auxmesh(T);
+}
+
+void grow_auxmesh_points(tessellation * T)
+{
+  T->MaxNdp *= AUXMESH_GROW_FAC;
+  T->Indi.AllocFacNdp = T->MaxNdp;
+  
+  point *DP = (point *)realloc(T->DP - 5, (T->MaxNdp + 5) * sizeof(point));
+  
+  if(!DP)
+    terminate("AuxMesh growth failed (MaxNdp = %d).", T->MaxNdp);
+  
+  T->DP = DP + 5;
+}
+
+/* called from within insert_point_new() as soon as Ndt > MaxNdt, i.e. all new tetras are
+ * still unwritten, callers must not keep pointers into DT/DTC/DTF across insertions
+ */
+void grow_auxmesh_tetras(tessellation * T)
+{
+  while(T->Ndt > T->MaxNdt)
+    T->MaxNdt *= AUXMESH_GROW_FAC;
+  T->Indi.AllocFacNdt = T->MaxNdt;
+  
+  tetra *DT = (tetra *)realloc(T->DT, T->MaxNdt * sizeof(tetra));
+  tetra_center *DTC = (tetra_center *)realloc(T->DTC, T->MaxNdt * sizeof(tetra_center));
+  char *DTF = (char *)realloc(T->DTF, T->MaxNdt * sizeof(char));
+  
+  if(!DT || !DTC || !DTF)
+    terminate("AuxMesh growth failed (MaxNdt = %d).", T->MaxNdt);
+  
+  T->DT  = DT;
+  T->DTC = DTC;
+  T->DTF = DTF;
+}
+
+void free_auxmesh(tessellation * T)
+{
+  if(!T->DT)
+    return;
+  
+  free(T->DTF);
+  free(T->DTC);
+  free(T->DT);
+  free(T->DP - 5);
+  
+  T->DTF = NULL;
+  T->DTC = NULL;
+  T->DT  = NULL;
+  T->DP  = NULL;
+}
+
 void init_clear_auxmesh(tessellation * T)
 {
   //point *p;
@@ -119,7 +248,7 @@ int insert_point_new(tessellation * T, int pp, int ttstart) /* returns a tetra t
       tt3 = T->Ndt++;
 
     if(T->Ndt > T->MaxNdt)
-      terminate("Ndt > MaxNdt");
+      grow_auxmesh_tetras(T);
 
     make_a_1_to_4_flip(T, pp, tt0, tt1, tt2, tt3);
 
@@ -165,7 +294,7 @@ int insert_point_new(tessellation * T, int pp, int ttstart) /* returns a tetra t
       tt4 = T->Ndt++;
 
     if(T->Ndt > T->MaxNdt)
-      terminate("Ndt > MaxNdt");
+      grow_auxmesh_tetras(T);
 
     n_faces_to_check = 0;
 
@@ -252,7 +381,7 @@ int insert_point_new(tessellation * T, int pp, int ttstart) /* returns a tetra t
         ttlist[i] = T->Ndt++;
 
         if(T->Ndt > T->MaxNdt)
-          terminate("Ndt > MaxNdt");
+          grow_auxmesh_tetras(T);
       }
 
       to_check[n_faces_to_check++] = ttlist[i];
@@ -318,7 +447,7 @@ int insert_point_new(tessellation * T, int pp, int ttstart) /* returns a tetra t
             ww = T->Ndt++;
 
           if(T->Ndt > T->MaxNdt)
-            terminate("Ndt > MaxNdt");
+            grow_auxmesh_tetras(T);
 
           if(n_faces_to_check >= STACKSIZE_TETRA - 3)
             terminate("stacksize exceeded");
@@ -556,6 +685,41 @@ void compute_auxmesh_volumes(tessellation *T, double *vol)
   }
 }
 
+// as compute_auxmesh_volumes, but only the cells flagged in inStar are computed (other vol[] are not valid)
+void compute_auxmesh_volumes_star(tessellation *T, double *vol, const unsigned char *inStar)
+{
+  int i, nr, p1, p2;
+
+  for(i = 0; i < T->Ndp; i++)
+    vol[i] = 0;
+
+  unsigned char *visited_edges = (unsigned char *)alloca(sizeof(unsigned char) * T->Ndt);
+
+  for(i = 0; i < T->Ndt; i++)
+    visited_edges[i] = 0;
+
+  for(i = 0; i < T->Ndt; i++)
+  {
+    if(T->DT[i].t[0] < 0)      /* deleted ? */
+      continue;
+
+    for(nr = 0; nr < 6; nr++)
+    {
+      if(visited_edges[i] & (1 << nr))
+        continue;
+
+      /* only edges (voronoi faces) of cells in the star contribute */
+      p1 = T->DT[i].p[edge_start[nr]];
+      p2 = T->DT[i].p[edge_end[nr]];
+
+      if((p1 < 0 || !inStar[p1]) && (p2 < 0 || !inStar[p2]))
+        continue;
+
+      derefine_refine_process_edge_new(T, vol, i, nr, visited_edges);
+    }
+  }
+}
+
 void derefine_refine_process_edge_new(tessellation * T, double *vol, int tt, int nr, unsigned char *visited_edges)
 {
   tetra *DT = T->DT;
@@ -680,30 +844,15 @@ void derefine_refine_process_edge_new(tessellation * T, double *vol, int tt, int
     are in the same octant. */
 void periodic_wrap_point(double pos[3], double ref[3])
 {
-  double dx, dy, dz;
-
-  dx = pos[0] - ref[0];
-  dy = pos[1] - ref[1];
-  dz = pos[2] - ref[2];
-
-  if(dx > boxHalf_X)
-    pos[0] -= boxSize_X;
-  if(dx < -boxHalf_X)
-    pos[0] += boxSize_X;
-  if(dy > boxHalf_Y)
-    pos[1] -= boxSize_Y;
-  if(dy < -boxHalf_Y)
-    pos[1] += boxSize_Y;
-  if(dz > boxHalf_Z)
-    pos[2] -= boxSize_Z;
-  if(dz < -boxHalf_Z)
-    pos[2] += boxSize_Z;
+  PeriodicBox<double> box;
+  box.nearestImage(pos, ref);
 }
 
 
 int find_next_cell_DC(tessellation * T, int cell, double p0[3], double dir[3], int previous, double *length)
 {
   point *DP = T->DP;
+  PeriodicBox<double> box;
   
   double cell_p[3];
   cell_p[0] = P[cell].Pos[0];
@@ -711,7 +860,7 @@ int find_next_cell_DC(tessellation * T, int cell, double p0[3], double dir[3], i
   cell_p[2] = P[cell].Pos[2];
 
   // if mesh point is across the boundary, wrap it
-  periodic_wrap_point(cell_p, p0);
+  box.nearestImage(cell_p, p0);
 
   double nb_p[3];
   double m[3];
@@ -750,7 +899,7 @@ int find_next_cell_DC(tessellation * T, int cell, double p0[3], double dir[3], i
     nb_p[1] = DP[neighbor].y;
     nb_p[2] = DP[neighbor].z;
     // if neighbor is across the boundary, wrap it
-    periodic_wrap_point(nb_p, p0);
+    box.nearestImage(nb_p, p0);
 
     int i;
     for(i = 0; i < 3; ++i)
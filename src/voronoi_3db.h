@@ -70,11 +70,17 @@ extern "C" {
 
 //#include "../arepo/src/main/allvars.h"
 #include "allvars.h"
+#include "periodic.h"
 
+void alloc_auxmesh(tessellation * T, int maxNdp, int maxNdt);
+void grow_auxmesh_points(tessellation * T);
+void grow_auxmesh_tetras(tessellation * T);
+void free_auxmesh(tessellation * T);
 void init_clear_auxmesh(tessellation * T);
 int insert_point_new(tessellation * T, int pp, int ttstart);
 void make_an_edge_split_new(tessellation * T, int tt0, int edge_nr, int count, int pp, int *ttlist);
 void compute_auxmesh_volumes(tessellation *T, double *vol);
+void compute_auxmesh_volumes_star(tessellation *T, double *vol, const unsigned char *inStar);
 void derefine_refine_process_edge_new(tessellation * T, double *vol, int tt, int nr, unsigned char *visited_edges);
 
 // for DC connectivity